@@ -0,0 +1,431 @@
+#ifndef INC_4_FUNCTIONS_ARCHIVE_HPP
+#define INC_4_FUNCTIONS_ARCHIVE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "Function.hpp"
+#include "Grammar.hpp"
+#include "MappedFile.hpp"
+#include "Program.hpp"
+
+using std::string;
+
+
+// Compiled functions in a versioned binary image. Every reference inside
+// the image is a byte offset from its start, so the file can be mapped
+// anywhere. Operators are stored by kind and name and resolved against the
+// grammar when the image is loaded; nothing is parsed or optimized again.
+//
+//   Header
+//   Entry[functions]            name, sources, calls, and the program
+//   Reference[...]              parameter, call, dependency and symbol names
+//   Code[...]                   instructions, operators by symbol index
+//   char[...]                   string pool
+class Archive
+{
+public:
+    static constexpr uint32_t Version = 3;
+    // Version 2 added dependencies and version 3 conditionals and min/max;
+    // older images still load.
+    static constexpr uint32_t OldestVersion = 1;
+    static constexpr char Magic[8] = {'F', 'N', 'I', 'M', 'A', 'G', 'E', 0};
+
+private:
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t order;
+        uint64_t functions;
+    };
+
+    struct Text
+    {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    // A run of records of one kind.
+    struct Range
+    {
+        uint64_t offset;
+        uint64_t count;
+    };
+
+    struct Reference
+    {
+        Text name;
+        uint32_t type;
+        uint32_t reserved;
+    };
+
+    struct Code
+    {
+        uint8_t code;
+        uint8_t reserved[3];
+        uint32_t symbol;
+        uint64_t payload;
+    };
+
+    struct Entry
+    {
+        Text name;
+        Text infix;
+        Text postfix;
+        Range parameters;
+        Range calls;
+        Range dependencies;
+        Range symbols;
+        Range instructions;
+        uint64_t depth;
+        uint64_t registers;
+    };
+
+    // An entry of version 1, which had no dependencies.
+    struct EntryVersion1
+    {
+        Text name;
+        Text infix;
+        Text postfix;
+        Range parameters;
+        Range calls;
+        Range symbols;
+        Range instructions;
+        uint64_t depth;
+        uint64_t registers;
+    };
+
+    static constexpr uint32_t Order = 0x01020304;
+
+public:
+    static void save(const string& path, const Function::Library& functions)
+    {
+        std::vector<Entry> entries;
+        std::vector<Reference> references;
+        std::vector<Code> code;
+        string pool;
+
+        auto text = [&](const string& value)
+        {
+            Text result {pool.size(), value.size()};
+            pool += value;
+            return result;
+        };
+        auto names = [&](const std::vector<string>& values, const TokenType type)
+        {
+            Range range {references.size(), values.size()};
+            for (const string& value: values)
+                references.push_back(Reference {text(value), type, 0});
+            return range;
+        };
+
+        for (const auto& [name, function]: functions)
+        {
+            const Program& program = function.program();
+            Entry entry {};
+            entry.name = text(name);
+            entry.infix = text(function.infix());
+            entry.postfix = text(function.postfix());
+            entry.parameters = names(program.parameters, TT_ARGUMENT);
+            entry.calls = names(function.calls(), TT_CALL);
+            entry.dependencies = Range {references.size(), function.dependencies().size()};
+            for (const Grammar::Name& dependency: function.dependencies())
+                references.push_back(Reference {text(dependency.name), dependency.kind, 0});
+            entry.symbols = Range {references.size(), program.symbols.size()};
+            for (const Symbol& symbol: program.symbols)
+                references.push_back(Reference {text(symbol.name), symbol.type, 0});
+            entry.instructions = Range {code.size(), program.instructions.size()};
+            for (const Instruction& instruction: program.instructions)
+            {
+                Code record {instruction.code, {}, 0, 0};
+                switch (instruction.code)
+                {
+                    case OP_CONSTANT:
+                        std::memcpy(&record.payload, &instruction.value, sizeof record.payload);
+                        break;
+                    case OP_ARGUMENT:
+                    case OP_STORE:
+                    case OP_LOAD:
+                    case OP_BRANCH:
+                    case OP_JUMP:
+                        record.payload = instruction.slot;
+                        break;
+                    case OP_UNARY:
+                    case OP_BINARY:
+                        record.symbol = instruction.symbol;
+                        break;
+                    default:
+                        break;
+                }
+                code.push_back(record);
+            }
+            entry.depth = program.depth;
+            entry.registers = program.registers;
+            entries.push_back(entry);
+        }
+
+        // Turn indices into offsets now that the layout is known.
+        const uint64_t referencesStart = sizeof(Header) + entries.size() * sizeof(Entry);
+        const uint64_t codeStart = referencesStart + references.size() * sizeof(Reference);
+        const uint64_t poolStart = codeStart + code.size() * sizeof(Code);
+        auto relocate = [&](Text& text) { text.offset += poolStart; };
+        for (Entry& entry: entries)
+        {
+            relocate(entry.name);
+            relocate(entry.infix);
+            relocate(entry.postfix);
+            for (Range* range: {&entry.parameters, &entry.calls, &entry.dependencies, &entry.symbols})
+                range->offset = referencesStart + range->offset * sizeof(Reference);
+            entry.instructions.offset = codeStart + entry.instructions.offset * sizeof(Code);
+        }
+        for (Reference& reference: references)
+            relocate(reference.name);
+
+        Header header {};
+        std::memcpy(header.magic, Magic, sizeof Magic);
+        header.version = Version;
+        header.order = Order;
+        header.functions = entries.size();
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(&header), sizeof header);
+        file.write(reinterpret_cast<const char*>(entries.data()), (std::streamsize) (entries.size() * sizeof(Entry)));
+        file.write(reinterpret_cast<const char*>(references.data()),
+                   (std::streamsize) (references.size() * sizeof(Reference)));
+        file.write(reinterpret_cast<const char*>(code.data()), (std::streamsize) (code.size() * sizeof(Code)));
+        file.write(pool.data(), (std::streamsize) pool.size());
+        if (!file)
+            throw std::system_error(errno, std::generic_category(), path);
+    }
+
+    // Loads every function of the image, or none of them if any record is
+    // malformed or refers to an operator the grammar does not have.
+    static Function::Library load(const string& path, const Grammar& grammar)
+    {
+        const MappedFile file(path);
+        const Header header = read<Header>(file, 0);
+        if (std::memcmp(header.magic, Magic, sizeof Magic) != 0)
+            throw std::logic_error("'" + path + "' is not a function archive");
+        if (header.version < OldestVersion || header.version > Version)
+            throw std::logic_error("Unsupported archive version " + std::to_string(header.version));
+        if (header.order != Order)
+            throw std::logic_error("The archive was written with a different byte order");
+
+        // Built first, as the dependencies of a version 1 function take in
+        // those of the functions it calls.
+        struct Loaded
+        {
+            string name;
+            Program program;
+            std::vector<string> calls;
+            std::vector<Grammar::Name> dependencies;
+            string infix;
+            string postfix;
+        };
+        std::vector<Loaded> loaded;
+        for (uint64_t i = 0; i < header.functions; ++i)
+        {
+            const Entry entry = header.version >= 2 ? read<Entry>(file, sizeof(Header) + i * sizeof(Entry))
+                                                    : upgrade(read<EntryVersion1>(
+                                                            file, sizeof(Header) + i * sizeof(EntryVersion1)));
+            Program program;
+            program.parameters = fetchAll(file, entry.parameters);
+            for (uint64_t k = 0; k < entry.symbols.count; ++k)
+            {
+                const auto reference = read<Reference>(file, entry.symbols.offset + k * sizeof(Reference));
+                program.symbols.push_back(resolve(grammar, (TokenType) reference.type, fetch(file, reference.name)));
+            }
+
+            // Every register is stored before it is loaded, and the sizes of
+            // the interpreter's workspace and the native frame follow from it.
+            check(entry.instructions.count <= file.size() / sizeof(Code));
+            check(entry.registers <= entry.instructions.count);
+            program.instructions.reserve(entry.instructions.count);
+            for (uint64_t k = 0; k < entry.instructions.count; ++k)
+            {
+                const auto record = read<Code>(file, entry.instructions.offset + k * sizeof(Code));
+                Instruction instruction {(OpCode) record.code};
+                switch (record.code)
+                {
+                    case OP_CONSTANT:
+                        std::memcpy(&instruction.value, &record.payload, sizeof record.payload);
+                        break;
+                    case OP_ARGUMENT:
+                        check(record.payload < program.parameters.size());
+                        instruction.slot = record.payload;
+                        break;
+                    case OP_STORE:
+                    case OP_LOAD:
+                        check(record.payload < entry.registers);
+                        instruction.slot = record.payload;
+                        break;
+                    case OP_UNARY:
+                        check(record.symbol < program.symbols.size() && program.symbols[record.symbol].unary.unary);
+                        instruction.symbol = record.symbol;
+                        instruction.unary = program.symbols[record.symbol].unary.unary;
+                        break;
+                    case OP_BINARY:
+                        check(record.symbol < program.symbols.size() && program.symbols[record.symbol].binary.binary);
+                        instruction.symbol = record.symbol;
+                        instruction.binary = program.symbols[record.symbol].binary.binary;
+                        break;
+                    case OP_BRANCH:
+                    case OP_JUMP:
+                        check(header.version >= 3 && record.payload < entry.instructions.count - k);
+                        instruction.slot = record.payload;
+                        break;
+                    case OP_MIN:
+                    case OP_MAX:
+                        check(header.version >= 3);
+                        break;
+                    case OP_FMA:
+                        break;
+                    default:
+                        check(false);
+                }
+                program.instructions.push_back(instruction);
+            }
+            program.registers = entry.registers;
+            program.measure();
+            check(program.depth == entry.depth);
+
+            std::vector<Grammar::Name> dependencies;
+            for (uint64_t k = 0; k < entry.dependencies.count; ++k)
+            {
+                const auto reference = read<Reference>(file, entry.dependencies.offset + k * sizeof(Reference));
+                check(reference.type <= Grammar::POSTFIX);
+                dependencies.push_back(Grammar::Name {(Grammar::Kind) reference.type, fetch(file, reference.name)});
+            }
+            if (header.version < 2)
+            {
+                // What the compiler records: the parameters and every operator.
+                for (const string& parameter: program.parameters)
+                    depend(dependencies, Grammar::Name {Grammar::CONSTANT, parameter});
+                for (const Symbol& symbol: program.symbols)
+                    depend(dependencies, Grammar::Name {symbol.kind(), symbol.name});
+            }
+
+            loaded.push_back(Loaded {fetch(file, entry.name), std::move(program), fetchAll(file, entry.calls),
+                                     std::move(dependencies), fetch(file, entry.infix), fetch(file, entry.postfix)});
+        }
+
+        // Calls were inlined, so a version 1 function also depends on what
+        // its callees in the image do, and on what theirs do.
+        std::map<string, size_t> index;
+        for (size_t i = 0; i < loaded.size(); ++i)
+            index.insert_or_assign(loaded[i].name, i);
+        for (bool changed = header.version < 2; changed;)
+        {
+            changed = false;
+            for (Loaded& function: loaded)
+            {
+                for (const string& call: function.calls)
+                {
+                    auto callee = index.find(call);
+                    if (callee == index.end())
+                        continue;
+                    for (const Grammar::Name& dependency: loaded[callee->second].dependencies)
+                        changed = depend(function.dependencies, dependency) || changed;
+                }
+            }
+        }
+
+        // Revisions are not comparable across grammars; the image counts as
+        // compiled against the grammar it is loaded with.
+        Function::Library functions;
+        for (Loaded& function: loaded)
+            functions.insert_or_assign(function.name, Function(std::move(function.program),
+                                                               std::move(function.infix),
+                                                               std::move(function.postfix),
+                                                               std::move(function.calls),
+                                                               std::move(function.dependencies),
+                                                               grammar.revision()));
+        return functions;
+    }
+
+private:
+    static Entry upgrade(const EntryVersion1& old)
+    {
+        return Entry {old.name, old.infix, old.postfix, old.parameters, old.calls, {}, old.symbols,
+                      old.instructions, old.depth, old.registers};
+    }
+
+    // Adds a dependency unless it is there already.
+    static bool depend(std::vector<Grammar::Name>& dependencies, const Grammar::Name& name)
+    {
+        if (std::find(dependencies.begin(), dependencies.end(), name) != dependencies.end())
+            return false;
+        dependencies.push_back(name);
+        return true;
+    }
+
+    static void check(const bool condition)
+    {
+        if (!condition)
+            throw std::logic_error("Corrupt function archive");
+    }
+
+    template<typename Record>
+    static Record read(const MappedFile& file, const uint64_t offset)
+    {
+        static_assert(std::is_trivially_copyable_v<Record>);
+        check(offset <= file.size() && sizeof(Record) <= file.size() - offset);
+        Record record;
+        std::memcpy(&record, file.data() + offset, sizeof record);
+        return record;
+    }
+
+    static string fetch(const MappedFile& file, const Text& text)
+    {
+        check(text.offset <= file.size() && text.length <= file.size() - text.offset);
+        return {file.data() + text.offset, text.length};
+    }
+
+    static std::vector<string> fetchAll(const MappedFile& file, const Range& range)
+    {
+        std::vector<string> result;
+        for (uint64_t k = 0; k < range.count; ++k)
+            result.push_back(fetch(file, read<Reference>(file, range.offset + k * sizeof(Reference)).name));
+        return result;
+    }
+
+    static Symbol resolve(const Grammar& grammar, const TokenType type, const string& name)
+    {
+        Symbol symbol {type, name, {}, {}};
+        bool found = false;
+        switch (type)
+        {
+            case TT_PREFIX:
+                found = grammar.prefix().contains(name);
+                if (found)
+                    symbol.unary = grammar.prefix().at(name);
+                break;
+            case TT_POSTFIX:
+                found = grammar.postfix().contains(name);
+                if (found)
+                    symbol.unary = grammar.postfix().at(name);
+                break;
+            case TT_BINARY:
+                found = grammar.binary().contains(name);
+                if (found)
+                    symbol.binary = grammar.binary().at(name);
+                break;
+            default:
+                break;
+        }
+        if (!found)
+            throw std::logic_error("The archive refers to operator '" + name + "' that the grammar does not have");
+        return symbol;
+    }
+};
+
+
+#endif //INC_4_FUNCTIONS_ARCHIVE_HPP
@@ -0,0 +1,86 @@
+#ifndef INC_4_FUNCTIONS_ARENA_HPP
+#define INC_4_FUNCTIONS_ARENA_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+
+
+// A bump allocator for short-lived data. Deallocation is a no-op; memory is
+// reclaimed all at once by reset(), which keeps it for the next use. When
+// more than one block was needed they are merged into a single one, so after
+// the first few uses of similar size the arena stops touching the heap.
+class Arena : public std::pmr::memory_resource
+{
+public:
+    static constexpr size_t InitialSize = 16 << 10;
+
+private:
+    struct Block
+    {
+        std::unique_ptr<std::byte[]> data;
+        size_t size;
+    };
+
+    std::vector<Block> _blocks;
+    size_t _used = 0;
+
+public:
+    explicit Arena(const size_t size = InitialSize)
+    {
+        _blocks.push_back(Block {std::make_unique_for_overwrite<std::byte[]>(size), size});
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void reset()
+    {
+        if (_blocks.size() > 1)
+        {
+            size_t total = 0;
+            for (const Block& block: _blocks)
+                total += block.size;
+            _blocks.clear();
+            _blocks.push_back(Block {std::make_unique_for_overwrite<std::byte[]>(total), total});
+        }
+        _used = 0;
+    }
+
+    [[nodiscard]] size_t capacity() const
+    {
+        size_t total = 0;
+        for (const Block& block: _blocks)
+            total += block.size;
+        return total;
+    }
+
+private:
+    void* do_allocate(const size_t bytes, const size_t alignment) override
+    {
+        Block& block = _blocks.back();
+        void* pointer = block.data.get() + _used;
+        size_t space = block.size - _used;
+        if (!std::align(alignment, bytes, pointer, space))
+        {
+            const size_t size = std::max(2 * block.size, bytes + alignment);
+            _blocks.push_back(Block {std::make_unique_for_overwrite<std::byte[]>(size), size});
+            _used = 0;
+            return do_allocate(bytes, alignment);
+        }
+        _used = static_cast<std::byte*>(pointer) - _blocks.back().data.get() + bytes;
+        return pointer;
+    }
+
+    void do_deallocate(void*, size_t, size_t) override {}
+
+    [[nodiscard]] bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+
+#endif //INC_4_FUNCTIONS_ARENA_HPP
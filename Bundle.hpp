@@ -0,0 +1,139 @@
+#ifndef INC_4_FUNCTIONS_BUNDLE_HPP
+#define INC_4_FUNCTIONS_BUNDLE_HPP
+
+#include <algorithm>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Function.hpp"
+#include "Graph.hpp"
+#include "Optimizer.hpp"
+#include "Program.hpp"
+
+using std::string;
+
+
+// Several functions evaluated together over one set of arguments. Their
+// bodies are merged into one graph, where common-subexpression elimination
+// shares what they compute alike, and emitted as one program with a segment
+// per function. A value needed by several segments is computed by the first
+// of them and kept in a register for the rest. Bundles are interpreted.
+class Bundle
+{
+private:
+    Program _program;
+    std::vector<size_t> _ends;
+
+public:
+    explicit Bundle(std::span<const Function* const> functions)
+    {
+        if (functions.empty())
+            throw std::logic_error("A bundle needs at least one function");
+
+        Graph graph;
+        std::vector<unsigned> roots;
+        std::vector<unsigned> arguments;
+        for (const Function* function: functions)
+        {
+            const Program& body = function->program();
+            arguments.clear();
+            for (const string& parameter: body.parameters)
+            {
+                Graph::Node node {{OP_ARGUMENT}};
+                node.instruction.slot = _program.bind(parameter);
+                arguments.push_back(graph.add(node));
+            }
+            roots.push_back(graph.splice(body, arguments, _program));
+        }
+        graph.roots(roots);
+        graph = Optimizer::eliminate(graph, _program);
+        graph.emit(_program, &_ends);
+    }
+
+    // The number of functions, and of results.
+    [[nodiscard]] size_t size() const
+    {
+        return _ends.size();
+    }
+
+    // The union of the functions' parameters.
+    [[nodiscard]] const std::vector<string>& parameters() const
+    {
+        return _program.parameters;
+    }
+
+    [[nodiscard]] const Program& program() const
+    {
+        return _program;
+    }
+
+    // Writes the result of every function, in the order they were given.
+    void evaluate(std::span<const double> args, std::span<double> out) const
+    {
+        if (args.size() < _program.parameters.size())
+            throw std::out_of_range("Not enough arguments");
+        if (out.size() < size())
+            throw std::out_of_range("Not enough room for the results");
+
+        const size_t size = _program.depth + _program.registers;
+        double buffer[Function::StackCapacity];
+        std::unique_ptr<double[]> heap;
+        double* stack = buffer;
+        if (size > Function::StackCapacity)
+        {
+            heap = std::make_unique<double[]>(size);
+            stack = heap.get();
+        }
+        double* registers = stack + _program.depth;
+
+        const std::span<const Instruction> code = _program.instructions;
+        size_t begin = 0;
+        for (size_t k = 0; k < _ends.size(); ++k)
+        {
+            out[k] = Function::run(code.subspan(begin, _ends[k] - begin), args.data(), stack, registers);
+            begin = _ends[k];
+        }
+    }
+
+    [[nodiscard]] std::vector<double> evaluate(const Function::Args& args) const
+    {
+        std::vector<double> values(_program.parameters.size());
+        for (size_t slot = 0; slot < values.size(); ++slot)
+            values[slot] = args.at(_program.parameters[slot]);
+        std::vector<double> results(size());
+        evaluate(values, results);
+        return results;
+    }
+
+    // Evaluates every function on n rows; out holds a column per function.
+    void evaluateBatch(std::span<const double* const> columns, const size_t n, std::span<double* const> out) const
+    {
+        if (columns.size() < _program.parameters.size())
+            throw std::out_of_range("Not enough argument columns");
+        if (out.size() < size())
+            throw std::out_of_range("Not enough result columns");
+
+        constexpr size_t BlockSize = Function::BlockSize;
+        Function::Workspace work(_program);
+
+        const std::span<const Instruction> code = _program.instructions;
+        for (size_t offset = 0; offset < n; offset += BlockSize)
+        {
+            const size_t m = std::min(BlockSize, n - offset);
+            size_t begin = 0;
+            for (size_t k = 0; k < _ends.size(); ++k)
+            {
+                const double* result = Function::run(code.subspan(begin, _ends[k] - begin), _program.symbols,
+                                                     columns, offset, m, work);
+                std::copy_n(result, m, out[k] + offset);
+                begin = _ends[k];
+            }
+        }
+    }
+};
+
+
+#endif //INC_4_FUNCTIONS_BUNDLE_HPP
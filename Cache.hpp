@@ -0,0 +1,98 @@
+#ifndef INC_4_FUNCTIONS_CACHE_HPP
+#define INC_4_FUNCTIONS_CACHE_HPP
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+
+template<typename Value>
+class Cache
+{
+private:
+    using Entry = std::pair<std::string, Value>;
+
+    size_t _capacity;
+    std::list<Entry> _entries;
+    std::unordered_map<std::string, typename std::list<Entry>::iterator> _index;
+    size_t _hits = 0;
+    size_t _misses = 0;
+
+public:
+    explicit Cache(const size_t capacity) : _capacity(capacity) {}
+
+    [[nodiscard]] size_t capacity() const
+    {
+        return _capacity;
+    }
+
+    void capacity(const size_t capacity)
+    {
+        _capacity = capacity;
+        evict();
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        return _entries.size();
+    }
+
+    [[nodiscard]] size_t hits() const
+    {
+        return _hits;
+    }
+
+    [[nodiscard]] size_t misses() const
+    {
+        return _misses;
+    }
+
+    const Value* find(const std::string& key)
+    {
+        auto lookup = _index.find(key);
+        if (lookup == _index.end())
+        {
+            ++_misses;
+            return nullptr;
+        }
+        ++_hits;
+        _entries.splice(_entries.begin(), _entries, lookup->second);
+        return &lookup->second->second;
+    }
+
+    const Value& insert(const std::string& key, Value value)
+    {
+        auto lookup = _index.find(key);
+        if (lookup != _index.end())
+        {
+            lookup->second->second = std::move(value);
+            _entries.splice(_entries.begin(), _entries, lookup->second);
+            return lookup->second->second;
+        }
+        _entries.emplace_front(key, std::move(value));
+        _index.emplace(key, _entries.begin());
+        const Value& inserted = _entries.front().second;
+        evict();
+        return inserted;
+    }
+
+    void clear()
+    {
+        _entries.clear();
+        _index.clear();
+    }
+
+private:
+    void evict()
+    {
+        while (_entries.size() > _capacity && !_entries.empty())
+        {
+            _index.erase(_entries.back().first);
+            _entries.pop_back();
+        }
+    }
+};
+
+
+#endif //INC_4_FUNCTIONS_CACHE_HPP
@@ -4,10 +4,19 @@
 
 #include <regex>
 #include <functional>
+#include <future>
+#include <optional>
+#include <set>
 
+#include "Archive.hpp"
+#include "Bundle.hpp"
+#include "Cache.hpp"
 #include "Grammar.hpp"
 #include "Compiler.hpp"
 #include "Function.hpp"
+#include "Grid.hpp"
+#include "Operators.hpp"
+#include "Stream.hpp"
 
 
 using std::map;
@@ -25,78 +34,112 @@ using std::regex_match;
 class Calculator
 {
 private:
+    // A saved function recompiled on another thread, or why it failed.
+    struct Update
+    {
+        string name;
+        string infix;
+        std::optional<Function> function;
+        string error;
+        // The grammar revision it was compiled against.
+        size_t revision;
+    };
+
     Grammar _grammar;
     Compiler* _compiler;
-    map<string, Function> _functions;
+    Cache<Function> _cache;
+    size_t _cacheRevision;
+    Function::Library _functions;
     map<string, std::function<void()>> _commands;
     const regex _argsPattern;
+    // Whether a grammar change recompiles the affected functions right away
+    // in the background, or each one when it is next used.
+    bool _eager = false;
+    std::vector<std::future<std::vector<Update>>> _updates;
+    // The grammar revision at which a saved function last failed to
+    // recompile; it is not tried again until the grammar changes.
+    map<string, size_t> _failures;
 
-    static void setupGrammar(Grammar& grammar)
+public:
+    // The stock operators, in whatever type the grammar computes in.
+    template<typename Value>
+    static void setupGrammar(BasicGrammar<Value>& grammar)
     {
         grammar.addConstant("pi", M_PI);
         grammar.addConstant("e", M_E);
 
-        grammar.addPrefixOperator("-",
-                                  [](const double x) -> double
-                                  { return -x; });
-        grammar.addPrefixOperator("exp",
-                                  [](const double x) -> double
-                                  { return std::exp(x); });
-        grammar.addPrefixOperator("sin",
-                                  [](const double x) -> double
-                                  { return std::sin(x); });
-        grammar.addPrefixOperator("cos",
-                                  [](const double x) -> double
-                                  { return std::cos(x); });
-        grammar.addPrefixOperator("floor",
-                                  [](const double x) -> double
-                                  { return std::floor(x); });
-        grammar.addPrefixOperator("ceil",
-                                  [](const double x) -> double
-                                  { return std::ceil(x); });
-        grammar.addPrefixOperator("round",
-                                  [](const double x) -> double
-                                  { return std::round(x); });
-
-        grammar.addBinaryOperator("+",
-                                  [](const double a, const double b) -> double
-                                  { return a + b; }, 1);
-        grammar.addBinaryOperator("-",
-                                  [](const double a, const double b) -> double
-                                  { return a - b; }, 1);
-        grammar.addBinaryOperator("*",
-                                  [](const double a, const double b) -> double
-                                  { return a * b; }, 2);
-        grammar.addBinaryOperator("/",
-                                  [](const double a, const double b) -> double
-                                  { return a / b; }, 2);
-        grammar.addBinaryOperator("^", pow, 3);
-
-        grammar.addPostfixOperator("!", [](const double x) -> double
-        {
-            auto n = (size_t) x;
-            size_t result = 1;
-            while (n > 1)
-            {
-                result *= n--;
-            }
-            return (double) result;
-        });
+        grammar.addPrefixOperator("-", operators::negate<Value>, kernels::negate<Value>, derivatives::negate<Value>);
+        grammar.addPrefixOperator("exp", operators::exp<Value>, nullptr, derivatives::exp<Value>);
+        grammar.addPrefixOperator("sin", operators::sin<Value>, nullptr, derivatives::sin<Value>);
+        grammar.addPrefixOperator("cos", operators::cos<Value>, nullptr, derivatives::cos<Value>);
+        grammar.addPrefixOperator("floor", operators::floor<Value>, kernels::floor<Value>, derivatives::zero<Value>);
+        grammar.addPrefixOperator("ceil", operators::ceil<Value>, kernels::ceil<Value>, derivatives::zero<Value>);
+        grammar.addPrefixOperator("round", operators::round<Value>, kernels::round<Value>, derivatives::zero<Value>);
+
+        grammar.addBinaryOperator("+", operators::add<Value>, 1, kernels::add<Value>,
+                                  derivatives::one<Value>, derivatives::one<Value>);
+        grammar.addBinaryOperator("-", operators::subtract<Value>, 1, kernels::subtract<Value>,
+                                  derivatives::one<Value>, derivatives::minusOne<Value>);
+        grammar.addBinaryOperator("*", operators::multiply<Value>, 2, kernels::multiply<Value>,
+                                  derivatives::multiplyLeft<Value>, derivatives::multiplyRight<Value>);
+        grammar.addBinaryOperator("/", operators::divide<Value>, 2, kernels::divide<Value>,
+                                  derivatives::divideLeft<Value>, derivatives::divideRight<Value>);
+        grammar.addBinaryOperator("^", {.binary = operators::power<Value>,
+                                        .precedence = 3,
+                                        .rightAssociative = true,
+                                        .leftDerivative = derivatives::powerLeft<Value>,
+                                        .rightDerivative = derivatives::powerRight<Value>});
+        // Below every arithmetic operator: a + b < c means (a + b) < c.
+        grammar.addBinaryOperator("<", operators::less<Value>, 0,
+                                  kernels::elementwise<Value, operators::less<Value>>,
+                                  derivatives::zero<Value>, derivatives::zero<Value>);
+        grammar.addBinaryOperator("<=", operators::lessEqual<Value>, 0,
+                                  kernels::elementwise<Value, operators::lessEqual<Value>>,
+                                  derivatives::zero<Value>, derivatives::zero<Value>);
+        grammar.addBinaryOperator(">", operators::greater<Value>, 0,
+                                  kernels::elementwise<Value, operators::greater<Value>>,
+                                  derivatives::zero<Value>, derivatives::zero<Value>);
+        grammar.addBinaryOperator(">=", operators::greaterEqual<Value>, 0,
+                                  kernels::elementwise<Value, operators::greaterEqual<Value>>,
+                                  derivatives::zero<Value>, derivatives::zero<Value>);
+        grammar.addBinaryOperator("==", operators::equal<Value>, 0,
+                                  kernels::elementwise<Value, operators::equal<Value>>,
+                                  derivatives::zero<Value>, derivatives::zero<Value>);
+        grammar.addBinaryOperator("!=", operators::notEqual<Value>, 0,
+                                  kernels::elementwise<Value, operators::notEqual<Value>>,
+                                  derivatives::zero<Value>, derivatives::zero<Value>);
+
+        grammar.addPostfixOperator("!", operators::factorial<Value>, nullptr, derivatives::zero<Value>);
     }
 
-public:
-    Calculator() : _argsPattern("(?:([a-zA-Z_]+)=([\\-0-9.]+)*)")
+    static constexpr size_t CacheCapacity = 256;
+
+    Calculator() : _cache(CacheCapacity), _argsPattern("(?:([a-zA-Z_]+)=(?!=)([\\-0-9.]+)*)")
     {
         setupGrammar(_grammar);
         _compiler = new Compiler(_grammar);
+        _compiler->link(&_functions);
+        _cacheRevision = _grammar.revision();
         _commands["save"] = [&](){save();};
         _commands["eval"] = [&](){ eval();};
         _commands["evals"] = [&](){ evalSaved();};
+        _commands["evals-many"] = [&](){ evalMany();};
+        _commands["gradient"] = [&](){gradient();};
+        _commands["stream"] = [&](){stream();};
+        _commands["grid"] = [&](){grid();};
+        _commands["stats"] = [&](){stats();};
+        _commands["save-all"] = [&](){saveAll();};
+        _commands["load-all"] = [&](){loadAll();};
         _commands["show"] = [&](){show();};
         _commands["list-saved"] = [&](){listSaved();};
         _commands["delete"] = [&](){deleteSaved();};
         _commands["clear"] = [&](){clear();};
         _commands["grammar"] = [&](){grammar();};
+        _commands["optimize"] = [&](){optimize();};
+        _commands["define"] = [&](){define();};
+        _commands["recompile"] = [&](){recompile();};
+        _commands["cache-stats"] = [&](){cacheStats();};
+        _commands["cache-size"] = [&](){cacheSize();};
         _commands["args-info"] = argsInfo;
         _commands["help"] = help;
 
@@ -112,9 +155,19 @@ public:
         {
             cout << "$~";
             cin >> keyword;
+            adopt();
             auto lookup = _commands.find(keyword);
             if(lookup != _commands.end())
-                lookup->second();
+            {
+                try
+                {
+                    lookup->second();
+                }
+                catch (const std::exception& e)
+                {
+                    cout << "Error: " << e.what() << endl;
+                }
+            }
             else if(keyword == "exit")
                 running = false;
             else
@@ -130,7 +183,14 @@ public:
         string expression;
         getline(cin, expression);
 //        cout << "save | name=[" << name << "] expression=[" << expression << "]\n";
-        _functions.insert_or_assign(name, _compiler->compile(expression));
+        Function function = _compiler->compile(expression);
+        if (refreshCallees(function))
+            function = _compiler->compile(expression);
+        if (reaches(function, name))
+            throw std::logic_error("'" + name + "' cannot call itself");
+        _functions.insert_or_assign(name, std::move(function));
+        _cache.clear();
+        recompileDependents(name);
     }
 
     void eval()
@@ -151,8 +211,29 @@ public:
         }
         string expression = tail.substr(0, argsBegin);
 //        cout << "Expression: [" << expression << "]\n";
-        Function f = _compiler->compile(expression);
-        double result = f(args);
+        if (_cacheRevision != _grammar.revision())
+        {
+            _cache.clear();
+            _cacheRevision = _grammar.revision();
+        }
+        string key = _compiler->key(expression);
+        const Function* f = _cache.find(key);
+        // A refreshed callee clears the cache.
+        if (f && refreshCallees(*f))
+            f = nullptr;
+        if (!f)
+        {
+            Function compiled = _compiler->compile(expression);
+            if (refreshCallees(compiled))
+                compiled = _compiler->compile(expression);
+            if (_cache.capacity() == 0)
+            {
+                cout << "The result = " << compiled(args) << endl;
+                return;
+            }
+            f = &_cache.insert(key, std::move(compiled));
+        }
+        double result = (*f)(args);
         cout << "The result = " << result << endl;
     }
 
@@ -169,25 +250,177 @@ public:
         auto end = sregex_iterator();
         for (; iterator != end; ++iterator)
             args.insert_or_assign((*iterator)[1].str(), stod((*iterator)[2].str()));
-        auto lookup = _functions.find(name);
-        if (lookup != _functions.end())
-            cout << "The result is: " << lookup->second(args) << endl;
+        const Function* function = saved(name);
+        if (function)
+            cout << "The result is: " << (*function)(args) << endl;
         else
             cout << "Unknown function: '" << name << "'\n";
     }
 
-    void show()
+    // Evaluates several saved functions in one pass over shared arguments.
+    void evalMany()
+    {
+        string tail;
+        getline(cin >> std::ws, tail);
+        auto iterator = sregex_iterator(tail.begin(), tail.end(), _argsPattern);
+        auto end = sregex_iterator();
+        const size_t argsBegin = iterator != end ? (size_t) (*iterator).position(0) : tail.size();
+        Function::Args args;
+        for (; iterator != end; ++iterator)
+            args.insert_or_assign((*iterator)[1].str(), stod((*iterator)[2].str()));
+
+        std::vector<string> names;
+        std::vector<const Function*> functions;
+        std::istringstream stream(tail.substr(0, argsBegin));
+        for (string name; stream >> name;)
+        {
+            const Function* function = saved(name);
+            if (!function)
+            {
+                cout << "Unknown function: '" << name << "'\n";
+                return;
+            }
+            names.push_back(name);
+            functions.push_back(function);
+        }
+        const std::vector<double> results = Bundle(functions).evaluate(args);
+        for (size_t k = 0; k < names.size(); ++k)
+            cout << names[k] << " = " << results[k] << endl;
+    }
+
+    void gradient()
     {
         string name;
+        cin >> name >> std::ws;
+        Function::Args args;
+        string tail;
+        getline(cin, tail);
+        auto iterator = sregex_iterator(tail.begin(),
+                                        tail.end(),
+                                        _argsPattern);
+        auto end = sregex_iterator();
+        for (; iterator != end; ++iterator)
+            args.insert_or_assign((*iterator)[1].str(), stod((*iterator)[2].str()));
+        const Function* function = saved(name);
+        if (!function)
+        {
+            cout << "Unknown function: '" << name << "'\n";
+            return;
+        }
+        Function::Args gradient;
+        cout << "The result is: " << function->differentiate(args, gradient) << endl;
+        for (const auto& pair: gradient)
+            cout << "  d/d" << pair.first << " = " << pair.second << endl;
+    }
+
+    void stream()
+    {
+        string name, input, output;
+        cin >> name >> input >> output;
+        const Function* function = saved(name);
+        if (!function)
+        {
+            cout << "Unknown function: '" << name << "'\n";
+            return;
+        }
+        cout.flush();
+        Stream::Report report = Stream::run(*function, input, output);
+        cout << "Evaluated " << report.rows << " rows in " << report.seconds << " s ("
+             << (size_t) report.throughput() << " rows/s)" << endl;
+    }
+
+    // Axes are name=first:last:count, outermost first.
+    void grid()
+    {
+        string name, tail;
         cin >> name;
+        getline(cin, tail);
+        const Function* function = saved(name);
+        if (!function)
+        {
+            cout << "Unknown function: '" << name << "'\n";
+            return;
+        }
+        std::vector<Grid::Axis> axes;
+        std::istringstream stream(tail);
+        for (string axis; stream >> axis;)
+        {
+            const size_t equals = axis.find('=');
+            const size_t first = axis.find(':', equals);
+            const size_t last = axis.find(':', first + 1);
+            if (equals == string::npos || first == string::npos || last == string::npos)
+                throw std::logic_error("Expected name=first:last:count, got '" + axis + "'");
+            axes.emplace_back(axis.substr(0, equals), stod(axis.substr(equals + 1, first - equals - 1)),
+                              stod(axis.substr(first + 1, last - first - 1)), stoul(axis.substr(last + 1)));
+        }
+        const Grid grid(*function, std::move(axes));
+        const std::vector<double> values = grid.evaluate();
+        const size_t width = grid.axes().back().values.size();
+        for (size_t i = 0; i < values.size(); ++i)
+            cout << values[i] << (i % width + 1 == width ? '\n' : ' ');
+    }
+
+    void stats()
+    {
+        string name;
+        getline(cin, name);
+        name.erase(0, name.find_first_not_of(' '));
+        name.erase(name.find_last_not_of(' ') + 1);
+        if (!Function::Profiling)
+        {
+            cout << "Profiling is disabled; rebuild with -DFUNCTIONS_PROFILING=ON" << endl;
+            return;
+        }
+        if (name.empty())
+        {
+            cout << "name: calls, rows, mean latency, estimated total" << endl;
+            for (const auto& pair: _functions)
+            {
+                Profile::Snapshot profile = pair.second.profile();
+                cout << pair.first << ": " << profile.calls << ", " << profile.rows << ", "
+                     << profile.mean << " ns, " << profile.total + profile.batchSeconds << " s" << endl;
+            }
+            return;
+        }
         auto lookup = _functions.find(name);
-        if (lookup != _functions.end())
+        if (lookup == _functions.end())
+        {
+            cout << "Unknown function: '" << name << "'\n";
+            return;
+        }
+        Profile::Snapshot profile = lookup->second.profile();
+        cout << "Calls: " << profile.calls << " (" << profile.sampled << " timed)"
+             << "\nLatency: mean " << profile.mean << " ns, p50 " << profile.p50 << " ns, p90 " << profile.p90
+             << " ns, p99 " << profile.p99 << " ns, max " << profile.max << " ns"
+             << "\nEstimated total: " << profile.total << " s"
+             << "\nBatch rows: " << profile.rows << " in " << profile.batchSeconds << " s"
+             << "\nOperator executions:";
+        for (const auto& [symbol, count]: profile.operators)
+            cout << ' ' << symbol << '=' << count;
+        if (!profile.conditional.empty())
+        {
+            cout << "\nIn conditionals, at most:";
+            for (const auto& [symbol, count]: profile.conditional)
+                cout << ' ' << symbol << '=' << count;
+        }
+        cout << endl;
+    }
+
+    void show()
+    {
+        string name;
+        cin >> name;
+        const Function* function = saved(name);
+        if (function)
         {
             cout << "Infix form: "
-                 << lookup->second.infix()
+                 << function->infix()
                  << "\nPostfix form: "
-                 << lookup->second.postfix()
-                 << endl;
+                 << function->postfix()
+                 << "\nParameters: ";
+            for (const auto& parameter: function->parameters())
+                cout << parameter << ' ';
+            cout << endl;
         }
     }
 
@@ -209,11 +442,32 @@ public:
         string name;
         cin >> name;
         _functions.erase(name);
+        _cache.clear();
+    }
+
+    void saveAll()
+    {
+        string path;
+        cin >> path;
+        Archive::save(path, _functions);
+        cout << "Saved " << _functions.size() << " functions" << endl;
+    }
+
+    void loadAll()
+    {
+        string path;
+        cin >> path;
+        Function::Library functions = Archive::load(path, _grammar);
+        for (auto& [name, function]: functions)
+            _functions.insert_or_assign(name, std::move(function));
+        _cache.clear();
+        cout << "Loaded " << functions.size() << " functions" << endl;
     }
 
     void clear()
     {
         _functions.clear();
+        _cache.clear();
     }
 
     void grammar()
@@ -230,9 +484,280 @@ public:
         cout << "\nPostfix Functions: ";
         for (const auto& pair: _grammar.postfix())
             cout << pair.first << ", ";
+        cout << "\nBuilt in: condition ? a : b, min(a, ...), max(a, ...)";
         cout << endl;
     }
 
+    void optimize()
+    {
+        unsigned level;
+        cin >> level;
+        _compiler->optimization(static_cast<Optimizer::Level>(std::min(level, (unsigned) Optimizer::O2)));
+        _cache.clear();
+        cout << "Optimization level: " << (unsigned) _compiler->optimization() << endl;
+    }
+
+    void define()
+    {
+        string name;
+        double value;
+        cin >> name >> value;
+        _grammar.addConstant(name, value);
+        Optimizer::Level level = _compiler->optimization();
+        delete _compiler;
+        _compiler = new Compiler(_grammar, level);
+        _compiler->link(&_functions);
+        if (_eager)
+            refreshInBackground();
+    }
+
+    void recompile()
+    {
+        string mode;
+        cin >> mode;
+        if (mode != "lazy" && mode != "eager")
+            throw std::logic_error("Expected 'lazy' or 'eager'");
+        _eager = mode == "eager";
+        if (_eager)
+            refreshInBackground();
+    }
+
+    void cacheStats()
+    {
+        cout << "Cached expressions: " << _cache.size() << '/' << _cache.capacity()
+             << "\nHits: " << _cache.hits()
+             << "\nMisses: " << _cache.misses() << endl;
+    }
+
+    void cacheSize()
+    {
+        size_t capacity;
+        cin >> capacity;
+        _cache.capacity(capacity);
+    }
+
+    // Whether 'function' calls 'name', directly or through saved functions.
+    bool reaches(const Function& function, const string& name) const
+    {
+        std::set<string> visited;
+        std::vector<string> pending(function.calls());
+        while (!pending.empty())
+        {
+            string callee = pending.back();
+            pending.pop_back();
+            if (callee == name)
+                return true;
+            auto lookup = _functions.find(callee);
+            if (lookup != _functions.end() && visited.insert(callee).second)
+                pending.insert(pending.end(), lookup->second.calls().begin(), lookup->second.calls().end());
+        }
+        return false;
+    }
+
+    // Recompiles every saved function that inlines 'name', directly or
+    // through other saved functions, callees before their callers.
+    void recompileDependents(const string& name)
+    {
+        std::set<string> stale;
+        std::vector<string> pending {name};
+        while (!pending.empty())
+        {
+            string callee = pending.back();
+            pending.pop_back();
+            for (const auto& [caller, function]: _functions)
+            {
+                const auto& calls = function.calls();
+                if (std::find(calls.begin(), calls.end(), callee) != calls.end() && stale.insert(caller).second)
+                    pending.push_back(caller);
+            }
+        }
+
+        for (const string& caller: ordered(stale))
+        {
+            string infix = _functions.at(caller).infix();
+            try
+            {
+                _functions.insert_or_assign(caller, _compiler->compile(infix));
+            }
+            catch (const std::exception& e)
+            {
+                cout << "Error: '" << caller << "' keeps its previous definition: " << e.what() << endl;
+            }
+        }
+    }
+
+    // Orders saved functions so that each comes after the ones it calls.
+    std::vector<string> ordered(std::set<string> names) const
+    {
+        std::vector<string> result;
+        bool progress = true;
+        while (!names.empty() && progress)
+        {
+            progress = false;
+            for (auto it = names.begin(); it != names.end();)
+            {
+                const Function& function = _functions.at(*it);
+                if (std::any_of(function.calls().begin(), function.calls().end(),
+                                [&](const string& callee) { return names.contains(callee); }))
+                {
+                    ++it;
+                    continue;
+                }
+                result.push_back(*it);
+                it = names.erase(it);
+                progress = true;
+            }
+        }
+        return result;
+    }
+
+    // Whether the grammar changed under 'function' or under a function it
+    // calls since they were compiled.
+    bool outdated(const Function& function) const
+    {
+        if (function.stale(_grammar))
+            return true;
+        for (const string& callee: function.calls())
+        {
+            auto lookup = _functions.find(callee);
+            if (lookup != _functions.end() && !failed(callee) && outdated(lookup->second))
+                return true;
+        }
+        return false;
+    }
+
+    // The saved function 'name', or nullptr. In lazy mode an outdated
+    // function is recompiled first.
+    const Function* saved(const string& name)
+    {
+        if (!_functions.contains(name))
+            return nullptr;
+        if (!_eager)
+            refresh(name);
+        return &_functions.at(name);
+    }
+
+    // Recompiles 'name' if it is outdated, the functions it calls first.
+    // A function that no longer compiles keeps its previous definition.
+    void refresh(const string& name)
+    {
+        if (failed(name) || !outdated(_functions.at(name)))
+            return;
+        for (const string& callee: std::vector<string>(_functions.at(name).calls()))
+        {
+            if (_functions.contains(callee))
+                refresh(callee);
+        }
+        try
+        {
+            string infix = _functions.at(name).infix();
+            _functions.insert_or_assign(name, _compiler->compile(infix));
+            _failures.erase(name);
+            _cache.clear();
+        }
+        catch (const std::exception& e)
+        {
+            _failures.insert_or_assign(name, _grammar.revision());
+            cout << "Error: '" << name << "' keeps its previous definition: " << e.what() << endl;
+        }
+    }
+
+    // In lazy mode, recompiles the outdated saved functions 'function'
+    // calls, whose programs it inlined. Returns whether any was, in which
+    // case it has to be compiled again.
+    bool refreshCallees(const Function& function)
+    {
+        if (_eager)
+            return false;
+        bool refreshed = false;
+        for (const string& callee: std::vector<string>(function.calls()))
+        {
+            auto lookup = _functions.find(callee);
+            if (lookup == _functions.end() || !outdated(lookup->second))
+                continue;
+            const size_t revision = lookup->second.revision();
+            refresh(callee);
+            refreshed = refreshed || _functions.at(callee).revision() != revision;
+        }
+        return refreshed;
+    }
+
+    // Whether 'name' failed to recompile against the current grammar.
+    bool failed(const string& name) const
+    {
+        auto lookup = _failures.find(name);
+        return lookup != _failures.end() && lookup->second == _grammar.revision();
+    }
+
+    // Recompiles every outdated function on another thread, against a copy
+    // of the saved functions. The current ones keep serving until adopt()
+    // installs the results.
+    void refreshInBackground()
+    {
+        std::set<string> stale;
+        for (const auto& [name, function]: _functions)
+        {
+            if (!failed(name) && outdated(function))
+                stale.insert(name);
+        }
+        if (stale.empty())
+            return;
+        _updates.push_back(std::async(std::launch::async,
+                                      [compiler = *_compiler, library = _functions, order = ordered(stale),
+                                       revision = _grammar.revision()]() mutable
+        {
+            compiler.link(&library);
+            std::vector<Update> updates;
+            for (const string& name: order)
+            {
+                Update update {name, library.at(name).infix(), std::nullopt, {}, revision};
+                try
+                {
+                    update.function.emplace(compiler.compile(update.infix));
+                    library.insert_or_assign(name, *update.function);
+                }
+                catch (const std::exception& e)
+                {
+                    update.error = e.what();
+                }
+                updates.push_back(std::move(update));
+            }
+            return updates;
+        }));
+    }
+
+    // Installs the background recompilations that have finished, except for
+    // functions that were saved again or deleted in the meantime.
+    void adopt()
+    {
+        for (auto it = _updates.begin(); it != _updates.end();)
+        {
+            if (it->wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            {
+                ++it;
+                continue;
+            }
+            for (Update& update: it->get())
+            {
+                auto lookup = _functions.find(update.name);
+                if (lookup == _functions.end() || lookup->second.infix() != update.infix)
+                    continue;
+                if (!update.function)
+                {
+                    _failures.insert_or_assign(update.name, update.revision);
+                    cout << "Error: '" << update.name << "' keeps its previous definition: " << update.error << endl;
+                }
+                else if (update.function->revision() > lookup->second.revision())
+                {
+                    _failures.erase(update.name);
+                    _functions.insert_or_assign(update.name, std::move(*update.function));
+                }
+            }
+            _cache.clear();
+            it = _updates.erase(it);
+        }
+    }
+
     static void argsInfo()
     {
         static const string message(
@@ -257,14 +782,32 @@ public:
                 "#=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=#\n"
                 "# > eval function args...   - eval expression with given args   #\n"
                 "# > save name function      - save the function as 'name'       #\n"
+                "#   saved functions can be called by name: f(x, y + 1)          #\n"
+                "#   x < 1 ? a : b runs only the arm taken; min(...), max(...)   #\n"
                 "# > evals name args...      - eval saved function 'name'        #\n"
+                "# > evals-many names... args... - eval several saved functions  #\n"
+                "#   in one pass that computes their shared parts once           #\n"
+                "# > gradient name args...   - eval 'name' and its gradient      #\n"
+                "# > stream name in out      - eval 'name' on each row of 'in'   #\n"
+                "#   CSV, or column-major doubles if '.bin'; out '-' is stdout   #\n"
+                "# > grid name x=0:1:5 ...   - eval 'name' on every combination  #\n"
+                "#   of the axes' values, a line per run of the last axis        #\n"
                 "#=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=#\n"
                 "# > show name   - 'name' function in infix & postfix notations  #\n"
+                "# > stats [name] - evaluation statistics of saved functions     #\n"
                 "# > list-saved  - all saved functions                           #\n"
                 "# > delete name - delete the 'name' function                    #\n"
                 "# > clear       - delete all functions                          #\n"
+                "# > save-all path - write all compiled functions to 'path'      #\n"
+                "# > load-all path - add the compiled functions from 'path'      #\n"
                 "#=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=#\n"
+                "# > define name value - add or redefine a constant              #\n"
+                "# > recompile lazy|eager - after 'define', recompile the saved  #\n"
+                "#   functions it affects when used, or at once in background    #\n"
                 "# > grammar    - all available operators and constants          #\n"
+                "# > optimize n - optimization level for new functions (0..2)    #\n"
+                "# > cache-stats  - compiled expression cache usage for 'eval'   #\n"
+                "# > cache-size n - keep at most n compiled expressions          #\n"
                 "# > args-info  - guide on args                                  #\n"
                 "# > help       - general app usage guide                        #\n"
                 "# > exit       - terminate the program                          #\n"
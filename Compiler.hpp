@@ -2,110 +2,294 @@
 #define INC_4_FUNCTIONS_COMPILER_HPP
 
 #include <iostream>
-#include <stack>
+#include <algorithm>
+#include <charconv>
+#include <memory_resource>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
 #include <bitset>
 #include <sstream>
 
+#include "Arena.hpp"
 #include "Grammar.hpp"
 #include "Function.hpp"
+#include "Graph.hpp"
+#include "Optimizer.hpp"
+#include "ThreadPool.hpp"
 #include "Token.hpp"
 
 
-class Compiler
+// Compiling is const and keeps its scratch data per thread, so one Compiler
+// may compile from any number of threads at once. Compilers made from the
+// same snapshot share the grammar instead of copying it. Functions come
+// out computing in the Value type of the grammar.
+template<typename Value>
+class BasicCompiler
 {
 public:
-    explicit Compiler(Grammar& grammar) : _grammar(grammar) {}
+    using Grammar = BasicGrammar<Value>;
+    using Function = BasicFunction<Value>;
+    using Program = BasicProgram<Value>;
+    using Instruction = BasicInstruction<Value>;
+    using Symbol = BasicSymbol<Value>;
+    using Graph = BasicGraph<Value>;
+    using Optimizer = BasicOptimizer<Value>;
+    using Token = BasicToken<Value>;
+
+    // One expression of a bulk compilation: the function, or why it failed.
+    struct Result
+    {
+        std::optional<Function> function;
+        string error;
+    };
+
+    static constexpr size_t BulkChunk = 64;
+
+    explicit BasicCompiler(typename Grammar::Snapshot grammar, const Optimization::Level level = Optimization::O2)
+        : _grammar(std::move(grammar)), _optimizer(*_grammar, level) {}
+
+    explicit BasicCompiler(const Grammar& grammar, const Optimization::Level level = Optimization::O2)
+        : BasicCompiler(grammar.snapshot(), level) {}
+
+    BasicCompiler(const BasicCompiler& other)
+        : _grammar(other._grammar), _optimizer(*_grammar, other.optimization()), _library(other._library) {}
 
 private:
-    Grammar _grammar;
+    typename Grammar::Snapshot _grammar;
+    Optimizer _optimizer;
+    const typename Function::Library* _library = nullptr;
 
 public:
-    Function compile(const string& infix)
+    [[nodiscard]] const typename Grammar::Snapshot& grammar() const
+    {
+        return _grammar;
+    }
+
+    [[nodiscard]] Optimization::Level optimization() const
+    {
+        return _optimizer.level();
+    }
+
+    void optimization(const Optimization::Level level)
+    {
+        _optimizer.level(level);
+    }
+
+    // Saved functions that expressions may call by name, as in f(x, y + 1).
+    // Arguments bind to the callee's parameters in order of first appearance
+    // and the callee body is inlined into the caller.
+    void link(const typename Function::Library* library)
+    {
+        _library = library;
+    }
+
+    Function compile(const string& infix) const
+    {
+        Arena& memory = arena();
+        memory.reset();
+        return compile(tokenize(infix, &memory), infix, memory);
+    }
+
+    // Compiles every expression across the pool. A failure is reported in
+    // its own result and does not affect the others. The linked library
+    // must not change until this returns.
+    std::vector<Result> compile(const std::vector<string>& expressions, ThreadPool& pool = ThreadPool::shared()) const
+    {
+        std::vector<Result> results(expressions.size());
+        const size_t chunks = (expressions.size() + BulkChunk - 1) / BulkChunk;
+        pool.parallelFor(chunks, [&](const size_t chunk)
+        {
+            const size_t end = std::min(expressions.size(), (chunk + 1) * BulkChunk);
+            for (size_t i = chunk * BulkChunk; i < end; ++i)
+            {
+                try
+                {
+                    results[i].function.emplace(compile(expressions[i]));
+                }
+                catch (const std::exception& e)
+                {
+                    results[i].error = e.what();
+                }
+            }
+        });
+        return results;
+    }
+
+    // What two expressions share when they read as the same tokens, however
+    // they are spaced or parenthesized; throws where tokenize() does.
+    [[nodiscard]] string key(const string& infix) const
+    {
+        Arena& memory = arena();
+        memory.reset();
+        string result;
+        for (const Token& token: tokenize(infix, &memory))
+        {
+            result += std::to_string(token.type);
+            if (token.type == TT_CALL)
+                result += '/' + std::to_string(token.arity);
+            result += ' ';
+            result += token.value;
+            result += '\n';
+        }
+        return result;
+    }
+
+    // Splits the infix expression into tokens and reorders them into postfix.
+    // The tokens refer to the text of infix, which must outlive them.
+    [[nodiscard]] std::pmr::vector<Token> tokenize(
+            const string& infix,
+            std::pmr::memory_resource* memory = std::pmr::get_default_resource()) const
     {
         static const auto
                 operands = static_cast<TokenType> (TT_NUMBER
                                                    | TT_ARGUMENT
                                                    | TT_PREFIX
-                                                   | TT_OPEN);
+                                                   | TT_OPEN
+                                                   | TT_CALL);
         static const auto
                 operators = static_cast<TokenType> (TT_BINARY
                                                     | TT_POSTFIX
-                                                    | TT_CLOSE);
+                                                    | TT_CLOSE
+                                                    | TT_COMMA
+                                                    | TT_IF
+                                                    | TT_ELSE);
 
+        const std::string_view text(infix);
         TokenType next = operands;
-        std::list<Token> expression;
-        std::stack<Token> stack;
+        // Every token takes at least one character.
+        std::pmr::vector<Token> expression(memory);
+        std::pmr::vector<Token> stack(memory);
+        expression.reserve(infix.size());
+        stack.reserve(infix.size());
 
         size_t length, i = 0;
         while (infix[i] == ' ') ++i;
         while (i < infix.size())
         {
-            if ((TT_NUMBER & next) && (length = Grammar::matchNumber(infix, i)))
+            const Function* callee = nullptr;
+            if ((TT_NUMBER & next) && (length = Syntax::matchNumber(infix, i)))
             {
                 expression.push_back(Token{
                         .type = TT_NUMBER,
-                        .value = infix.substr(i, length)
+                        .value = text.substr(i, length)
                 });
                 next = operators;
             }
-            else if ((TT_PREFIX & next) && (length = _grammar.matchPrefix(infix, i)))
+            else if ((TT_CALL & next) && (length = matchCall(infix, i, callee)))
             {
-                stack.push(Token{
+                stack.push_back(Token{
+                        .type = TT_CALL,
+                        .value = text.substr(i, Syntax::matchArgument(infix, i)),
+                        .callee = callee
+                });
+                next = static_cast<TokenType> (operands | TT_CLOSE);
+            }
+            else if ((TT_PREFIX & next) && (length = _grammar->matchPrefix(infix, i)))
+            {
+                const std::string_view signature = text.substr(i, length);
+                stack.push_back(Token{
                         .type = TT_PREFIX,
-                        .value = infix.substr(i, length)
+                        .value = signature,
+                        .unary = &_grammar->prefix().find(signature)->second
                 });
                 next = operands;
             }
-            else if ((TT_BINARY & next) && (length = _grammar.matchBinary(infix, i)))
+            else if ((TT_BINARY & next) && (length = _grammar->matchBinary(infix, i)))
             {
-                string signature = infix.substr(i, length);
-                Grammar::Precedence p = _grammar.precedence(signature);
+                const std::string_view signature = text.substr(i, length);
+                const typename Grammar::BinaryOperator& binary = _grammar->binary().find(signature)->second;
+                const Syntax::Precedence p = binary.precedence;
                 while (!stack.empty()
-                   && (stack.top().type == TT_PREFIX || _grammar.precedence(stack.top().value) > p))
+                   && (stack.back().type == TT_PREFIX
+                       || (stack.back().type == TT_BINARY
+                           && (stack.back().precedence > p
+                               || (stack.back().precedence == p && !binary.rightAssociative)))))
                 {
-                    expression.push_back(stack.top());
-                    stack.pop();
+                    expression.push_back(stack.back());
+                    stack.pop_back();
                 }
-                stack.push(Token{
+                stack.push_back(Token{
                         .type = TT_BINARY,
-                        .value = signature
+                        .value = signature,
+                        .precedence = p,
+                        .binary = &binary
                 });
                 next = operands;
             }
-            else if ((TT_POSTFIX & next) && (length = _grammar.matchPostfix(infix, i)))
+            else if ((TT_POSTFIX & next) && (length = _grammar->matchPostfix(infix, i)))
             {
+                const std::string_view signature = text.substr(i, length);
                 expression.push_back(Token{
                         .type = TT_POSTFIX,
-                        .value = infix.substr(i, length)
+                        .value = signature,
+                        .unary = &_grammar->postfix().find(signature)->second
                 });
                 next = operators;
             }
             else if ((TT_OPEN & next) && (length = infix[i] == '('))
             {
-                stack.push(Token{.type = TT_OPEN});
+                stack.push_back(Token{.type = TT_OPEN});
                 next = operands;
             }
             else if ((TT_CLOSE & next) && (length = (infix[i] == ')')))
             {
-                while (stack.top().type != TT_OPEN)
+                const bool empty = !(TT_BINARY & next);
+                unwind(stack, expression, i);
+                if (stack.back().type == TT_CALL)
                 {
-                    expression.push_back(stack.top());
-                    stack.pop();
+                    stack.back().arity += !empty;
+                    expression.push_back(stack.back());
                 }
-                stack.pop();
+                stack.pop_back();
                 next = operators;
             }
-            else if ((TT_ARGUMENT & next) && (length = Grammar::matchArgument(infix, i)))
+            else if ((TT_COMMA & next) && (length = (infix[i] == ',')))
+            {
+                unwind(stack, expression, i);
+                if (stack.back().type != TT_CALL)
+                    throw std::logic_error("Unexpected ',' at " + std::to_string(i));
+                ++stack.back().arity;
+                next = operands;
+            }
+            else if ((TT_IF & next) && (length = (infix[i] == '?')))
+            {
+                // The conditional binds loosest: all before it is the condition.
+                while (!stack.empty() && (stack.back().type == TT_PREFIX || stack.back().type == TT_BINARY))
+                {
+                    expression.push_back(stack.back());
+                    stack.pop_back();
+                }
+                stack.push_back(Token{.type = TT_IF});
+                next = operands;
+            }
+            else if ((TT_ELSE & next) && (length = (infix[i] == ':')))
+            {
+                while (!stack.empty()
+                       && (stack.back().type == TT_PREFIX
+                           || stack.back().type == TT_BINARY
+                           || stack.back().type == TT_ELSE))
+                {
+                    expression.push_back(stack.back());
+                    stack.pop_back();
+                }
+                if (stack.empty() || stack.back().type != TT_IF)
+                    throw std::logic_error("Unexpected ':' at " + std::to_string(i));
+                stack.back().type = TT_ELSE;
+                next = operands;
+            }
+            else if ((TT_ARGUMENT & next) && (length = Syntax::matchArgument(infix, i)))
             {
                 expression.push_back(Token{
                         .type = TT_ARGUMENT,
-                        .value = infix.substr(i, length)
+                        .value = text.substr(i, length)
                 });
                 next = operators;
             }
             else
             {
-                std::bitset<8> b(next);
+                std::bitset<11> b(next);
                 std::stringstream s;
                 s << "Unexpected token at " << i << "; UnitGroup: " << b;
                 throw std::logic_error(s.str());
@@ -115,102 +299,219 @@ public:
         }
         while (!stack.empty())
         {
-            expression.push_back(stack.top());
-            stack.pop();
+            if (stack.back().type == TT_OPEN || stack.back().type == TT_CALL)
+                throw std::logic_error("Unbalanced parenthesis");
+            if (stack.back().type == TT_IF)
+                throw std::logic_error("Missing ':' of a conditional");
+            expression.push_back(stack.back());
+            stack.pop_back();
         }
-
-        return Function(compile(expression),
-                        infix,
-                        stringify(expression));
+        return expression;
     }
 
 private:
-    std::list<Unit> compile(const std::list<Token>& tokens)
+    // Tokens, the graph and the optimizer's scratch data of the expression
+    // being compiled on this thread; only the Function itself is allocated
+    // on the heap.
+    static Arena& arena()
+    {
+        thread_local Arena arena;
+        return arena;
+    }
+
+    // A saved function, or the built-in min or max unless one of that name
+    // was saved, followed by '('.
+    size_t matchCall(const string& infix, const size_t start, const Function*& callee) const
     {
-        std::list<Unit> expression;
+        size_t length = Syntax::matchArgument(infix, start);
+        if (!length)
+            return 0;
+        const std::string_view name = std::string_view(infix).substr(start, length);
+        callee = nullptr;
+        if (_library)
+        {
+            auto lookup = _library->find(name);
+            if (lookup != _library->end())
+                callee = &lookup->second;
+        }
+        if (!callee && name != "min" && name != "max")
+            return 0;
+        while (infix[start + length] == ' ') ++length;
+        if (infix[start + length] != '(')
+            return 0;
+        return length + 1;
+    }
+
+    static void unwind(std::pmr::vector<Token>& stack, std::pmr::vector<Token>& expression, const size_t position)
+    {
+        while (!stack.empty() && stack.back().type != TT_OPEN && stack.back().type != TT_CALL)
+        {
+            if (stack.back().type == TT_IF)
+                throw std::logic_error("Missing ':' of a conditional before " + std::to_string(position));
+            expression.push_back(stack.back());
+            stack.pop_back();
+        }
+        if (stack.empty())
+            throw std::logic_error("Unbalanced parenthesis at " + std::to_string(position));
+    }
+
+    Function compile(const std::pmr::vector<Token>& tokens, const string& infix, Arena& memory) const
+    {
+        Program program;
+        Graph graph(&memory);
+        std::pmr::vector<unsigned> stack(&memory);
+        std::vector<string> calls;
+        std::vector<Syntax::Name> dependencies;
+        auto depend = [&](const Syntax::Kind kind, const std::string_view name)
+        {
+            auto same = [&](const Syntax::Name& other) { return other.kind == kind && other.name == name; };
+            if (std::none_of(dependencies.begin(), dependencies.end(), same))
+                dependencies.push_back(Syntax::Name {kind, string(name)});
+        };
+        stack.reserve(tokens.size());
         for (const auto& token: tokens)
         {
+            typename Graph::Node node;
             switch (token.type)
             {
                 case TT_NUMBER:
-                    expression.push_back(CompileNumber(token));
+                    node.instruction = CompileNumber(token);
                     break;
                 case TT_ARGUMENT:
-                    expression.push_back(CompileArgument(token));
+                    node.instruction = CompileArgument(token, program);
+                    depend(Syntax::CONSTANT, token.value);
                     break;
                 case TT_PREFIX:
-                    expression.push_back(CompilePrefix(token));
+                case TT_POSTFIX:
+                    node.instruction = CompileUnary(token, program);
                     break;
                 case TT_BINARY:
-                    expression.push_back(CompileBinary(token));
+                    node.instruction = CompileBinary(token, program);
                     break;
-                case TT_POSTFIX:
-                    expression.push_back(CompilePostfix(token));
+                case TT_ELSE:
+                    node.instruction = Instruction {OP_SELECT};
                     break;
+                case TT_CALL:
+                    if (!token.callee)
+                    {
+                        stack.push_back(CompileReduction(token, graph, stack));
+                        continue;
+                    }
+                    stack.push_back(CompileCall(token, graph, program, stack));
+                    if (std::find(calls.begin(), calls.end(), token.value) == calls.end())
+                        calls.emplace_back(token.value);
+                    for (const Syntax::Name& dependency: token.callee->dependencies())
+                        depend(dependency.kind, dependency.name);
+                    continue;
                 default:
                     std::stringstream s;
                     s << "Unhandled TokenType: " << token.type;
                     throw std::logic_error(s.str());
             }
+            const size_t arity = Graph::arity(node);
+            if (stack.size() < arity)
+                throw std::logic_error("Missing operand");
+            std::copy(stack.end() - arity, stack.end(), node.operands);
+            stack.resize(stack.size() - arity);
+            stack.push_back(graph.add(node));
         }
-        return expression;
-    }
+        if (stack.size() != 1)
+            throw std::logic_error("Incomplete expression");
 
-    static Unit CompileNumber(const Token& token)
-    {
-        double x = stod(token.value);
-        return [x](Stack stack, Args args) -> double
-        { return x; };
+        graph.root(stack.back());
+        _optimizer.optimize(graph, program);
+        graph.emit(program);
+        // Every operator interned along the way, including those that were
+        // folded away or brought in by the optimizer.
+        for (const Symbol& symbol: program.symbols)
+            depend(symbol.kind(), symbol.name);
+        string postfix = program.stringify();
+        return Function(std::move(program), infix, postfix, std::move(calls),
+                        std::move(dependencies), _grammar->revision());
     }
 
-    static Unit CompileArgument(const Token& token)
+    static Instruction CompileNumber(const Token& token)
     {
-        return [name=token.value](Stack stack, Args args) -> double
-        { return args.at(name); };
+        // from_chars does not take a leading plus.
+        const std::string_view text = token.value.substr(token.value.front() == '+');
+        Instruction instruction {OP_CONSTANT};
+        auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), instruction.value);
+        if (error != std::errc() || end != text.data() + text.size())
+            throw std::logic_error("Invalid number '" + string(token.value) + "'");
+        return instruction;
     }
 
-    static Unit CompileUnary(const Token& token, const std::map<string, Grammar::Unary>& registry)
+    Instruction CompileArgument(const Token& token, Program& program) const
     {
-        const Grammar::Unary& unary = registry.at(token.value);
-        return [unary](Stack stack, Args args) -> double
+        auto constant = _grammar->constants().find(token.value);
+        if (constant != _grammar->constants().end())
         {
-            double x = stack.top();
-            stack.pop();
-            return unary(x);
-        };
+            Instruction instruction {OP_CONSTANT};
+            instruction.value = constant->second;
+            return instruction;
+        }
+        Instruction instruction {OP_ARGUMENT};
+        instruction.slot = program.bind(token.value);
+        return instruction;
     }
 
-    Unit CompilePrefix(const Token& token)
+    static Instruction CompileUnary(const Token& token, Program& program)
     {
-        return CompileUnary(token, _grammar.prefix());
+        Instruction instruction {OP_UNARY};
+        instruction.symbol = program.intern(token.type, token.value, *token.unary, {});
+        instruction.unary = token.unary->unary;
+        return instruction;
     }
 
-    Unit CompilePostfix(const Token& token)
+    static Instruction CompileBinary(const Token& token, Program& program)
     {
-        return CompileUnary(token, _grammar.postfix());
+        Instruction instruction {OP_BINARY};
+        instruction.symbol = program.intern(token.type, token.value, {}, *token.binary);
+        instruction.binary = token.binary->binary;
+        return instruction;
     }
 
-    Unit CompileBinary(const Token& token)
+    static unsigned CompileCall(const Token& token, Graph& graph, Program& program, std::pmr::vector<unsigned>& stack)
     {
-        const Grammar::Binary& binary = _grammar.binary().at(token.value).binary;
-        return [binary](Stack stack, Args args) -> double
+        const Function& callee = *token.callee;
+        if (token.arity != callee.parameters().size())
         {
-            double a = stack.top();
-            stack.pop();
-            double b = stack.top();
-            stack.pop();
-            return binary(b, a);
-        };
+            std::stringstream s;
+            s << '\'' << token.value << "' takes " << callee.parameters().size()
+              << " argument(s), " << token.arity << " given";
+            throw std::logic_error(s.str());
+        }
+        if (stack.size() < token.arity)
+            throw std::logic_error("Missing operand");
+        const unsigned result = graph.splice(callee.program(),
+                                             std::span<const unsigned>(stack).last(token.arity),
+                                             program);
+        stack.resize(stack.size() - token.arity);
+        return result;
     }
 
-    static string stringify(const std::list<Token>& tokens)
+    // min(a, b, c) becomes min(min(a, b), c).
+    static unsigned CompileReduction(const Token& token, Graph& graph, std::pmr::vector<unsigned>& stack)
     {
-        std::stringstream stream;
-        for(const Token& token : tokens)
-            stream << token.value << ' ';
-        return stream.str();
+        if (token.arity == 0)
+            throw std::logic_error("'" + string(token.value) + "' takes at least one argument");
+        if (stack.size() < token.arity)
+            throw std::logic_error("Missing operand");
+        const size_t first = stack.size() - token.arity;
+        unsigned result = stack[first];
+        for (size_t k = first + 1; k < stack.size(); ++k)
+        {
+            typename Graph::Node node {{token.value == "min" ? OP_MIN : OP_MAX}};
+            node.operands[0] = result;
+            node.operands[1] = stack[k];
+            result = graph.add(node);
+        }
+        stack.resize(first);
+        return result;
     }
 };
 
+using Compiler = BasicCompiler<double>;
+
 
 #endif //INC_4_FUNCTIONS_COMPILER_HPP
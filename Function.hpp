@@ -3,38 +3,100 @@
 
 
 #include <iostream>
-#include <stack>
 #include <string>
-#include <set>
+#include <vector>
 #include <map>
-#include <list>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <cmath>
+#include <cstdint>
+#include <type_traits>
 
-#include "Token.hpp"
+#include "Grammar.hpp"
+#include "Jit.hpp"
+#include "Operators.hpp"
+#include "Profile.hpp"
+#include "Program.hpp"
+#include "ThreadPool.hpp"
 
 using std::string;
 using std::stod;
 
-class Function
+// A compiled Function is immutable: every evaluate* method is const and
+// keeps its state on the caller's stack, so a single instance may be
+// evaluated from any number of threads at once. Value is the type it
+// computes in; only double functions are compiled to native code, the
+// others are always interpreted.
+template<typename Value>
+class BasicFunction
 {
-    friend class Compiler;
+    template<typename> friend class BasicCompiler;
+    friend class Archive;
+    friend class Bundle;
+    friend class Grid;
+
+public:
+    using Grammar = BasicGrammar<Value>;
+    using Program = BasicProgram<Value>;
+    using Instruction = BasicInstruction<Value>;
+    using Symbol = BasicSymbol<Value>;
+
+    static constexpr size_t StackCapacity = 64;
+    static constexpr size_t BlockSize = 256;
+    static constexpr size_t ChunkSize = 64 * BlockSize;
+    static constexpr size_t JitThreshold = 1000;
+#ifdef FUNCTIONS_PROFILING
+    static constexpr bool Profiling = true;
+#else
+    static constexpr bool Profiling = false;
+#endif
 
 private:
+    struct Tier
+    {
+        std::atomic<const NativeCode*> native = nullptr;
+        std::atomic<size_t> invocations = 0;
+        std::atomic<size_t> threshold = JitThreshold;
+        std::atomic<bool> attempted = false;
+        std::unique_ptr<NativeCode> code;
+        std::mutex mutex;
+#ifdef FUNCTIONS_PROFILING
+        Profile profile;
+#endif
+    };
+
     string _infix;
     string _postfix;
-    std::list<Unit> _expression;
+    std::vector<string> _calls;
+    std::vector<Syntax::Name> _dependencies;
+    size_t _revision = 0;
+    Program _program;
+    std::shared_ptr<Tier> _tier;
 
-    explicit Function(const std::list<Unit>& expression,
+    explicit BasicFunction(Program program,
                       const string& infix,
-                      const string& postfix)
+                      const string& postfix,
+                      std::vector<string> calls = {},
+                      std::vector<Syntax::Name> dependencies = {},
+                      const size_t revision = 0)
     {
-        _expression = expression;
+        _program = std::move(program);
         _infix = infix;
         _postfix = postfix;
+        _calls = std::move(calls);
+        _dependencies = std::move(dependencies);
+        _revision = revision;
+        _tier = std::make_shared<Tier>();
     }
 
 public:
-    using Args = std::map<string, double>;
+    using Args = std::map<string, Value>;
+    // Saved functions by name, looked up by string_view while compiling.
+    using Library = std::map<string, BasicFunction, std::less<>>;
 
     [[nodiscard]] const string& postfix() const
     {
@@ -46,30 +108,576 @@ public:
         return _infix;
     }
 
-    [[nodiscard]] double evaluate(const Args& args) const
+    // Names of the saved functions whose bodies were inlined into this one.
+    [[nodiscard]] const std::vector<string>& calls() const
+    {
+        return _calls;
+    }
+
+    // The grammar symbols the function was compiled with, including those
+    // of the functions it inlines, and the grammar revision it saw.
+    [[nodiscard]] const std::vector<Syntax::Name>& dependencies() const
+    {
+        return _dependencies;
+    }
+
+    [[nodiscard]] size_t revision() const
     {
-        std::stack<double> stack;
-        for (const auto& unit: _expression)
-            stack.push(unit(stack, args));
-        return stack.top();
+        return _revision;
     }
 
-    [[nodiscard]] double evaluate() const
+    // Whether a later change to the grammar may compile this function
+    // differently: one of its symbols was redefined, or an operator was
+    // added whose name occurs in its text and may now be read as one.
+    [[nodiscard]] bool stale(const Grammar& grammar) const
     {
-        Args args;
-        return this->evaluate(args);
+        for (const Syntax::Change& change: grammar.changes(_revision))
+        {
+            if (std::find(_dependencies.begin(), _dependencies.end(), change.symbol) != _dependencies.end())
+                return true;
+            if (change.added && change.symbol.kind != Syntax::CONSTANT
+                && _infix.find(change.symbol.name) != string::npos)
+                return true;
+        }
+        return false;
     }
 
-    double operator()(const Args& args) const
+    [[nodiscard]] const Program& program() const
+    {
+        return _program;
+    }
+
+    [[nodiscard]] const std::vector<string>& parameters() const
+    {
+        return _program.parameters;
+    }
+
+    // Compiles the function to native code now instead of waiting for the
+    // invocation threshold. Returns false if the program is not supported
+    // by the code generator, in which case the interpreter keeps serving.
+    bool jit() const
+    {
+        if constexpr (!std::is_same_v<Value, double>)
+            return false;
+        else
+        {
+            std::lock_guard<std::mutex> lock(_tier->mutex);
+            if (!_tier->attempted.load())
+            {
+                _tier->code = NativeCode::compile(_program);
+                _tier->native.store(_tier->code.get(), std::memory_order_release);
+                _tier->attempted.store(true);
+            }
+            return _tier->native.load() != nullptr;
+        }
+    }
+
+    [[nodiscard]] bool native() const
+    {
+        return _tier->native.load(std::memory_order_acquire) != nullptr;
+    }
+
+    // Sets how many evaluations trigger native compilation; 0 disables it.
+    void jitThreshold(const size_t invocations)
+    {
+        _tier->threshold.store(invocations);
+    }
+
+    // Statistics of the evaluations so far; empty unless the library is
+    // built with FUNCTIONS_PROFILING. Shared by all copies of the Function.
+    [[nodiscard]] Profile::Snapshot profile() const
+    {
+#ifdef FUNCTIONS_PROFILING
+        return _tier->profile.snapshot(_program);
+#else
+        return {};
+#endif
+    }
+
+    void resetProfile() const
+    {
+#ifdef FUNCTIONS_PROFILING
+        _tier->profile.reset();
+#endif
+    }
+
+    [[nodiscard]] Value evaluate(std::span<const Value> args) const
+    {
+        if (args.size() < _program.parameters.size())
+            throw std::out_of_range("Not enough arguments");
+#ifdef FUNCTIONS_PROFILING
+        Profile::Scope scope(_tier->profile);
+#endif
+
+        if constexpr (std::is_same_v<Value, double>)
+        {
+            if (const NativeCode* native = _tier->native.load(std::memory_order_acquire))
+                return (*native)(args.data());
+            if (!_tier->attempted.load(std::memory_order_relaxed))
+            {
+                const size_t threshold = _tier->threshold.load(std::memory_order_relaxed);
+                if (threshold && _tier->invocations.fetch_add(1, std::memory_order_relaxed) + 1 >= threshold && jit())
+                    return (*_tier->native.load(std::memory_order_acquire))(args.data());
+            }
+        }
+        return interpret(args);
+    }
+
+    [[nodiscard]] Value interpret(std::span<const Value> args) const
+    {
+        if (args.size() < _program.parameters.size())
+            throw std::out_of_range("Not enough arguments");
+
+        const size_t size = _program.depth + _program.registers;
+        Value buffer[StackCapacity];
+        std::unique_ptr<Value[]> heap;
+        Value* stack = buffer;
+        if (size > StackCapacity)
+        {
+            heap = std::make_unique<Value[]>(size);
+            stack = heap.get();
+        }
+        return run(_program.instructions, args.data(), stack, stack + _program.depth);
+    }
+
+private:
+    // Runs code that leaves one value on the stack; a conditional jumps over
+    // the arm it does not take.
+    static Value run(std::span<const Instruction> code, const Value* args, Value* stack, Value* registers)
+    {
+        size_t top = 0;
+        for (size_t i = 0; i < code.size(); ++i)
+        {
+            const Instruction& instruction = code[i];
+            switch (instruction.code)
+            {
+                case OP_CONSTANT:
+                    stack[top++] = instruction.value;
+                    break;
+                case OP_ARGUMENT:
+                    stack[top++] = args[instruction.slot];
+                    break;
+                case OP_UNARY:
+                    stack[top - 1] = instruction.unary(stack[top - 1]);
+                    break;
+                case OP_BINARY:
+                    --top;
+                    stack[top - 1] = instruction.binary(stack[top - 1], stack[top]);
+                    break;
+                case OP_FMA:
+                    top -= 2;
+                    stack[top - 1] = std::fma(stack[top - 1], stack[top], stack[top + 1]);
+                    break;
+                case OP_STORE:
+                    registers[instruction.slot] = stack[top - 1];
+                    break;
+                case OP_LOAD:
+                    stack[top++] = registers[instruction.slot];
+                    break;
+                case OP_MIN:
+                    --top;
+                    stack[top - 1] = operators::minimum(stack[top - 1], stack[top]);
+                    break;
+                case OP_MAX:
+                    --top;
+                    stack[top - 1] = operators::maximum(stack[top - 1], stack[top]);
+                    break;
+                case OP_BRANCH:
+                    if (stack[--top] == 0)
+                        i += instruction.slot;
+                    break;
+                case OP_JUMP:
+                    i += instruction.slot;
+                    break;
+                case OP_SELECT:
+                    break;
+            }
+        }
+        return stack[0];
+    }
+
+    // A conditional the batch interpreter is inside of. The condition is
+    // null when every row of the block takes the first arm, which then
+    // runs alone; otherwise both arms run and meet at the join.
+    struct Frame
+    {
+        const Value* condition;
+        size_t join;
+    };
+
+    // The batch interpreter's storage for one program: a block per stack
+    // cell, register and condition being blended.
+    struct Workspace
+    {
+        std::unique_ptr<Value[]> cells;
+        std::unique_ptr<const Value*[]> stack;
+        std::unique_ptr<Frame[]> frames;
+        Value* registers;
+        Value* conditions;
+
+        explicit Workspace(const Program& program)
+            : cells(std::make_unique<Value[]>((program.blendDepth + program.registers + program.nesting) * BlockSize)),
+              stack(std::make_unique<const Value*[]>(program.blendDepth)),
+              frames(std::make_unique<Frame[]>(program.nesting)),
+              registers(cells.get() + program.blendDepth * BlockSize),
+              conditions(registers + program.registers * BlockSize) {}
+    };
+
+    // Runs the code over rows [offset, offset + m) of the columns and
+    // returns where the m results are. A conditional whose condition is the
+    // same for the whole block runs only the arm taken; otherwise both arms
+    // run and their results are blended row by row.
+    static const Value* run(std::span<const Instruction> code,
+                             const std::vector<Symbol>& symbols,
+                             std::span<const Value* const> columns,
+                             const size_t offset,
+                             const size_t m,
+                             Workspace& work)
+    {
+        Value* scratch = work.cells.get();
+        const Value** stack = work.stack.get();
+        Frame* frames = work.frames.get();
+        size_t top = 0, open = 0;
+        for (size_t i = 0; i <= code.size(); ++i)
+        {
+            while (open && frames[open - 1].join == i)
+            {
+                --top;
+                Value* result = scratch + (top - 1) * BlockSize;
+                kernels::select(frames[--open].condition, stack[top - 1], stack[top], result, m);
+                stack[top - 1] = result;
+            }
+            if (i == code.size())
+                break;
+
+            const Instruction& instruction = code[i];
+            switch (instruction.code)
+            {
+                case OP_CONSTANT:
+                {
+                    Value* result = scratch + top * BlockSize;
+                    std::fill_n(result, m, instruction.value);
+                    stack[top++] = result;
+                    break;
+                }
+                case OP_ARGUMENT:
+                    stack[top++] = columns[instruction.slot] + offset;
+                    break;
+                case OP_UNARY:
+                {
+                    Value* result = scratch + (top - 1) * BlockSize;
+                    const Value* x = stack[top - 1];
+                    typename Grammar::UnaryKernel kernel = symbols[instruction.symbol].unary.kernel;
+                    if (kernel)
+                        kernel(x, result, m);
+                    else
+                        for (size_t k = 0; k < m; ++k) result[k] = instruction.unary(x[k]);
+                    stack[top - 1] = result;
+                    break;
+                }
+                case OP_BINARY:
+                {
+                    --top;
+                    Value* result = scratch + (top - 1) * BlockSize;
+                    const Value* a = stack[top - 1];
+                    const Value* b = stack[top];
+                    typename Grammar::BinaryKernel kernel = symbols[instruction.symbol].binary.kernel;
+                    if (kernel)
+                        kernel(a, b, result, m);
+                    else
+                        for (size_t k = 0; k < m; ++k) result[k] = instruction.binary(a[k], b[k]);
+                    stack[top - 1] = result;
+                    break;
+                }
+                case OP_FMA:
+                {
+                    top -= 2;
+                    Value* result = scratch + (top - 1) * BlockSize;
+                    kernels::fma(stack[top - 1], stack[top], stack[top + 1], result, m);
+                    stack[top - 1] = result;
+                    break;
+                }
+                case OP_STORE:
+                    std::copy_n(stack[top - 1], m, work.registers + instruction.slot * BlockSize);
+                    break;
+                case OP_LOAD:
+                    stack[top++] = work.registers + instruction.slot * BlockSize;
+                    break;
+                case OP_MIN:
+                case OP_MAX:
+                {
+                    --top;
+                    Value* result = scratch + (top - 1) * BlockSize;
+                    if (instruction.code == OP_MIN)
+                        kernels::elementwise<Value, operators::minimum<Value>>(stack[top - 1], stack[top], result, m);
+                    else
+                        kernels::elementwise<Value, operators::maximum<Value>>(stack[top - 1], stack[top], result, m);
+                    stack[top - 1] = result;
+                    break;
+                }
+                case OP_BRANCH:
+                {
+                    const Value* condition = stack[--top];
+                    const size_t taken = std::count_if(condition, condition + m, [](const Value c) { return c != 0; });
+                    if (taken == 0)
+                    {
+                        i += instruction.slot;
+                        break;
+                    }
+                    Frame& frame = frames[open++];
+                    frame.condition = nullptr;
+                    frame.join = SIZE_MAX;
+                    if (taken < m)
+                    {
+                        Value* copy = work.conditions + (open - 1) * BlockSize;
+                        std::copy_n(condition, m, copy);
+                        frame.condition = copy;
+                    }
+                    break;
+                }
+                case OP_JUMP:
+                {
+                    Frame& frame = frames[open - 1];
+                    if (frame.condition)
+                    {
+                        frame.join = i + 1 + instruction.slot;
+                        break;
+                    }
+                    --open;
+                    i += instruction.slot;
+                    break;
+                }
+                case OP_SELECT:
+                    break;
+            }
+        }
+        return stack[0];
+    }
+
+public:
+    [[nodiscard]] Value evaluate(const Args& args) const
+    {
+        const std::vector<string>& parameters = _program.parameters;
+        Value buffer[StackCapacity];
+        std::unique_ptr<Value[]> heap;
+        Value* values = buffer;
+        if (parameters.size() > StackCapacity)
+        {
+            heap = std::make_unique<Value[]>(parameters.size());
+            values = heap.get();
+        }
+        for (size_t slot = 0; slot < parameters.size(); ++slot)
+            values[slot] = args.at(parameters[slot]);
+        return evaluate(std::span<const Value>(values, parameters.size()));
+    }
+
+    [[nodiscard]] Value evaluate() const
+    {
+        return evaluate(std::span<const Value>());
+    }
+
+    // Evaluates the function and its gradient in a single pass: every stack
+    // cell carries the value followed by its partial derivative with respect
+    // to each parameter, and the operators' registered derivatives apply the
+    // chain rule. The gradient is written in parameters() order.
+    Value differentiate(std::span<const Value> args, std::span<Value> gradient) const
+    {
+        const size_t n = _program.parameters.size();
+        if (args.size() < n)
+            throw std::out_of_range("Not enough arguments");
+        if (gradient.size() < n)
+            throw std::out_of_range("Gradient is too short");
+
+        const size_t width = n + 1;
+        const size_t size = (_program.depth + _program.registers) * width;
+        Value buffer[StackCapacity];
+        std::unique_ptr<Value[]> heap;
+        Value* stack = buffer;
+        if (size > StackCapacity)
+        {
+            heap = std::make_unique<Value[]>(size);
+            stack = heap.get();
+        }
+        Value* registers = stack + _program.depth * width;
+
+        size_t top = 0;
+        const std::vector<Instruction>& code = _program.instructions;
+        for (size_t i = 0; i < code.size(); ++i)
+        {
+            const Instruction& instruction = code[i];
+            switch (instruction.code)
+            {
+                case OP_CONSTANT:
+                {
+                    Value* cell = stack + width * top++;
+                    cell[0] = instruction.value;
+                    std::fill(cell + 1, cell + width, Value(0));
+                    break;
+                }
+                case OP_ARGUMENT:
+                {
+                    Value* cell = stack + width * top++;
+                    cell[0] = args[instruction.slot];
+                    std::fill(cell + 1, cell + width, Value(0));
+                    cell[1 + instruction.slot] = 1;
+                    break;
+                }
+                case OP_UNARY:
+                {
+                    const Symbol& symbol = _program.symbols[instruction.symbol];
+                    if (!symbol.unary.derivative)
+                        throw std::logic_error("'" + symbol.name + "' has no derivative");
+                    Value* x = stack + width * (top - 1);
+                    const Value y = instruction.unary(x[0]);
+                    const Value d = symbol.unary.derivative(x[0], y);
+                    x[0] = y;
+                    for (size_t k = 1; k < width; ++k)
+                        x[k] *= d;
+                    break;
+                }
+                case OP_BINARY:
+                {
+                    const Symbol& symbol = _program.symbols[instruction.symbol];
+                    if (!symbol.binary.leftDerivative || !symbol.binary.rightDerivative)
+                        throw std::logic_error("'" + symbol.name + "' has no derivative");
+                    --top;
+                    Value* a = stack + width * (top - 1);
+                    const Value* b = a + width;
+                    if (instruction.binary == operators::add<Value>
+                        || instruction.binary == operators::subtract<Value>)
+                    {
+                        const Value sign = instruction.binary == operators::add<Value> ? 1 : -1;
+                        for (size_t k = 0; k < width; ++k)
+                            a[k] += sign * b[k];
+                        break;
+                    }
+                    if (instruction.binary == operators::multiply<Value>)
+                    {
+                        for (size_t k = 1; k < width; ++k)
+                            a[k] = b[0] * a[k] + a[0] * b[k];
+                        a[0] *= b[0];
+                        break;
+                    }
+                    const Value y = instruction.binary(a[0], b[0]);
+                    const Value da = symbol.binary.leftDerivative(a[0], b[0], y);
+                    const Value db = symbol.binary.rightDerivative(a[0], b[0], y);
+                    a[0] = y;
+                    for (size_t k = 1; k < width; ++k)
+                        a[k] = da * a[k] + db * b[k];
+                    break;
+                }
+                case OP_FMA:
+                {
+                    top -= 2;
+                    Value* a = stack + width * (top - 1);
+                    const Value* b = a + width;
+                    const Value* c = b + width;
+                    for (size_t k = 1; k < width; ++k)
+                        a[k] = b[0] * a[k] + a[0] * b[k] + c[k];
+                    a[0] = std::fma(a[0], b[0], c[0]);
+                    break;
+                }
+                case OP_STORE:
+                    std::copy_n(stack + width * (top - 1), width, registers + width * instruction.slot);
+                    break;
+                case OP_LOAD:
+                    std::copy_n(registers + width * instruction.slot, width, stack + width * top++);
+                    break;
+                case OP_MIN:
+                case OP_MAX:
+                {
+                    // The derivative of the operand chosen.
+                    --top;
+                    Value* a = stack + width * (top - 1);
+                    const Value* b = a + width;
+                    const Value y = instruction.code == OP_MIN ? operators::minimum(a[0], b[0])
+                                                               : operators::maximum(a[0], b[0]);
+                    if (y != a[0] || std::isnan(y))
+                        std::copy_n(b, width, a);
+                    break;
+                }
+                case OP_BRANCH:
+                    if (stack[width * --top] == 0)
+                        i += instruction.slot;
+                    break;
+                case OP_JUMP:
+                    i += instruction.slot;
+                    break;
+                case OP_SELECT:
+                    break;
+            }
+        }
+        std::copy_n(stack + 1, n, gradient.begin());
+        return stack[0];
+    }
+
+    Value differentiate(const Args& args, Args& gradient) const
+    {
+        const std::vector<string>& parameters = _program.parameters;
+        std::vector<Value> values(parameters.size());
+        std::vector<Value> partials(parameters.size());
+        for (size_t slot = 0; slot < parameters.size(); ++slot)
+            values[slot] = args.at(parameters[slot]);
+        const Value value = differentiate(values, partials);
+        for (size_t slot = 0; slot < parameters.size(); ++slot)
+            gradient.insert_or_assign(parameters[slot], partials[slot]);
+        return value;
+    }
+
+    void evaluateBatch(std::span<const Value* const> columns, const size_t n, Value* out) const
+    {
+        if (columns.size() < _program.parameters.size())
+            throw std::out_of_range("Not enough argument columns");
+#ifdef FUNCTIONS_PROFILING
+        Profile::Batch scope(_tier->profile, n);
+#endif
+
+        Workspace work(_program);
+        for (size_t offset = 0; offset < n; offset += BlockSize)
+        {
+            const size_t m = std::min(BlockSize, n - offset);
+            const Value* result = run(_program.instructions, _program.symbols, columns, offset, m, work);
+            std::copy_n(result, m, out + offset);
+        }
+    }
+
+    void evaluateParallel(std::span<const Value* const> columns,
+                          const size_t n,
+                          Value* out,
+                          ThreadPool& pool = ThreadPool::shared(),
+                          const size_t chunk = ChunkSize) const
+    {
+        if (columns.size() < _program.parameters.size())
+            throw std::out_of_range("Not enough argument columns");
+
+        const size_t step = std::max<size_t>(1, chunk);
+        pool.parallelFor((n + step - 1) / step, [&](const size_t index)
+        {
+            const size_t offset = index * step;
+            std::vector<const Value*> slice(columns.begin(), columns.end());
+            for (const Value*& column: slice)
+                column += offset;
+            evaluateBatch(slice, std::min(step, n - offset), out + offset);
+        });
+    }
+
+    Value operator()(const Args& args) const
     {
         return evaluate(args);
     }
 
-    double operator()() const
+    Value operator()(std::span<const Value> args) const
+    {
+        return evaluate(args);
+    }
+
+    Value operator()() const
     {
         return evaluate();
     }
 };
 
+using Function = BasicFunction<double>;
+
 
 #endif //INC_4_FUNCTIONS_FUNCTION_HPP
@@ -1,51 +1,75 @@
 #ifndef INC_4_FUNCTIONS_GRAMMAR_HPP
 #define INC_4_FUNCTIONS_GRAMMAR_HPP
 
+#include <algorithm>
+#include <functional>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <map>
+#include <span>
+#include <vector>
+
+#include "Trie.hpp"
 
 using std::string;
 using std::map;
 
-class Grammar
+// The part of a grammar that does not depend on the type of the values:
+// which symbols it has, how they are matched in text, and its revisions.
+class Syntax
 {
 public:
     using Precedence = unsigned char;
 
-    typedef double (* Unary)(const double);
-    typedef double (* Binary)(const double, const double);
+    // Looked up by string_view without building a string.
+    template<typename Value>
+    using Table = map<string, Value, std::less<>>;
 
-private:
-    struct BinaryOperator
+    enum Kind : unsigned char
     {
-        Binary binary = nullptr;
-        Precedence precedence = 0;
+        CONSTANT,
+        PREFIX,
+        BINARY,
+        POSTFIX
     };
 
-    map<string, double> _constants;
-    map<string, Unary> _prefixOperators;
-    map<string, BinaryOperator> _binaryOperators;
-    map<string, Unary> _postfixOperators;
-
-public:
-    [[nodiscard]] const map<string, double>& constants() const
+    // A symbol of the grammar. Constants share their names with arguments,
+    // so a parameter name is a CONSTANT too: defining it changes its meaning.
+    struct Name
     {
-        return _constants;
-    }
+        Kind kind;
+        string name;
 
-    [[nodiscard]] const map<string, Unary>& prefix() const
+        bool operator==(const Name&) const = default;
+    };
+
+    // What the change that produced a revision defined; added is false when
+    // the symbol already existed and was replaced.
+    struct Change
     {
-        return _prefixOperators;
-    }
+        Name symbol;
+        bool added;
+    };
 
-    [[nodiscard]] const map<string, BinaryOperator>& binary() const
+private:
+    Trie _prefixTrie;
+    Trie _binaryTrie;
+    Trie _postfixTrie;
+    size_t _revision = 0;
+    // One entry per revision, in order.
+    std::vector<Change> _changes;
+
+public:
+    [[nodiscard]] size_t revision() const
     {
-        return _binaryOperators;
+        return _revision;
     }
 
-    [[nodiscard]] const map<string, Unary>& postfix() const
+    // The changes made after the given revision.
+    [[nodiscard]] std::span<const Change> changes(const size_t since) const
     {
-        return _postfixOperators;
+        return std::span<const Change>(_changes).subspan(std::min(since, _changes.size()));
     }
 
     static size_t matchNumber(const string& s, const size_t start)
@@ -65,63 +89,162 @@ public:
         return length;
     }
 
-    size_t matchPrefix(const string& s, const size_t start)
+    [[nodiscard]] size_t matchPrefix(const string& s, const size_t start) const
     {
-        return match(s, start, _prefixOperators);
+        return _prefixTrie.match(s, start);
     }
 
-    size_t matchBinary(const string& s, const size_t start)
+    [[nodiscard]] size_t matchBinary(const string& s, const size_t start) const
     {
-        return match(s, start, _binaryOperators);
+        return _binaryTrie.match(s, start);
     }
 
-    size_t matchPostfix(const string& s, const size_t start)
+    [[nodiscard]] size_t matchPostfix(const string& s, const size_t start) const
     {
-        return match(s, start, _postfixOperators);
+        return _postfixTrie.match(s, start);
+    }
+
+protected:
+    void record(const Kind kind, const string& name, const bool added)
+    {
+        if (kind == PREFIX)
+            _prefixTrie.insert(name);
+        else if (kind == BINARY)
+            _binaryTrie.insert(name);
+        else if (kind == POSTFIX)
+            _postfixTrie.insert(name);
+        _changes.push_back(Change {Name {kind, name}, added});
+        ++_revision;
     }
+};
+
+
+// The operators of a grammar compute on Value, so a grammar over float or
+// long double registers its own set; double is the Grammar everything
+// defaults to.
+template<typename Value>
+class BasicGrammar : public Syntax
+{
+public:
+    typedef Value (* Unary)(const Value);
+    typedef Value (* Binary)(const Value, const Value);
+
+    typedef void (* UnaryKernel)(const Value* x, Value* result, size_t n);
+    typedef void (* BinaryKernel)(const Value* a, const Value* b, Value* result, size_t n);
 
-    Precedence precedence(const string& signature)
+    // Derivatives receive the operands and the operator's result at them.
+    typedef Value (* UnaryDerivative)(const Value x, const Value y);
+    typedef Value (* BinaryDerivative)(const Value a, const Value b, const Value y);
+
+    // An immutable copy that any number of compilers and threads can share.
+    using Snapshot = std::shared_ptr<const BasicGrammar>;
+
+    struct UnaryOperator
+    {
+        Unary unary = nullptr;
+        UnaryKernel kernel = nullptr;
+        bool pure = true;
+        UnaryDerivative derivative = nullptr;
+    };
+
+    struct BinaryOperator
+    {
+        Binary binary = nullptr;
+        Precedence precedence = 0;
+        BinaryKernel kernel = nullptr;
+        bool pure = true;
+        bool rightAssociative = false;
+        BinaryDerivative leftDerivative = nullptr;
+        BinaryDerivative rightDerivative = nullptr;
+    };
+
+private:
+    Table<Value> _constants;
+    Table<UnaryOperator> _prefixOperators;
+    Table<BinaryOperator> _binaryOperators;
+    Table<UnaryOperator> _postfixOperators;
+
+public:
+    [[nodiscard]] Snapshot snapshot() const
+    {
+        return std::make_shared<const BasicGrammar>(*this);
+    }
+
+    [[nodiscard]] const Table<Value>& constants() const
+    {
+        return _constants;
+    }
+
+    [[nodiscard]] const Table<UnaryOperator>& prefix() const
+    {
+        return _prefixOperators;
+    }
+
+    [[nodiscard]] const Table<BinaryOperator>& binary() const
+    {
+        return _binaryOperators;
+    }
+
+    [[nodiscard]] const Table<UnaryOperator>& postfix() const
+    {
+        return _postfixOperators;
+    }
+
+    [[nodiscard]] Precedence precedence(const std::string_view signature) const
     {
         auto lookup = _binaryOperators.find(signature);
         return (lookup != _binaryOperators.end()) ? lookup->second.precedence : 0;
     }
 
-    void addConstant(const string& name, const double value)
+    void addConstant(const string& name, const Value value)
     {
-        _constants.insert_or_assign(name, value);
+        record(CONSTANT, name, _constants.insert_or_assign(name, value).second);
     }
 
-    void addPrefixOperator(const string& signature, Unary prefix)
+    void addPrefixOperator(const string& signature, const UnaryOperator& prefix)
     {
-        _prefixOperators.insert_or_assign(signature, prefix);
+        record(PREFIX, signature, _prefixOperators.insert_or_assign(signature, prefix).second);
     }
 
-    void addBinaryOperator(const string& signature, Binary binary, const Precedence precedence)
+    void addPrefixOperator(const string& signature,
+                           Unary prefix,
+                           UnaryKernel kernel = nullptr,
+                           UnaryDerivative derivative = nullptr)
     {
-        _binaryOperators.insert_or_assign(signature, BinaryOperator {binary, precedence});
+        addPrefixOperator(signature, UnaryOperator {prefix, kernel, true, derivative});
     }
 
-    void addPostfixOperator(const string& signature, Unary postfix)
+    void addBinaryOperator(const string& signature, const BinaryOperator& binary)
     {
-        _postfixOperators.insert_or_assign(signature, postfix);
+        record(BINARY, signature, _binaryOperators.insert_or_assign(signature, binary).second);
     }
 
-private:
-    template<typename Operator>
-    static size_t match(const string& s, const size_t start, map<string, Operator>& ops)
-    {
-        size_t length;
-        for (const auto& pair: ops)
-        {
-            length = pair.first.length();
-            if (start + length <= s.length() && s.compare(start, length, pair.first) == 0)
-            {
-                return length;
-            }
-        }
-        return 0;
+    void addBinaryOperator(const string& signature,
+                           Binary binary,
+                           const Precedence precedence,
+                           BinaryKernel kernel = nullptr,
+                           BinaryDerivative leftDerivative = nullptr,
+                           BinaryDerivative rightDerivative = nullptr)
+    {
+        addBinaryOperator(signature,
+                          BinaryOperator {binary, precedence, kernel, true, false, leftDerivative, rightDerivative});
+    }
+
+    void addPostfixOperator(const string& signature, const UnaryOperator& postfix)
+    {
+        record(POSTFIX, signature, _postfixOperators.insert_or_assign(signature, postfix).second);
+    }
+
+    void addPostfixOperator(const string& signature,
+                            Unary postfix,
+                            UnaryKernel kernel = nullptr,
+                            UnaryDerivative derivative = nullptr)
+    {
+        addPostfixOperator(signature, UnaryOperator {postfix, kernel, true, derivative});
     }
 };
 
+using Grammar = BasicGrammar<double>;
+
 
 #endif //INC_4_FUNCTIONS_GRAMMAR_HPP
@@ -0,0 +1,309 @@
+#ifndef INC_4_FUNCTIONS_GRAPH_HPP
+#define INC_4_FUNCTIONS_GRAPH_HPP
+
+#include <cstdint>
+#include <memory_resource>
+#include <span>
+#include <vector>
+#include <utility>
+
+#include "Program.hpp"
+
+
+template<typename Value>
+class BasicGraph
+{
+public:
+    using Program = BasicProgram<Value>;
+    using Instruction = BasicInstruction<Value>;
+
+    struct Node
+    {
+        Instruction instruction;
+        unsigned operands[3] = {};
+    };
+
+private:
+    std::pmr::vector<Node> _nodes;
+    // Usually one; a graph merged from several programs has one per program.
+    std::pmr::vector<unsigned> _roots;
+
+public:
+    // The nodes and all scratch storage of the passes over the graph are
+    // drawn from the given memory resource.
+    explicit BasicGraph(std::pmr::memory_resource* memory = std::pmr::get_default_resource())
+        : _nodes(memory), _roots(1, 0u, memory) {}
+
+    explicit BasicGraph(const Program& program, std::pmr::memory_resource* memory = std::pmr::get_default_resource())
+        : _nodes(memory), _roots(1, 0u, memory)
+    {
+        // A conditional being read: its condition, the value of its first
+        // arm and where the arms join, once known.
+        struct Conditional
+        {
+            unsigned condition;
+            unsigned first = 0;
+            size_t join = SIZE_MAX;
+        };
+        std::pmr::vector<unsigned> stack(memory);
+        std::pmr::vector<unsigned> registers(program.registers, memory);
+        std::pmr::vector<Conditional> conditionals(memory);
+        _nodes.reserve(program.instructions.size());
+        for (size_t i = 0; i <= program.instructions.size(); ++i)
+        {
+            while (!conditionals.empty() && conditionals.back().join == i)
+            {
+                Node node {{OP_SELECT}};
+                node.operands[0] = conditionals.back().condition;
+                node.operands[1] = conditionals.back().first;
+                node.operands[2] = stack.back();
+                stack.back() = add(node);
+                conditionals.pop_back();
+            }
+            if (i == program.instructions.size())
+                break;
+
+            const Instruction& instruction = program.instructions[i];
+            switch (instruction.code)
+            {
+                case OP_STORE:
+                    registers[instruction.slot] = stack.back();
+                    continue;
+                case OP_LOAD:
+                    stack.push_back(registers[instruction.slot]);
+                    continue;
+                case OP_BRANCH:
+                    conditionals.push_back(Conditional {stack.back()});
+                    stack.pop_back();
+                    continue;
+                case OP_JUMP:
+                    conditionals.back().first = stack.back();
+                    conditionals.back().join = i + 1 + instruction.slot;
+                    stack.pop_back();
+                    continue;
+                default:
+                    break;
+            }
+            Node node {instruction};
+            const size_t arity = Program::consumes(instruction.code);
+            for (size_t k = arity; k > 0; --k)
+            {
+                node.operands[k - 1] = stack.back();
+                stack.pop_back();
+            }
+            stack.push_back(add(node));
+        }
+        root(stack.back());
+    }
+
+    [[nodiscard]] std::pmr::memory_resource* memory() const
+    {
+        return _nodes.get_allocator().resource();
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        return _nodes.size();
+    }
+
+    const Node& operator[](const unsigned id) const
+    {
+        return _nodes[id];
+    }
+
+    [[nodiscard]] unsigned root() const
+    {
+        return _roots.front();
+    }
+
+    void root(const unsigned id)
+    {
+        _roots.assign(1, id);
+    }
+
+    [[nodiscard]] std::span<const unsigned> roots() const
+    {
+        return _roots;
+    }
+
+    void roots(const std::span<const unsigned> ids)
+    {
+        _roots.assign(ids.begin(), ids.end());
+    }
+
+    // Roots this graph where the roots of the graph it was rewritten from
+    // went, given the id each of that graph's nodes was mapped to.
+    void roots(const BasicGraph& source, const std::span<const unsigned> map)
+    {
+        _roots.clear();
+        for (const unsigned id: source._roots)
+            _roots.push_back(map[id]);
+    }
+
+    unsigned add(const Node& node)
+    {
+        _nodes.push_back(node);
+        return _nodes.size() - 1;
+    }
+
+    // Copies the body of another program into this graph with its parameters
+    // bound to the given nodes, and returns the node of its result. Symbols
+    // are re-interned into the program this graph belongs to.
+    unsigned splice(const Program& callee, const std::span<const unsigned> arguments, Program& program)
+    {
+        const BasicGraph body(callee, memory());
+        std::pmr::vector<unsigned> map(body.size(), memory());
+        for (unsigned id = 0; id < body.size(); ++id)
+        {
+            Node node = body[id];
+            if (node.instruction.code == OP_ARGUMENT)
+            {
+                map[id] = arguments[node.instruction.slot];
+                continue;
+            }
+            if (node.instruction.code == OP_UNARY || node.instruction.code == OP_BINARY)
+                node.instruction.symbol = program.intern(callee.symbols[node.instruction.symbol]);
+            for (size_t i = 0; i < arity(node); ++i)
+                node.operands[i] = map[node.operands[i]];
+            map[id] = add(node);
+        }
+        return map[body.root()];
+    }
+
+    static size_t arity(const Node& node)
+    {
+        return Program::consumes(node.instruction.code);
+    }
+
+    static bool leaf(const Node& node)
+    {
+        return node.instruction.code == OP_CONSTANT || node.instruction.code == OP_ARGUMENT;
+    }
+
+    [[nodiscard]] std::pmr::vector<unsigned> uses() const
+    {
+        std::pmr::vector<unsigned> counts(_nodes.size(), memory());
+        std::pmr::vector<bool> reached(_nodes.size(), false, memory());
+        for (const unsigned id: _roots)
+        {
+            ++counts[id];
+            reached[id] = true;
+        }
+        for (size_t id = _nodes.size(); id > 0; --id)
+        {
+            if (!reached[id - 1])
+                continue;
+            const Node& node = _nodes[id - 1];
+            for (size_t i = 0; i < arity(node); ++i)
+            {
+                ++counts[node.operands[i]];
+                reached[node.operands[i]] = true;
+            }
+        }
+        return counts;
+    }
+
+    // Emits the nodes reachable from the root in postfix order. Leaves are
+    // re-emitted at every use; any other node used more than once is
+    // computed once and kept in a register. With several roots each one is
+    // emitted in turn as a segment that leaves its value on the stack, and
+    // ends receives where every segment ends.
+    //
+    // A conditional becomes its condition, a branch over the first arm, the
+    // first arm, a jump over the second and the second arm, so each arm is
+    // computed only when it is taken. A value kept in a register by one arm
+    // is not available to the other arm or after the join, where it is
+    // computed again if needed.
+    void emit(Program& program, std::vector<size_t>* ends = nullptr) const
+    {
+        struct Visit
+        {
+            unsigned id;
+            size_t next = 0;
+            // Of a conditional: where its last branch or jump is, and how
+            // many values were held in registers when its arm began.
+            size_t jump = 0;
+            size_t held = 0;
+        };
+        const std::pmr::vector<unsigned> counts = uses();
+        std::pmr::vector<long> registers(_nodes.size(), -1, memory());
+        std::pmr::vector<bool> available(_nodes.size(), false, memory());
+        std::pmr::vector<unsigned> held(memory());
+        std::pmr::vector<Visit> pending(memory());
+        std::pmr::vector<Instruction> instructions(memory());
+        program.registers = 0;
+        if (ends)
+            ends->clear();
+
+        auto forget = [&](const size_t count)
+        {
+            for (; held.size() > count; held.pop_back())
+                available[held.back()] = false;
+        };
+        auto land = [&](const size_t jump)
+        {
+            instructions[jump].slot = instructions.size() - jump - 1;
+        };
+
+        for (const unsigned root: _roots)
+        {
+            pending.push_back(Visit {root});
+            while (!pending.empty())
+            {
+                Visit& visit = pending.back();
+                const Node& node = _nodes[visit.id];
+                const bool conditional = node.instruction.code == OP_SELECT;
+                if (visit.next == 0 && available[visit.id])
+                {
+                    Instruction load {OP_LOAD};
+                    load.slot = registers[visit.id];
+                    instructions.push_back(load);
+                    pending.pop_back();
+                    continue;
+                }
+                if (conditional && visit.next > 0)
+                {
+                    const size_t previous = visit.jump;
+                    if (visit.next > 1)
+                        forget(visit.held);
+                    if (visit.next < 3)
+                    {
+                        visit.jump = instructions.size();
+                        visit.held = held.size();
+                        instructions.push_back(Instruction {visit.next == 1 ? OP_BRANCH : OP_JUMP});
+                    }
+                    if (visit.next > 1)
+                        land(previous);
+                }
+                if (visit.next < arity(node))
+                {
+                    pending.push_back(Visit {node.operands[visit.next++]});
+                    continue;
+                }
+
+                if (!conditional)
+                    instructions.push_back(node.instruction);
+                if (counts[visit.id] > 1 && !leaf(node))
+                {
+                    if (registers[visit.id] < 0)
+                        registers[visit.id] = program.registers++;
+                    available[visit.id] = true;
+                    held.push_back(visit.id);
+                    Instruction store {OP_STORE};
+                    store.slot = registers[visit.id];
+                    instructions.push_back(store);
+                }
+                pending.pop_back();
+            }
+            if (ends)
+                ends->push_back(instructions.size());
+        }
+        program.instructions.assign(instructions.begin(), instructions.end());
+        program.measure(ends ? std::span<const size_t>(*ends) : std::span<const size_t>());
+    }
+};
+
+using Graph = BasicGraph<double>;
+
+
+#endif //INC_4_FUNCTIONS_GRAPH_HPP
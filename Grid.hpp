@@ -0,0 +1,348 @@
+#ifndef INC_4_FUNCTIONS_GRID_HPP
+#define INC_4_FUNCTIONS_GRID_HPP
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Function.hpp"
+#include "Graph.hpp"
+#include "Program.hpp"
+#include "ThreadPool.hpp"
+
+using std::string;
+
+
+// A function tabulated over the cartesian product of the values of its
+// parameters. The axes are the loops, outermost first, and the results are
+// written densely in that order, the last axis varying fastest.
+//
+// Every node of the function's graph belongs to the innermost loop whose
+// axis it depends on. Each loop runs the code of its nodes only when its own
+// argument moves and keeps the values deeper loops use in an environment
+// they read like arguments; the innermost loop runs through the batch
+// interpreter. Nodes of impure operators stay in the innermost loop, and a
+// value hoisted out of a conditional's arm is computed whether or not the
+// arm is taken.
+class Grid
+{
+public:
+    struct Axis
+    {
+        string parameter;
+        std::vector<double> values;
+
+        Axis(string parameter, std::vector<double> values) : parameter(std::move(parameter)), values(std::move(values))
+        {
+            if (this->values.empty())
+                throw std::logic_error("The axis of '" + this->parameter + "' has no values");
+        }
+
+        // count evenly spaced values from first to last.
+        Axis(string parameter, const double first, const double last, const size_t count)
+            : Axis(std::move(parameter), std::vector<double>(count))
+        {
+            for (size_t i = 0; i < count; ++i)
+                values[i] = count > 1 ? first + (last - first) * (double) i / (double) (count - 1) : first;
+        }
+    };
+
+private:
+    // The code a loop runs when its argument moves, with a segment per value
+    // it keeps for the deeper loops, written to the environment from first.
+    struct Level
+    {
+        Program program;
+        std::vector<size_t> ends;
+        size_t first = 0;
+    };
+
+    // What one thread evaluates with: the environment, the axes' current
+    // values followed by the kept values, and the interpreters' storage.
+    struct State
+    {
+        std::vector<double> environment;
+        std::unique_ptr<double[]> stack;
+        Function::Workspace work;
+        std::unique_ptr<double[]> broadcast;
+        std::vector<const double*> columns;
+
+        explicit State(const Grid& grid)
+            : environment(grid._slots),
+              stack(std::make_unique<double[]>(grid._stack)),
+              work(grid._levels.back().program),
+              broadcast(std::make_unique<double[]>(grid._broadcast.size() * Function::BlockSize)),
+              columns(grid._slots, nullptr)
+        {
+            for (size_t k = 0; k < grid._broadcast.size(); ++k)
+                columns[grid._broadcast[k]] = broadcast.get() + k * Function::BlockSize;
+        }
+    };
+
+    std::vector<Axis> _axes;
+    std::vector<Level> _levels;
+    std::vector<size_t> _strides;
+    // The environment slots the innermost loop reads, besides its own axis.
+    std::vector<size_t> _broadcast;
+    size_t _slots = 0;
+    size_t _stack = 0;
+
+public:
+    Grid(const Function& function, std::vector<Axis> axes) : _axes(std::move(axes))
+    {
+        if (_axes.empty())
+            throw std::logic_error("A grid needs at least one axis");
+        const Program& body = function.program();
+        const size_t d = _axes.size();
+        std::vector<size_t> axisOf(body.parameters.size(), SIZE_MAX);
+        for (size_t a = 0; a < d; ++a)
+        {
+            auto lookup = std::find(body.parameters.begin(), body.parameters.end(), _axes[a].parameter);
+            if (lookup == body.parameters.end())
+                throw std::logic_error("'" + _axes[a].parameter + "' is not a parameter of the function");
+            if (axisOf[lookup - body.parameters.begin()] != SIZE_MAX)
+                throw std::logic_error("'" + _axes[a].parameter + "' has two axes");
+            axisOf[lookup - body.parameters.begin()] = a;
+        }
+        for (size_t slot = 0; slot < body.parameters.size(); ++slot)
+        {
+            if (axisOf[slot] == SIZE_MAX)
+                throw std::logic_error("No axis for parameter '" + body.parameters[slot] + "'");
+        }
+
+        // The loop of every node; -1 for constants, which belong everywhere.
+        const Graph graph(body);
+        std::vector<long> loop(graph.size());
+        for (unsigned id = 0; id < graph.size(); ++id)
+        {
+            const Graph::Node& node = graph[id];
+            if (node.instruction.code == OP_CONSTANT)
+            {
+                loop[id] = -1;
+                continue;
+            }
+            if (node.instruction.code == OP_ARGUMENT)
+            {
+                loop[id] = (long) axisOf[node.instruction.slot];
+                continue;
+            }
+            long level = 0;
+            for (size_t i = 0; i < Graph::arity(node); ++i)
+                level = std::max(level, loop[node.operands[i]]);
+            loop[id] = pure(node, body) ? level : (long) d - 1;
+        }
+
+        // A value is kept when a deeper loop uses it, the result when it
+        // does not depend on the innermost axis.
+        std::vector<bool> kept(graph.size(), false);
+        for (unsigned id = 0; id < graph.size(); ++id)
+        {
+            const Graph::Node& node = graph[id];
+            for (size_t i = 0; i < Graph::arity(node); ++i)
+                kept[node.operands[i]] = kept[node.operands[i]] || loop[node.operands[i]] < loop[id];
+        }
+        kept[graph.root()] = loop[graph.root()] < (long) d - 1;
+
+        std::vector<size_t> slots(graph.size(), SIZE_MAX);
+        _slots = d;
+        _levels.resize(d);
+        for (size_t level = 0; level < d; ++level)
+        {
+            _levels[level].first = _slots;
+            for (unsigned id = 0; id < graph.size(); ++id)
+            {
+                if (kept[id] && loop[id] == (long) level && !Graph::leaf(graph[id]))
+                    slots[id] = _slots++;
+            }
+        }
+
+        // Named after their axes, and the kept values by their index.
+        std::vector<string> environment;
+        for (const Axis& axis: _axes)
+            environment.push_back(axis.parameter);
+        for (size_t slot = d; slot < _slots; ++slot)
+            environment.push_back("[" + std::to_string(slot - d) + "]");
+
+        for (size_t level = 0; level < d; ++level)
+        {
+            Level& result = _levels[level];
+            result.program.parameters = environment;
+            result.program.symbols = body.symbols;
+            Graph code;
+            std::vector<unsigned> map(graph.size(), UINT_MAX);
+            auto use = [&](const unsigned id) -> unsigned
+            {
+                Graph::Node node = graph[id];
+                if (node.instruction.code == OP_ARGUMENT)
+                {
+                    node.instruction.slot = axisOf[node.instruction.slot];
+                    return code.add(node);
+                }
+                if (node.instruction.code == OP_CONSTANT)
+                    return code.add(node);
+                if (loop[id] == (long) level)
+                    return map[id];
+                Graph::Node load {{OP_ARGUMENT}};
+                load.instruction.slot = slots[id];
+                return code.add(load);
+            };
+            for (unsigned id = 0; id < graph.size(); ++id)
+            {
+                Graph::Node node = graph[id];
+                if (loop[id] != (long) level || Graph::leaf(node))
+                    continue;
+                for (size_t i = 0; i < Graph::arity(node); ++i)
+                    node.operands[i] = use(node.operands[i]);
+                map[id] = code.add(node);
+            }
+
+            std::vector<unsigned> roots;
+            if (level + 1 == d)
+                roots.push_back(use(graph.root()));
+            for (unsigned id = 0; id < graph.size() && level + 1 < d; ++id)
+            {
+                if (slots[id] != SIZE_MAX && loop[id] == (long) level)
+                    roots.push_back(map[id]);
+            }
+            if (roots.empty())
+                continue;
+            code.roots(roots);
+            code.emit(result.program, &result.ends);
+            _stack = std::max(_stack, result.program.depth + result.program.registers);
+        }
+
+        const Program& inner = _levels.back().program;
+        std::vector<bool> read(_slots, false);
+        for (const Instruction& instruction: inner.instructions)
+        {
+            if (instruction.code == OP_ARGUMENT && instruction.slot != d - 1)
+                read[instruction.slot] = true;
+        }
+        for (size_t slot = 0; slot < _slots; ++slot)
+        {
+            if (read[slot])
+                _broadcast.push_back(slot);
+        }
+
+        _strides.assign(d, 1);
+        for (size_t a = d - 1; a > 0; --a)
+            _strides[a - 1] = _strides[a] * _axes[a].values.size();
+    }
+
+    [[nodiscard]] const std::vector<Axis>& axes() const
+    {
+        return _axes;
+    }
+
+    // The number of results, the product of the axes' sizes.
+    [[nodiscard]] size_t size() const
+    {
+        return _strides.front() * _axes.front().values.size();
+    }
+
+    // The code run each time the given axis moves; for the last axis, the
+    // code run at every point.
+    [[nodiscard]] const Program& program(const size_t axis) const
+    {
+        return _levels.at(axis).program;
+    }
+
+    void evaluate(std::span<double> out) const
+    {
+        if (out.size() < size())
+            throw std::out_of_range("Not enough room for the results");
+        State state(*this);
+        walk(state, 0, 0, _axes.front().values.size(), out.data());
+    }
+
+    [[nodiscard]] std::vector<double> evaluate() const
+    {
+        std::vector<double> out(size());
+        evaluate(out);
+        return out;
+    }
+
+    // Splits the outermost axis into slabs of at least chunk results and
+    // evaluates them on the pool.
+    void evaluateParallel(std::span<double> out,
+                          ThreadPool& pool = ThreadPool::shared(),
+                          const size_t chunk = Function::ChunkSize) const
+    {
+        if (out.size() < size())
+            throw std::out_of_range("Not enough room for the results");
+        const size_t n = _axes.front().values.size();
+        const size_t step = std::max<size_t>(1, chunk / _strides.front());
+        pool.parallelFor((n + step - 1) / step, [&](const size_t index)
+        {
+            State state(*this);
+            const size_t first = index * step;
+            walk(state, 0, first, std::min(n, first + step), out.data() + first * _strides.front());
+        });
+    }
+
+private:
+    static bool pure(const Graph::Node& node, const Program& program)
+    {
+        switch (node.instruction.code)
+        {
+            case OP_UNARY:
+                return program.symbols[node.instruction.symbol].unary.pure;
+            case OP_BINARY:
+                return program.symbols[node.instruction.symbol].binary.pure;
+            default:
+                return true;
+        }
+    }
+
+    // Runs indices [first, last) of the axis and every loop inside it.
+    void walk(State& state, const size_t axis, const size_t first, const size_t last, double* out) const
+    {
+        const Level& level = _levels[axis];
+        if (axis + 1 == _axes.size())
+        {
+            inner(state, first, last, out);
+            return;
+        }
+        const std::span<const Instruction> code = level.program.instructions;
+        double* stack = state.stack.get();
+        double* registers = stack + level.program.depth;
+        for (size_t i = first; i < last; ++i)
+        {
+            state.environment[axis] = _axes[axis].values[i];
+            size_t begin = 0;
+            for (size_t k = 0; k < level.ends.size(); ++k)
+            {
+                state.environment[level.first + k] = Function::run(code.subspan(begin, level.ends[k] - begin),
+                                                                   state.environment.data(), stack, registers);
+                begin = level.ends[k];
+            }
+            walk(state, axis + 1, 0, _axes[axis + 1].values.size(), out + (i - first) * _strides[axis]);
+        }
+    }
+
+    void inner(State& state, const size_t first, const size_t last, double* out) const
+    {
+        constexpr size_t BlockSize = Function::BlockSize;
+        const Program& program = _levels.back().program;
+        const size_t n = last - first;
+        for (size_t k = 0; k < _broadcast.size(); ++k)
+            std::fill_n(state.broadcast.get() + k * BlockSize, std::min(n, BlockSize),
+                        state.environment[_broadcast[k]]);
+        for (size_t offset = 0; offset < n; offset += BlockSize)
+        {
+            const size_t m = std::min(BlockSize, n - offset);
+            state.columns[_axes.size() - 1] = _axes.back().values.data() + first + offset;
+            const double* result = Function::run(program.instructions, program.symbols, state.columns, 0, m,
+                                                 state.work);
+            std::copy_n(result, m, out + offset);
+        }
+    }
+};
+
+
+#endif //INC_4_FUNCTIONS_GRID_HPP
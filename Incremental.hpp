@@ -0,0 +1,253 @@
+#ifndef INC_4_FUNCTIONS_INCREMENTAL_HPP
+#define INC_4_FUNCTIONS_INCREMENTAL_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Function.hpp"
+#include "Graph.hpp"
+#include "Operators.hpp"
+#include "Optimizer.hpp"
+#include "Program.hpp"
+
+using std::string;
+
+
+// Evaluates a function again and again as its arguments change a few at a
+// time. The value of every subexpression is kept between evaluations; a
+// changed argument marks the subexpressions that depend on it stale, and
+// evaluate() recomputes only the stale ones the result needs. Conditionals
+// stay lazy: a stale arm that is not taken is left stale until it is.
+// Subexpressions of impure operators are recomputed at every evaluation.
+// An instance holds the state of one caller and is not shared by threads.
+template<typename Value>
+class BasicIncremental
+{
+public:
+    using Function = BasicFunction<Value>;
+    using Program = BasicProgram<Value>;
+    using Graph = BasicGraph<Value>;
+    using Node = typename Graph::Node;
+
+private:
+    struct Visit
+    {
+        unsigned id;
+        size_t next = 0;
+    };
+
+    Program _program;
+    std::vector<Node> _nodes;
+    std::vector<Value> _values;
+    std::vector<char> _stale;
+    // The nodes that are not leaves and depend on each parameter, and those
+    // that depend on an impure operator.
+    std::vector<std::vector<unsigned>> _dependents;
+    std::vector<unsigned> _volatile;
+    // The node of each parameter, if the function reads it.
+    std::vector<long> _arguments;
+    std::vector<Visit> _pending;
+    unsigned _root = 0;
+    size_t _recomputed = 0;
+
+public:
+    // Every argument starts at zero.
+    explicit BasicIncremental(const Function& function) : _program(function.program())
+    {
+        const Graph graph = BasicOptimizer<Value>::eliminate(Graph(_program), _program);
+        _root = graph.root();
+        _nodes.assign(&graph[0], &graph[0] + graph.size());
+        _values.assign(_nodes.size(), 0);
+        _stale.assign(_nodes.size(), 0);
+        // A path from the root visits every node at most once.
+        _pending.resize(_nodes.size());
+        _arguments.assign(_program.parameters.size(), -1);
+
+        const size_t n = _program.parameters.size();
+        std::vector<char> depends(_nodes.size() * (n + 1), 0);
+        for (unsigned id = 0; id < _nodes.size(); ++id)
+        {
+            const Node& node = _nodes[id];
+            char* row = depends.data() + id * (n + 1);
+            switch (node.instruction.code)
+            {
+                case OP_CONSTANT:
+                    _values[id] = node.instruction.value;
+                    continue;
+                case OP_ARGUMENT:
+                    _arguments[node.instruction.slot] = id;
+                    row[node.instruction.slot] = 1;
+                    continue;
+                default:
+                    break;
+            }
+            _stale[id] = 1;
+            for (size_t i = 0; i < Graph::arity(node); ++i)
+            {
+                const char* operand = depends.data() + node.operands[i] * (n + 1);
+                for (size_t k = 0; k <= n; ++k)
+                    row[k] |= operand[k];
+            }
+            row[n] |= !pure(node);
+        }
+
+        _dependents.resize(n);
+        for (unsigned id = 0; id < _nodes.size(); ++id)
+        {
+            if (Graph::leaf(_nodes[id]))
+                continue;
+            for (size_t k = 0; k < n; ++k)
+            {
+                if (depends[id * (n + 1) + k])
+                    _dependents[k].push_back(id);
+            }
+            if (depends[id * (n + 1) + n])
+                _volatile.push_back(id);
+        }
+    }
+
+    [[nodiscard]] const std::vector<string>& parameters() const
+    {
+        return _program.parameters;
+    }
+
+    void set(const size_t slot, const Value value)
+    {
+        if (slot >= _arguments.size())
+            throw std::out_of_range("No parameter " + std::to_string(slot));
+        const long id = _arguments[slot];
+        if (id < 0)
+            return;
+        Value& current = _values[id];
+        if (value == current || (std::isnan(value) && std::isnan(current)))
+            return;
+        current = value;
+        for (const unsigned dependent: _dependents[slot])
+            _stale[dependent] = 1;
+    }
+
+    void set(const string& parameter, const Value value)
+    {
+        auto lookup = std::find(_program.parameters.begin(), _program.parameters.end(), parameter);
+        if (lookup == _program.parameters.end())
+            throw std::out_of_range("Unknown parameter '" + parameter + "'");
+        set(lookup - _program.parameters.begin(), value);
+    }
+
+    // Sets every argument, in parameters() order; only those that differ
+    // from the last ones count as changed.
+    void set(std::span<const Value> args)
+    {
+        if (args.size() < _arguments.size())
+            throw std::out_of_range("Not enough arguments");
+        for (size_t slot = 0; slot < _arguments.size(); ++slot)
+            set(slot, args[slot]);
+    }
+
+    [[nodiscard]] Value evaluate()
+    {
+        // Through local pointers: stores of stale flags may alias anything,
+        // which would otherwise reload every member after each one.
+        const Node* nodes = _nodes.data();
+        Value* values = _values.data();
+        char* stale = _stale.data();
+        Visit* pending = _pending.data();
+        size_t top = 0, recomputed = 0;
+        for (const unsigned id: _volatile)
+            stale[id] = 1;
+        if (stale[_root])
+            pending[top++] = Visit {_root};
+        while (top)
+        {
+            Visit& visit = pending[top - 1];
+            const unsigned id = visit.id;
+            const Node& node = nodes[id];
+            if (node.instruction.code == OP_SELECT)
+            {
+                // The condition first, then only the arm it picks.
+                if (visit.next < 2)
+                {
+                    const unsigned operand = visit.next == 0 ? node.operands[0]
+                                                             : node.operands[values[node.operands[0]] != 0 ? 1 : 2];
+                    ++visit.next;
+                    if (stale[operand])
+                        pending[top++] = Visit {operand};
+                    continue;
+                }
+                values[id] = values[node.operands[values[node.operands[0]] != 0 ? 1 : 2]];
+            }
+            else
+            {
+                const size_t arity = Graph::arity(node);
+                while (visit.next < arity && !stale[node.operands[visit.next]])
+                    ++visit.next;
+                if (visit.next < arity)
+                {
+                    pending[top++] = Visit {node.operands[visit.next++]};
+                    continue;
+                }
+                values[id] = compute(node, values);
+            }
+            stale[id] = 0;
+            ++recomputed;
+            --top;
+        }
+        _recomputed = recomputed;
+        return values[_root];
+    }
+
+    // How many subexpressions the last evaluate() computed.
+    [[nodiscard]] size_t recomputed() const
+    {
+        return _recomputed;
+    }
+
+    // How many subexpressions a full evaluation computes at most.
+    [[nodiscard]] size_t size() const
+    {
+        return std::count_if(_nodes.begin(), _nodes.end(), [](const Node& node) { return !Graph::leaf(node); });
+    }
+
+private:
+    bool pure(const Node& node) const
+    {
+        switch (node.instruction.code)
+        {
+            case OP_UNARY:
+                return _program.symbols[node.instruction.symbol].unary.pure;
+            case OP_BINARY:
+                return _program.symbols[node.instruction.symbol].binary.pure;
+            default:
+                return true;
+        }
+    }
+
+    static Value compute(const Node& node, const Value* values)
+    {
+        auto operand = [&](const size_t i) { return values[node.operands[i]]; };
+        switch (node.instruction.code)
+        {
+            case OP_UNARY:
+                return node.instruction.unary(operand(0));
+            case OP_BINARY:
+                return node.instruction.binary(operand(0), operand(1));
+            case OP_FMA:
+                return std::fma(operand(0), operand(1), operand(2));
+            case OP_MIN:
+                return operators::minimum(operand(0), operand(1));
+            case OP_MAX:
+                return operators::maximum(operand(0), operand(1));
+            default:
+                throw std::logic_error("Invalid instruction");
+        }
+    }
+};
+
+using Incremental = BasicIncremental<double>;
+
+
+#endif //INC_4_FUNCTIONS_INCREMENTAL_HPP
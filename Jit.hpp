@@ -0,0 +1,408 @@
+#ifndef INC_4_FUNCTIONS_JIT_HPP
+#define INC_4_FUNCTIONS_JIT_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+#endif
+
+#include "Operators.hpp"
+#include "Program.hpp"
+
+
+// Native x86-64 code for a Program. The operand stack lives in xmm0..xmm13,
+// xmm14 and xmm15 are scratch registers, the program registers and spilled
+// stack entries live in the frame, and conditionals are jumps. Programs the
+// emitter cannot handle produce no code and keep running in the interpreter.
+class NativeCode
+{
+public:
+    typedef double (* Entry)(const double* args);
+
+    static constexpr size_t StackRegisters = 14;
+
+private:
+    void* _memory = nullptr;
+    size_t _size = 0;
+    Entry _entry = nullptr;
+
+    class Assembler
+    {
+    private:
+        std::vector<unsigned char> _code;
+
+        static constexpr unsigned char RAX = 0;
+        static constexpr unsigned char RSP = 4;
+        static constexpr unsigned char RBX = 3;
+        static constexpr unsigned char Scratch = 15;
+        static constexpr unsigned char Spare = 14;
+
+    public:
+        [[nodiscard]] const std::vector<unsigned char>& code() const
+        {
+            return _code;
+        }
+
+        void prologue(const uint32_t frame)
+        {
+            emit({0x53});                       // push rbx
+            emit({0x48, 0x89, 0xFB});           // mov rbx, rdi
+            emit({0x48, 0x81, 0xEC});           // sub rsp, frame
+            immediate32(frame);
+        }
+
+        void epilogue(const uint32_t frame)
+        {
+            emit({0x48, 0x81, 0xC4});           // add rsp, frame
+            immediate32(frame);
+            emit({0x5B, 0xC3});                 // pop rbx; ret
+        }
+
+        void constant(const unsigned char xmm, const double value)
+        {
+            uint64_t bits;
+            std::memcpy(&bits, &value, sizeof bits);
+            loadRax(bits);
+            emit({0x66, static_cast<unsigned char>(0x48 | (xmm >> 3 << 2)), 0x0F, 0x6E,
+                  static_cast<unsigned char>(0xC0 | (xmm & 7) << 3 | RAX)});     // movq xmm, rax
+        }
+
+        void loadArgument(const unsigned char xmm, const size_t slot)
+        {
+            memory(0xF2, 0x10, xmm, RBX, slot * sizeof(double));                  // movsd xmm, [rbx + disp]
+        }
+
+        void load(const unsigned char xmm, const size_t offset)
+        {
+            memory(0xF2, 0x10, xmm, RSP, offset);                                 // movsd xmm, [rsp + disp]
+        }
+
+        void store(const size_t offset, const unsigned char xmm)
+        {
+            memory(0xF2, 0x11, xmm, RSP, offset);                                 // movsd [rsp + disp], xmm
+        }
+
+        void move(const unsigned char destination, const unsigned char source)
+        {
+            if (destination != source)
+                registers(0xF2, 0x10, destination, source);                       // movsd xmm, xmm
+        }
+
+        void add(const unsigned char a, const unsigned char b) { registers(0xF2, 0x58, a, b); }
+        void multiply(const unsigned char a, const unsigned char b) { registers(0xF2, 0x59, a, b); }
+        void subtract(const unsigned char a, const unsigned char b) { registers(0xF2, 0x5C, a, b); }
+        void divide(const unsigned char a, const unsigned char b) { registers(0xF2, 0x5E, a, b); }
+
+        void negate(const unsigned char xmm)
+        {
+            constant(Scratch, -0.0);
+            registers(0x66, 0x57, xmm, Scratch);                                  // xorpd xmm, xmm15
+        }
+
+        // vfmadd213sd a, b, c: a = b * a + c
+        void fma(const unsigned char a, const unsigned char b, const unsigned char c)
+        {
+            emit({0xC4,
+                  static_cast<unsigned char>((~a & 8) << 4 | 0x40 | (~c & 8) << 2 | 0x02),
+                  static_cast<unsigned char>(0x80 | (~b & 15) << 3 | 0x01),
+                  0xA9,
+                  static_cast<unsigned char>(0xC0 | (a & 7) << 3 | (c & 7))});
+        }
+
+        void minimum(const unsigned char a, const unsigned char b) { registers(0xF2, 0x5D, a, b); }
+        void maximum(const unsigned char a, const unsigned char b) { registers(0xF2, 0x5F, a, b); }
+
+        // Sets a to 1 or 0 by a cmpsd predicate: 0 equal, 1 less, 2 less or
+        // equal, 4 not equal. Swapped compares b with a, for > and >=.
+        void compare(const unsigned char a, const unsigned char b, const unsigned char predicate, const bool swapped)
+        {
+            unsigned char mask = a;
+            if (swapped)
+            {
+                move(Spare, b);
+                mask = Spare;
+            }
+            registers(0xF2, 0xC2, mask, swapped ? a : b);
+            _code.push_back(predicate);                                           // cmpsd mask, other, predicate
+            constant(Scratch, 1.0);
+            registers(0x66, 0x54, mask, Scratch);                                 // andpd mask, xmm15
+            move(a, mask);
+        }
+
+        // Jumps if xmm is zero, not if it is NaN. Returns where the target
+        // goes, for patch().
+        size_t branchIfZero(const unsigned char xmm)
+        {
+            registers(0x66, 0x57, Scratch, Scratch);                              // xorpd xmm15, xmm15
+            registers(0x66, 0x2E, xmm, Scratch);                                  // ucomisd xmm, xmm15
+            emit({0x7A, 0x06, 0x0F, 0x84});                                       // jp +6; je rel32
+            immediate32(0);
+            return _code.size() - 4;
+        }
+
+        size_t jump()
+        {
+            emit({0xE9});                                                         // jmp rel32
+            immediate32(0);
+            return _code.size() - 4;
+        }
+
+        void patch(const size_t at, const size_t target)
+        {
+            const auto relative = static_cast<uint32_t>(static_cast<int32_t>(target - (at + 4)));
+            for (size_t i = 0; i < 4; ++i)
+                _code[at + i] = relative >> (8 * i) & 0xFF;
+        }
+
+        void call(const void* function)
+        {
+            loadRax(reinterpret_cast<uint64_t>(function));
+            emit({0xFF, 0xD0});                                                   // call rax
+        }
+
+    private:
+        void emit(std::initializer_list<unsigned char> bytes)
+        {
+            _code.insert(_code.end(), bytes);
+        }
+
+        void immediate32(const uint32_t value)
+        {
+            for (size_t i = 0; i < 4; ++i)
+                _code.push_back(value >> (8 * i) & 0xFF);
+        }
+
+        void loadRax(const uint64_t value)
+        {
+            emit({0x48, 0xB8});                                                   // mov rax, imm64
+            for (size_t i = 0; i < 8; ++i)
+                _code.push_back(value >> (8 * i) & 0xFF);
+        }
+
+        void rex(const unsigned char reg, const unsigned char rm)
+        {
+            if ((reg | rm) & 8)
+                _code.push_back(0x40 | (reg >> 3 << 2) | (rm >> 3));
+        }
+
+        void registers(const unsigned char prefix, const unsigned char opcode,
+                       const unsigned char reg, const unsigned char rm)
+        {
+            _code.push_back(prefix);
+            rex(reg, rm);
+            emit({0x0F, opcode, static_cast<unsigned char>(0xC0 | (reg & 7) << 3 | (rm & 7))});
+        }
+
+        void memory(const unsigned char prefix, const unsigned char opcode,
+                    const unsigned char reg, const unsigned char base, const size_t displacement)
+        {
+            _code.push_back(prefix);
+            rex(reg, 0);
+            emit({0x0F, opcode, static_cast<unsigned char>(0x80 | (reg & 7) << 3 | base)});
+            if (base == RSP)
+                _code.push_back(0x24);
+            immediate32(displacement);
+        }
+    };
+
+    static double fusedMultiplyAdd(const double a, const double b, const double c)
+    {
+        return std::fma(a, b, c);
+    }
+
+    NativeCode() = default;
+
+public:
+    NativeCode(const NativeCode&) = delete;
+    NativeCode& operator=(const NativeCode&) = delete;
+
+    ~NativeCode()
+    {
+#if defined(__x86_64__) && defined(__unix__)
+        if (_memory)
+            munmap(_memory, _size);
+#endif
+    }
+
+    double operator()(const double* args) const
+    {
+        return _entry(args);
+    }
+
+    static std::unique_ptr<NativeCode> compile(const Program& program)
+    {
+#if defined(__x86_64__) && defined(__unix__)
+        if (program.depth > StackRegisters)
+            return nullptr;
+
+        // Stack registers are spilled from offset 0, the program registers follow.
+        const size_t temporaries = StackRegisters * sizeof(double);
+        const auto frame = static_cast<uint32_t>(
+                (temporaries + program.registers * sizeof(double) + 15) / 16 * 16);
+
+        Assembler assembler;
+        assembler.prologue(frame);
+
+        auto save = [&](const size_t count)
+        {
+            for (unsigned char i = 0; i < count; ++i)
+                assembler.store(i * sizeof(double), i);
+        };
+        auto restore = [&](const size_t count)
+        {
+            for (unsigned char i = 0; i < count; ++i)
+                assembler.load(i, i * sizeof(double));
+        };
+
+        // Where each instruction starts, the stack height jumps arrive with
+        // and the jumps to resolve once every instruction has been placed.
+        const std::vector<Instruction>& instructions = program.instructions;
+        std::vector<size_t> labels(instructions.size() + 1);
+        std::vector<int> heights(instructions.size() + 1, -1);
+        std::vector<std::pair<size_t, size_t>> jumps;
+
+        unsigned char top = 0;
+        for (size_t i = 0; i < instructions.size(); ++i)
+        {
+            const Instruction& instruction = instructions[i];
+            labels[i] = assembler.code().size();
+            if (heights[i] >= 0)
+                top = heights[i];
+            switch (instruction.code)
+            {
+                case OP_CONSTANT:
+                    assembler.constant(top++, instruction.value);
+                    break;
+                case OP_ARGUMENT:
+                    assembler.loadArgument(top++, instruction.slot);
+                    break;
+                case OP_UNARY:
+                {
+                    const unsigned char x = top - 1;
+                    if (instruction.unary == operators::negate<double>)
+                    {
+                        assembler.negate(x);
+                        break;
+                    }
+                    save(x);
+                    assembler.move(0, x);
+                    assembler.call(reinterpret_cast<const void*>(instruction.unary));
+                    assembler.move(x, 0);
+                    restore(x);
+                    break;
+                }
+                case OP_BINARY:
+                {
+                    const unsigned char a = top - 2, b = top - 1;
+                    --top;
+                    if (instruction.binary == operators::add<double>)
+                        assembler.add(a, b);
+                    else if (instruction.binary == operators::subtract<double>)
+                        assembler.subtract(a, b);
+                    else if (instruction.binary == operators::multiply<double>)
+                        assembler.multiply(a, b);
+                    else if (instruction.binary == operators::divide<double>)
+                        assembler.divide(a, b);
+                    else if (instruction.binary == operators::equal<double>)
+                        assembler.compare(a, b, 0, false);
+                    else if (instruction.binary == operators::notEqual<double>)
+                        assembler.compare(a, b, 4, false);
+                    else if (instruction.binary == operators::less<double>)
+                        assembler.compare(a, b, 1, false);
+                    else if (instruction.binary == operators::lessEqual<double>)
+                        assembler.compare(a, b, 2, false);
+                    else if (instruction.binary == operators::greater<double>)
+                        assembler.compare(a, b, 1, true);
+                    else if (instruction.binary == operators::greaterEqual<double>)
+                        assembler.compare(a, b, 2, true);
+                    else
+                    {
+                        save(a);
+                        assembler.move(0, a);
+                        assembler.move(1, b);
+                        assembler.call(reinterpret_cast<const void*>(instruction.binary));
+                        assembler.move(a, 0);
+                        restore(a);
+                    }
+                    break;
+                }
+                case OP_FMA:
+                {
+                    const unsigned char a = top - 3, b = top - 2, c = top - 1;
+                    top -= 2;
+                    if (simd::Fused)
+                    {
+                        assembler.fma(a, b, c);
+                        break;
+                    }
+                    save(a);
+                    assembler.move(0, a);
+                    assembler.move(1, b);
+                    assembler.move(2, c);
+                    assembler.call(reinterpret_cast<const void*>(fusedMultiplyAdd));
+                    assembler.move(a, 0);
+                    restore(a);
+                    break;
+                }
+                case OP_STORE:
+                    assembler.store(temporaries + instruction.slot * sizeof(double), top - 1);
+                    break;
+                case OP_LOAD:
+                    assembler.load(top++, temporaries + instruction.slot * sizeof(double));
+                    break;
+                case OP_MIN:
+                    --top;
+                    assembler.minimum(top - 1, top);
+                    break;
+                case OP_MAX:
+                    --top;
+                    assembler.maximum(top - 1, top);
+                    break;
+                case OP_BRANCH:
+                    --top;
+                    heights[i + 1 + instruction.slot] = top;
+                    jumps.emplace_back(assembler.branchIfZero(top), i + 1 + instruction.slot);
+                    break;
+                case OP_JUMP:
+                    heights[i + 1 + instruction.slot] = top;
+                    jumps.emplace_back(assembler.jump(), i + 1 + instruction.slot);
+                    break;
+                default:
+                    return nullptr;
+            }
+        }
+        labels[instructions.size()] = assembler.code().size();
+        for (const auto& [at, target]: jumps)
+            assembler.patch(at, labels[target]);
+        assembler.epilogue(frame);
+
+        const std::vector<unsigned char>& code = assembler.code();
+        void* memory = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            return nullptr;
+        std::memcpy(memory, code.data(), code.size());
+        if (mprotect(memory, code.size(), PROT_READ | PROT_EXEC) != 0)
+        {
+            munmap(memory, code.size());
+            return nullptr;
+        }
+
+        std::unique_ptr<NativeCode> native(new NativeCode());
+        native->_memory = memory;
+        native->_size = code.size();
+        native->_entry = reinterpret_cast<Entry>(memory);
+        return native;
+#else
+        return nullptr;
+#endif
+    }
+};
+
+
+#endif //INC_4_FUNCTIONS_JIT_HPP
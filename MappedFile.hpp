@@ -0,0 +1,86 @@
+#ifndef INC_4_FUNCTIONS_MAPPEDFILE_HPP
+#define INC_4_FUNCTIONS_MAPPEDFILE_HPP
+
+#include <algorithm>
+#include <string>
+#include <system_error>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::string;
+
+
+// A read-only view of a whole file. The mapping only reserves address
+// space, so files larger than RAM are paged in as they are read.
+class MappedFile
+{
+private:
+    const char* _data = nullptr;
+    size_t _size = 0;
+
+public:
+    explicit MappedFile(const string& path)
+    {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), path);
+        struct stat status {};
+        if (fstat(fd, &status) < 0)
+        {
+            const int error = errno;
+            close(fd);
+            throw std::system_error(error, std::generic_category(), path);
+        }
+        _size = status.st_size;
+        if (_size > 0)
+        {
+            void* data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED)
+            {
+                const int error = errno;
+                close(fd);
+                throw std::system_error(error, std::generic_category(), path);
+            }
+            _data = static_cast<const char*>(data);
+            madvise(data, _size, MADV_SEQUENTIAL);
+        }
+        close(fd);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile()
+    {
+        if (_data)
+            munmap(const_cast<char*>(_data), _size);
+    }
+
+    [[nodiscard]] const char* data() const
+    {
+        return _data;
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        return _size;
+    }
+
+    // Drops the pages wholly inside [offset, offset + length) from memory;
+    // they are read again from the file if touched later.
+    void release(const size_t offset, const size_t length) const
+    {
+        const auto page = (size_t) sysconf(_SC_PAGESIZE);
+        const size_t begin = (offset + page - 1) / page * page;
+        const size_t end = std::min(offset + length, _size) / page * page;
+        if (_data && begin < end)
+            madvise(const_cast<char*>(_data) + begin, end - begin, MADV_DONTNEED);
+    }
+};
+
+
+#endif //INC_4_FUNCTIONS_MAPPEDFILE_HPP
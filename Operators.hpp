@@ -0,0 +1,361 @@
+#ifndef INC_4_FUNCTIONS_OPERATORS_HPP
+#define INC_4_FUNCTIONS_OPERATORS_HPP
+
+#include <cmath>
+#include <cstddef>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+
+namespace simd
+{
+#if defined(FP_FAST_FMA)
+    constexpr bool Fused = true;
+#else
+    constexpr bool Fused = false;
+#endif
+
+    // Whether fma on T is as fast as a multiplication; for long double it
+    // never is, the x87 unit has no fused multiply-add.
+    template<typename T>
+    constexpr bool FusedFor = false;
+    template<> constexpr bool FusedFor<double> = Fused;
+#if defined(FP_FAST_FMAF)
+    template<> constexpr bool FusedFor<float> = true;
+#endif
+
+    // Lanes in a vector of T; 0 for a type without a vector path, such as
+    // long double, whose kernels run as plain loops.
+    template<typename T>
+    constexpr size_t Width = 0;
+
+#if defined(__AVX__)
+    using Pack = __m256d;
+    using FloatPack = __m256;
+    template<> constexpr size_t Width<double> = 4;
+    template<> constexpr size_t Width<float> = 8;
+    constexpr bool Rounding = true;
+
+    inline Pack load(const double* p) { return _mm256_loadu_pd(p); }
+    inline void store(double* p, const Pack x) { _mm256_storeu_pd(p, x); }
+    inline Pack broadcast(const double x) { return _mm256_set1_pd(x); }
+    inline Pack add(const Pack a, const Pack b) { return _mm256_add_pd(a, b); }
+    inline Pack subtract(const Pack a, const Pack b) { return _mm256_sub_pd(a, b); }
+    inline Pack multiply(const Pack a, const Pack b) { return _mm256_mul_pd(a, b); }
+    inline Pack divide(const Pack a, const Pack b) { return _mm256_div_pd(a, b); }
+#if defined(__FMA__)
+    inline Pack fma(const Pack a, const Pack b, const Pack c) { return _mm256_fmadd_pd(a, b, c); }
+#endif
+    inline Pack negate(const Pack x) { return _mm256_xor_pd(x, _mm256_set1_pd(-0.0)); }
+    inline Pack floor(const Pack x) { return _mm256_floor_pd(x); }
+    inline Pack ceil(const Pack x) { return _mm256_ceil_pd(x); }
+    inline Pack trunc(const Pack x) { return _mm256_round_pd(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC); }
+    inline Pack abs(const Pack x) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), x); }
+    inline Pack sign(const Pack x) { return _mm256_and_pd(x, _mm256_set1_pd(-0.0)); }
+    inline Pack mask(const Pack a, const Pack b) { return _mm256_cmp_pd(a, b, _CMP_GE_OQ); }
+    inline Pack select(const Pack mask, const Pack x) { return _mm256_and_pd(mask, x); }
+    inline Pack combine(const Pack a, const Pack b) { return _mm256_or_pd(a, b); }
+
+    inline FloatPack load(const float* p) { return _mm256_loadu_ps(p); }
+    inline void store(float* p, const FloatPack x) { _mm256_storeu_ps(p, x); }
+    inline FloatPack broadcast(const float x) { return _mm256_set1_ps(x); }
+    inline FloatPack add(const FloatPack a, const FloatPack b) { return _mm256_add_ps(a, b); }
+    inline FloatPack subtract(const FloatPack a, const FloatPack b) { return _mm256_sub_ps(a, b); }
+    inline FloatPack multiply(const FloatPack a, const FloatPack b) { return _mm256_mul_ps(a, b); }
+    inline FloatPack divide(const FloatPack a, const FloatPack b) { return _mm256_div_ps(a, b); }
+#if defined(__FMA__)
+    inline FloatPack fma(const FloatPack a, const FloatPack b, const FloatPack c) { return _mm256_fmadd_ps(a, b, c); }
+#endif
+    inline FloatPack negate(const FloatPack x) { return _mm256_xor_ps(x, _mm256_set1_ps(-0.0f)); }
+    inline FloatPack floor(const FloatPack x) { return _mm256_floor_ps(x); }
+    inline FloatPack ceil(const FloatPack x) { return _mm256_ceil_ps(x); }
+    inline FloatPack trunc(const FloatPack x) { return _mm256_round_ps(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC); }
+    inline FloatPack abs(const FloatPack x) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), x); }
+    inline FloatPack sign(const FloatPack x) { return _mm256_and_ps(x, _mm256_set1_ps(-0.0f)); }
+    inline FloatPack mask(const FloatPack a, const FloatPack b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+    inline FloatPack select(const FloatPack mask, const FloatPack x) { return _mm256_and_ps(mask, x); }
+    inline FloatPack combine(const FloatPack a, const FloatPack b) { return _mm256_or_ps(a, b); }
+#elif defined(__SSE2__)
+    using Pack = __m128d;
+    using FloatPack = __m128;
+    template<> constexpr size_t Width<double> = 2;
+    template<> constexpr size_t Width<float> = 4;
+#if defined(__SSE4_1__)
+    constexpr bool Rounding = true;
+#else
+    constexpr bool Rounding = false;
+#endif
+
+    inline Pack load(const double* p) { return _mm_loadu_pd(p); }
+    inline void store(double* p, const Pack x) { _mm_storeu_pd(p, x); }
+    inline Pack broadcast(const double x) { return _mm_set1_pd(x); }
+    inline Pack add(const Pack a, const Pack b) { return _mm_add_pd(a, b); }
+    inline Pack subtract(const Pack a, const Pack b) { return _mm_sub_pd(a, b); }
+    inline Pack multiply(const Pack a, const Pack b) { return _mm_mul_pd(a, b); }
+    inline Pack divide(const Pack a, const Pack b) { return _mm_div_pd(a, b); }
+#if defined(__FMA__)
+    inline Pack fma(const Pack a, const Pack b, const Pack c) { return _mm_fmadd_pd(a, b, c); }
+#endif
+    inline Pack negate(const Pack x) { return _mm_xor_pd(x, _mm_set1_pd(-0.0)); }
+#if defined(__SSE4_1__)
+    inline Pack floor(const Pack x) { return _mm_floor_pd(x); }
+    inline Pack ceil(const Pack x) { return _mm_ceil_pd(x); }
+    inline Pack trunc(const Pack x) { return _mm_round_pd(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC); }
+#else
+    inline Pack floor(const Pack x) { return x; }
+    inline Pack ceil(const Pack x) { return x; }
+    inline Pack trunc(const Pack x) { return x; }
+#endif
+    inline Pack abs(const Pack x) { return _mm_andnot_pd(_mm_set1_pd(-0.0), x); }
+    inline Pack sign(const Pack x) { return _mm_and_pd(x, _mm_set1_pd(-0.0)); }
+    inline Pack mask(const Pack a, const Pack b) { return _mm_cmpge_pd(a, b); }
+    inline Pack select(const Pack mask, const Pack x) { return _mm_and_pd(mask, x); }
+    inline Pack combine(const Pack a, const Pack b) { return _mm_or_pd(a, b); }
+
+    inline FloatPack load(const float* p) { return _mm_loadu_ps(p); }
+    inline void store(float* p, const FloatPack x) { _mm_storeu_ps(p, x); }
+    inline FloatPack broadcast(const float x) { return _mm_set1_ps(x); }
+    inline FloatPack add(const FloatPack a, const FloatPack b) { return _mm_add_ps(a, b); }
+    inline FloatPack subtract(const FloatPack a, const FloatPack b) { return _mm_sub_ps(a, b); }
+    inline FloatPack multiply(const FloatPack a, const FloatPack b) { return _mm_mul_ps(a, b); }
+    inline FloatPack divide(const FloatPack a, const FloatPack b) { return _mm_div_ps(a, b); }
+#if defined(__FMA__)
+    inline FloatPack fma(const FloatPack a, const FloatPack b, const FloatPack c) { return _mm_fmadd_ps(a, b, c); }
+#endif
+    inline FloatPack negate(const FloatPack x) { return _mm_xor_ps(x, _mm_set1_ps(-0.0f)); }
+#if defined(__SSE4_1__)
+    inline FloatPack floor(const FloatPack x) { return _mm_floor_ps(x); }
+    inline FloatPack ceil(const FloatPack x) { return _mm_ceil_ps(x); }
+    inline FloatPack trunc(const FloatPack x) { return _mm_round_ps(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC); }
+#else
+    inline FloatPack floor(const FloatPack x) { return x; }
+    inline FloatPack ceil(const FloatPack x) { return x; }
+    inline FloatPack trunc(const FloatPack x) { return x; }
+#endif
+    inline FloatPack abs(const FloatPack x) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), x); }
+    inline FloatPack sign(const FloatPack x) { return _mm_and_ps(x, _mm_set1_ps(-0.0f)); }
+    inline FloatPack mask(const FloatPack a, const FloatPack b) { return _mm_cmpge_ps(a, b); }
+    inline FloatPack select(const FloatPack mask, const FloatPack x) { return _mm_and_ps(mask, x); }
+    inline FloatPack combine(const FloatPack a, const FloatPack b) { return _mm_or_ps(a, b); }
+#else
+    constexpr bool Rounding = false;
+#endif
+
+    template<typename T, typename Vector, typename Scalar>
+    inline void transform(const T* x, T* result, const size_t n, Vector vector, Scalar scalar)
+    {
+        size_t i = 0;
+        if constexpr (Width<T> > 0)
+            for (; i + Width<T> <= n; i += Width<T>)
+                store(result + i, vector(load(x + i)));
+        for (; i < n; ++i)
+            result[i] = scalar(x[i]);
+    }
+
+    template<typename T, typename Vector, typename Scalar>
+    inline void transform(const T* a, const T* b, T* result, const size_t n, Vector vector, Scalar scalar)
+    {
+        size_t i = 0;
+        if constexpr (Width<T> > 0)
+            for (; i + Width<T> <= n; i += Width<T>)
+                store(result + i, vector(load(a + i), load(b + i)));
+        for (; i < n; ++i)
+            result[i] = scalar(a[i], b[i]);
+    }
+}
+
+
+namespace operators
+{
+    template<typename T> inline T negate(const T x) { return -x; }
+    template<typename T> inline T exp(const T x) { return std::exp(x); }
+    template<typename T> inline T sin(const T x) { return std::sin(x); }
+    template<typename T> inline T cos(const T x) { return std::cos(x); }
+    template<typename T> inline T floor(const T x) { return std::floor(x); }
+    template<typename T> inline T ceil(const T x) { return std::ceil(x); }
+    template<typename T> inline T round(const T x) { return std::round(x); }
+
+    template<typename T> inline T add(const T a, const T b) { return a + b; }
+    template<typename T> inline T subtract(const T a, const T b) { return a - b; }
+    template<typename T> inline T multiply(const T a, const T b) { return a * b; }
+    template<typename T> inline T divide(const T a, const T b) { return a / b; }
+    template<typename T> inline T power(const T a, const T b) { return std::pow(a, b); }
+
+    // Comparisons give 1 or 0, and false with a NaN except for !=.
+    template<typename T> inline T less(const T a, const T b) { return a < b; }
+    template<typename T> inline T lessEqual(const T a, const T b) { return a <= b; }
+    template<typename T> inline T greater(const T a, const T b) { return a > b; }
+    template<typename T> inline T greaterEqual(const T a, const T b) { return a >= b; }
+    template<typename T> inline T equal(const T a, const T b) { return a == b; }
+    template<typename T> inline T notEqual(const T a, const T b) { return a != b; }
+
+    // The built-in min and max, folded pairwise over their arguments. With
+    // a NaN they return b, as minsd and maxsd do.
+    template<typename T> inline T minimum(const T a, const T b) { return a < b ? a : b; }
+    template<typename T> inline T maximum(const T a, const T b) { return a > b ? a : b; }
+
+    template<typename T>
+    inline T factorial(const T x)
+    {
+        auto n = (size_t) x;
+        size_t result = 1;
+        while (n > 1)
+        {
+            result *= n--;
+        }
+        return (T) result;
+    }
+}
+
+
+// Derivatives of the built-in operators with respect to each operand.
+// Rounding, the factorial and comparisons are piecewise constant, so their
+// derivative is taken to be zero everywhere.
+namespace derivatives
+{
+    template<typename T> inline T zero(const T, const T) { return 0; }
+    template<typename T> inline T zero(const T, const T, const T) { return 0; }
+    template<typename T> inline T negate(const T, const T) { return -1; }
+    template<typename T> inline T exp(const T, const T y) { return y; }
+    template<typename T> inline T sin(const T x, const T) { return std::cos(x); }
+    template<typename T> inline T cos(const T x, const T) { return -std::sin(x); }
+
+    template<typename T> inline T one(const T, const T, const T) { return 1; }
+    template<typename T> inline T minusOne(const T, const T, const T) { return -1; }
+    template<typename T> inline T multiplyLeft(const T, const T b, const T) { return b; }
+    template<typename T> inline T multiplyRight(const T a, const T, const T) { return a; }
+    template<typename T> inline T divideLeft(const T, const T b, const T) { return 1 / b; }
+    template<typename T> inline T divideRight(const T, const T b, const T y) { return -y / b; }
+    template<typename T>
+    inline T powerLeft(const T a, const T b, const T)
+    {
+        return b == 0 ? 0 : b * std::pow(a, b - 1);
+    }
+    template<typename T>
+    inline T powerRight(const T a, const T, const T y)
+    {
+        return a > 0 ? y * std::log(a) : 0;
+    }
+}
+
+
+namespace kernels
+{
+    template<typename T>
+    inline void negate(const T* x, T* result, const size_t n)
+    {
+        simd::transform(x, result, n,
+                        [](auto v) { return simd::negate(v); },
+                        operators::negate<T>);
+    }
+
+    template<typename T>
+    inline void floor(const T* x, T* result, const size_t n)
+    {
+        if constexpr (simd::Rounding)
+            simd::transform(x, result, n,
+                            [](auto v) { return simd::floor(v); },
+                            operators::floor<T>);
+        else
+            for (size_t i = 0; i < n; ++i) result[i] = operators::floor(x[i]);
+    }
+
+    template<typename T>
+    inline void ceil(const T* x, T* result, const size_t n)
+    {
+        if constexpr (simd::Rounding)
+            simd::transform(x, result, n,
+                            [](auto v) { return simd::ceil(v); },
+                            operators::ceil<T>);
+        else
+            for (size_t i = 0; i < n; ++i) result[i] = operators::ceil(x[i]);
+    }
+
+    // std::round breaks ties away from zero, which no rounding mode of the
+    // vector units does, so the fraction is tested explicitly. The sign of x
+    // goes back on the result, as -0.0 + 0.0 would drop it for -0.5 < x <= -0.
+    template<typename T>
+    inline void round(const T* x, T* result, const size_t n)
+    {
+        if constexpr (simd::Rounding && simd::Width<T> > 0)
+            simd::transform(x, result, n,
+                            [](auto v)
+                            {
+                                auto whole = simd::trunc(v);
+                                auto tie = simd::mask(simd::abs(simd::subtract(v, whole)),
+                                                      simd::broadcast(T(0.5)));
+                                auto sign = simd::sign(v);
+                                auto step = simd::combine(sign, simd::broadcast(T(1)));
+                                return simd::combine(sign, simd::add(whole, simd::select(tie, step)));
+                            },
+                            operators::round<T>);
+        else
+            for (size_t i = 0; i < n; ++i) result[i] = operators::round(x[i]);
+    }
+
+    template<typename T>
+    inline void add(const T* a, const T* b, T* result, const size_t n)
+    {
+        simd::transform(a, b, result, n,
+                        [](auto x, auto y) { return simd::add(x, y); },
+                        operators::add<T>);
+    }
+
+    template<typename T>
+    inline void subtract(const T* a, const T* b, T* result, const size_t n)
+    {
+        simd::transform(a, b, result, n,
+                        [](auto x, auto y) { return simd::subtract(x, y); },
+                        operators::subtract<T>);
+    }
+
+    template<typename T>
+    inline void multiply(const T* a, const T* b, T* result, const size_t n)
+    {
+        simd::transform(a, b, result, n,
+                        [](auto x, auto y) { return simd::multiply(x, y); },
+                        operators::multiply<T>);
+    }
+
+    template<typename T>
+    inline void divide(const T* a, const T* b, T* result, const size_t n)
+    {
+        simd::transform(a, b, result, n,
+                        [](auto x, auto y) { return simd::divide(x, y); },
+                        operators::divide<T>);
+    }
+
+    // Comparisons, min, max and the blend of the arms of a conditional are
+    // plain loops, which the compiler turns into vector compares and blends.
+    template<typename T, T (* Operator)(T, T)>
+    inline void elementwise(const T* a, const T* b, T* result, const size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            result[i] = Operator(a[i], b[i]);
+    }
+
+    template<typename T>
+    inline void select(const T* condition, const T* a, const T* b, T* result, const size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            result[i] = condition[i] != 0 ? a[i] : b[i];
+    }
+
+    template<typename T>
+    inline void fma(const T* a, const T* b, const T* c, T* result, const size_t n)
+    {
+        size_t i = 0;
+#if defined(__FMA__)
+        if constexpr (simd::Width<T> > 0)
+            for (; i + simd::Width<T> <= n; i += simd::Width<T>)
+                simd::store(result + i, simd::fma(simd::load(a + i), simd::load(b + i), simd::load(c + i)));
+#endif
+        for (; i < n; ++i)
+            result[i] = std::fma(a[i], b[i], c[i]);
+    }
+}
+
+
+#endif //INC_4_FUNCTIONS_OPERATORS_HPP
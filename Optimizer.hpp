@@ -0,0 +1,339 @@
+#ifndef INC_4_FUNCTIONS_OPTIMIZER_HPP
+#define INC_4_FUNCTIONS_OPTIMIZER_HPP
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <memory_resource>
+#include <vector>
+
+#include "Grammar.hpp"
+#include "Graph.hpp"
+#include "Operators.hpp"
+#include "Program.hpp"
+
+
+// What does not depend on the value type the optimizer works on.
+class Optimization
+{
+public:
+    enum Level : unsigned char
+    {
+        O0,
+        O1,
+        O2
+    };
+
+    static constexpr double MaxPower = 16;
+};
+
+
+template<typename Value>
+class BasicOptimizer : public Optimization
+{
+public:
+    using Grammar = BasicGrammar<Value>;
+    using Program = BasicProgram<Value>;
+    using Instruction = BasicInstruction<Value>;
+    using Graph = BasicGraph<Value>;
+    using Node = typename Graph::Node;
+
+private:
+    const Grammar& _grammar;
+    Level _level;
+
+public:
+    BasicOptimizer(const Grammar& grammar, const Level level) : _grammar(grammar), _level(level) {}
+
+    [[nodiscard]] Level level() const
+    {
+        return _level;
+    }
+
+    void level(const Level level)
+    {
+        _level = level;
+    }
+
+    void optimize(Program& program) const
+    {
+        if (_level == O0)
+            return;
+        Graph graph(program);
+        optimize(graph, program);
+        graph.emit(program);
+    }
+
+    void optimize(Graph& graph, Program& program) const
+    {
+        if (_level == O0)
+            return;
+        graph = eliminate(fold(graph, program), program);
+        if (_level >= O2)
+        {
+            graph = reduce(graph, program);
+            if (simd::FusedFor<Value>)
+                graph = fuse(graph);
+        }
+    }
+
+private:
+    static Node constant(const Value value)
+    {
+        Node node {{OP_CONSTANT}};
+        node.instruction.value = value;
+        return node;
+    }
+
+    static bool pure(const Node& node, const Program& program)
+    {
+        switch (node.instruction.code)
+        {
+            case OP_UNARY:
+                return program.symbols[node.instruction.symbol].unary.pure;
+            case OP_BINARY:
+                return program.symbols[node.instruction.symbol].binary.pure;
+            default:
+                return true;
+        }
+    }
+
+    static bool calls(const Node& node, const typename Grammar::Binary binary)
+    {
+        return node.instruction.code == OP_BINARY && node.instruction.binary == binary;
+    }
+
+    static Graph fold(const Graph& graph, const Program& program)
+    {
+        Graph result(graph.memory());
+        std::pmr::vector<unsigned> map(graph.size(), graph.memory());
+        for (unsigned id = 0; id < graph.size(); ++id)
+        {
+            Node node = graph[id];
+            bool constant = !Graph::leaf(node) && pure(node, program);
+            for (size_t i = 0; i < Graph::arity(node); ++i)
+            {
+                node.operands[i] = map[node.operands[i]];
+                constant = constant && result[node.operands[i]].instruction.code == OP_CONSTANT;
+            }
+            // A constant condition leaves only the arm it takes.
+            if (node.instruction.code == OP_SELECT && result[node.operands[0]].instruction.code == OP_CONSTANT)
+            {
+                map[id] = node.operands[result[node.operands[0]].instruction.value != 0 ? 1 : 2];
+                continue;
+            }
+            if (constant)
+            {
+                auto value = [&](const size_t i) { return result[node.operands[i]].instruction.value; };
+                switch (node.instruction.code)
+                {
+                    case OP_UNARY:
+                        node = BasicOptimizer::constant(node.instruction.unary(value(0)));
+                        break;
+                    case OP_BINARY:
+                        node = BasicOptimizer::constant(node.instruction.binary(value(0), value(1)));
+                        break;
+                    case OP_FMA:
+                        node = BasicOptimizer::constant(std::fma(value(0), value(1), value(2)));
+                        break;
+                    case OP_MIN:
+                        node = BasicOptimizer::constant(operators::minimum(value(0), value(1)));
+                        break;
+                    case OP_MAX:
+                        node = BasicOptimizer::constant(operators::maximum(value(0), value(1)));
+                        break;
+                    default:
+                        break;
+                }
+            }
+            map[id] = result.add(node);
+        }
+        result.roots(graph, map);
+        return result;
+    }
+
+public:
+    // Merges structurally identical pure nodes, so a sub-formula repeated
+    // within an expression or brought in by several calls is computed once.
+    static Graph eliminate(const Graph& graph, const Program& program)
+    {
+        // The code, the bits of the payload and the operands. The payload is
+        // the member of the union the code uses; of a value only the bytes
+        // that hold it count, as x87 extended precision pads its ten to
+        // twelve or sixteen and the padding is not part of the value.
+        constexpr size_t Significant = std::numeric_limits<Value>::digits == 64 ? 10 : sizeof(Value);
+        constexpr size_t Payload = std::max({Significant, sizeof(size_t), sizeof(typename Grammar::Unary),
+                                             sizeof(typename Grammar::Binary)});
+        constexpr size_t Words = (Payload + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+        using Key = std::array<uint64_t, 1 + Words + 3>;
+        Graph result(graph.memory());
+        std::pmr::vector<unsigned> map(graph.size(), graph.memory());
+        std::pmr::map<Key, unsigned> seen(graph.memory());
+        for (unsigned id = 0; id < graph.size(); ++id)
+        {
+            Node node = graph[id];
+            for (size_t i = 0; i < Graph::arity(node); ++i)
+                node.operands[i] = map[node.operands[i]];
+            if (!pure(node, program))
+            {
+                map[id] = result.add(node);
+                continue;
+            }
+            Key key {node.instruction.code};
+            const Instruction& instruction = node.instruction;
+            switch (instruction.code)
+            {
+                case OP_CONSTANT:
+                    std::memcpy(&key[1], &instruction.value, Significant);
+                    break;
+                case OP_UNARY:
+                    std::memcpy(&key[1], &instruction.unary, sizeof instruction.unary);
+                    break;
+                case OP_BINARY:
+                    std::memcpy(&key[1], &instruction.binary, sizeof instruction.binary);
+                    break;
+                case OP_ARGUMENT:
+                case OP_STORE:
+                case OP_LOAD:
+                case OP_BRANCH:
+                case OP_JUMP:
+                    std::memcpy(&key[1], &instruction.slot, sizeof instruction.slot);
+                    break;
+                default:
+                    break;
+            }
+            for (size_t i = 0; i < Graph::arity(node); ++i)
+                key[1 + Words + i] = node.operands[i];
+            auto [lookup, inserted] = seen.try_emplace(key, result.size());
+            if (inserted)
+                result.add(node);
+            map[id] = lookup->second;
+        }
+        result.roots(graph, map);
+        return result;
+    }
+
+private:
+    // Rewrites x^n for small integer n into a chain of multiplications by
+    // repeated squaring.
+    Graph reduce(const Graph& graph, Program& program) const
+    {
+        Node multiply {{OP_BINARY}};
+        if (!resolve(operators::multiply<Value>, program, multiply.instruction))
+            return graph;
+
+        Graph result(graph.memory());
+        std::pmr::vector<unsigned> map(graph.size(), graph.memory());
+        for (unsigned id = 0; id < graph.size(); ++id)
+        {
+            Node node = graph[id];
+            for (size_t i = 0; i < Graph::arity(node); ++i)
+                node.operands[i] = map[node.operands[i]];
+
+            if (!calls(node, operators::power<Value>))
+            {
+                map[id] = result.add(node);
+                continue;
+            }
+            const Node& exponent = result[node.operands[1]];
+            if (exponent.instruction.code != OP_CONSTANT
+                || exponent.instruction.value != std::floor(exponent.instruction.value)
+                || exponent.instruction.value < 0
+                || exponent.instruction.value > MaxPower)
+            {
+                map[id] = result.add(node);
+                continue;
+            }
+
+            auto n = (unsigned) exponent.instruction.value;
+            if (n == 0)
+            {
+                map[id] = result.add(constant(1));
+                continue;
+            }
+            unsigned square = node.operands[0];
+            long product = -1;
+            while (true)
+            {
+                if (n & 1)
+                {
+                    if (product < 0)
+                    {
+                        product = square;
+                    }
+                    else
+                    {
+                        multiply.operands[0] = product;
+                        multiply.operands[1] = square;
+                        product = result.add(multiply);
+                    }
+                }
+                n >>= 1;
+                if (n == 0)
+                    break;
+                multiply.operands[0] = multiply.operands[1] = square;
+                square = result.add(multiply);
+            }
+            map[id] = product;
+        }
+        result.roots(graph, map);
+        return result;
+    }
+
+    // Fuses a*b+c and c+a*b into a single fused multiply-add where the
+    // hardware executes it natively. A product that has other users is
+    // still fused, so the result does not depend on what CSE shared.
+    static Graph fuse(const Graph& graph)
+    {
+        Graph result(graph.memory());
+        std::pmr::vector<unsigned> map(graph.size(), graph.memory());
+        for (unsigned id = 0; id < graph.size(); ++id)
+        {
+            Node node = graph[id];
+            if (calls(node, operators::add<Value>))
+            {
+                for (size_t side = 0; side < 2; ++side)
+                {
+                    const Node& product = graph[node.operands[side]];
+                    if (calls(product, operators::multiply<Value>))
+                    {
+                        Node fma {{OP_FMA}};
+                        fma.operands[0] = product.operands[0];
+                        fma.operands[1] = product.operands[1];
+                        fma.operands[2] = node.operands[1 - side];
+                        node = fma;
+                        break;
+                    }
+                }
+            }
+            for (size_t i = 0; i < Graph::arity(node); ++i)
+                node.operands[i] = map[node.operands[i]];
+            map[id] = result.add(node);
+        }
+        result.roots(graph, map);
+        return result;
+    }
+
+    bool resolve(const typename Grammar::Binary binary, Program& program, Instruction& instruction) const
+    {
+        for (const auto& pair: _grammar.binary())
+        {
+            if (pair.second.binary == binary)
+            {
+                instruction.binary = binary;
+                instruction.symbol = program.intern(TT_BINARY, pair.first, {}, pair.second);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+using Optimizer = BasicOptimizer<double>;
+
+
+#endif //INC_4_FUNCTIONS_OPTIMIZER_HPP
@@ -0,0 +1,245 @@
+#ifndef INC_4_FUNCTIONS_PROFILE_HPP
+#define INC_4_FUNCTIONS_PROFILE_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "Program.hpp"
+
+
+// Evaluation statistics of a Function, collected when the library is built
+// with FUNCTIONS_PROFILING defined. Every scalar evaluation is counted and
+// one in SampleInterval is timed into a log-linear latency histogram whose
+// buckets are a quarter of a power of two wide. Batches are always timed.
+// Times are kept in ticks of the time-stamp counter where there is one and
+// converted to nanoseconds when a snapshot is taken.
+class Profile
+{
+public:
+    static constexpr uint64_t SampleInterval = 8;
+    static constexpr size_t Buckets = 4 * 63;
+
+    struct Snapshot
+    {
+        bool enabled = false;
+        uint64_t calls = 0;
+        uint64_t sampled = 0;
+        // Latency of the timed calls, in nanoseconds.
+        double mean = 0;
+        double p50 = 0;
+        double p90 = 0;
+        double p99 = 0;
+        double max = 0;
+        // Estimated from the sampled mean, in seconds.
+        double total = 0;
+        uint64_t rows = 0;
+        double batchSeconds = 0;
+        // Executions of each operator over calls and batch rows alike.
+        std::vector<std::pair<std::string, uint64_t>> operators;
+        // The same for operators inside the arms of conditionals, as if
+        // every arm ran: an upper bound.
+        std::vector<std::pair<std::string, uint64_t>> conditional;
+    };
+
+    // Times the scope if its evaluation is one of the samples.
+    class Scope
+    {
+    private:
+        Profile& _profile;
+        bool _sampled;
+        uint64_t _start = 0;
+
+    public:
+        explicit Scope(Profile& profile) : _profile(profile)
+        {
+            _sampled = _profile._calls.fetch_add(1, std::memory_order_relaxed) % SampleInterval == 0;
+            if (_sampled)
+                _start = ticks();
+        }
+
+        ~Scope()
+        {
+            if (_sampled)
+                _profile.record(ticks() - _start);
+        }
+    };
+
+    class Batch
+    {
+    private:
+        Profile& _profile;
+        size_t _rows;
+        uint64_t _start;
+
+    public:
+        Batch(Profile& profile, const size_t rows) : _profile(profile), _rows(rows), _start(ticks()) {}
+
+        ~Batch()
+        {
+            _profile._rows.fetch_add(_rows, std::memory_order_relaxed);
+            _profile._batchTicks.fetch_add(ticks() - _start, std::memory_order_relaxed);
+        }
+    };
+
+private:
+    std::atomic<uint64_t> _calls = 0;
+    std::atomic<uint64_t> _sampled = 0;
+    std::atomic<uint64_t> _ticks = 0;
+    std::atomic<uint64_t> _max = 0;
+    std::atomic<uint64_t> _rows = 0;
+    std::atomic<uint64_t> _batchTicks = 0;
+    std::array<std::atomic<uint64_t>, Buckets> _histogram {};
+
+public:
+    static uint64_t ticks()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    // Nanoseconds per tick, measured once against the steady clock.
+    static double period()
+    {
+        static const double period = []()
+        {
+            const auto start = std::chrono::steady_clock::now();
+            const uint64_t first = ticks();
+            while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(5));
+            const uint64_t last = ticks();
+            const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+            return last > first ? elapsed.count() / (double) (last - first) : 1.0;
+        }();
+        return period;
+    }
+
+    void record(const uint64_t elapsed)
+    {
+        _sampled.fetch_add(1, std::memory_order_relaxed);
+        _ticks.fetch_add(elapsed, std::memory_order_relaxed);
+        _histogram[bucket(elapsed)].fetch_add(1, std::memory_order_relaxed);
+        uint64_t max = _max.load(std::memory_order_relaxed);
+        while (elapsed > max && !_max.compare_exchange_weak(max, elapsed, std::memory_order_relaxed));
+    }
+
+    void reset()
+    {
+        _calls = _sampled = _ticks = _max = _rows = _batchTicks = 0;
+        for (auto& count: _histogram)
+            count = 0;
+    }
+
+    template<typename Value>
+    [[nodiscard]] Snapshot snapshot(const BasicProgram<Value>& program) const
+    {
+        Snapshot result;
+        result.enabled = true;
+        result.calls = _calls.load(std::memory_order_relaxed);
+        result.sampled = _sampled.load(std::memory_order_relaxed);
+        result.rows = _rows.load(std::memory_order_relaxed);
+        const double period = Profile::period();
+        result.batchSeconds = (double) _batchTicks.load(std::memory_order_relaxed) * period * 1e-9;
+        result.max = (double) _max.load(std::memory_order_relaxed) * period;
+        if (result.sampled)
+        {
+            result.mean = (double) _ticks.load(std::memory_order_relaxed) * period / (double) result.sampled;
+            result.total = result.mean * (double) result.calls * 1e-9;
+            result.p50 = std::min(percentile(0.50, result.sampled) * period, result.max);
+            result.p90 = std::min(percentile(0.90, result.sampled) * period, result.max);
+            result.p99 = std::min(percentile(0.99, result.sampled) * period, result.max);
+        }
+
+        // Outside conditionals each evaluation executes every instruction
+        // exactly once. The ends of the arms the instruction is in, innermost
+        // last, tell which list it counts in.
+        std::vector<size_t> arms;
+        for (size_t i = 0; i < program.instructions.size(); ++i)
+        {
+            const auto& instruction = program.instructions[i];
+            while (!arms.empty() && arms.back() == i)
+                arms.pop_back();
+            std::string name;
+            switch (instruction.code)
+            {
+                case OP_UNARY:
+                case OP_BINARY:
+                    name = program.symbols[instruction.symbol].name;
+                    break;
+                case OP_FMA:
+                    name = "fma";
+                    break;
+                case OP_MIN:
+                    name = "min";
+                    break;
+                case OP_MAX:
+                    name = "max";
+                    break;
+                case OP_JUMP:
+                    // The first arm ends here and the second one begins.
+                    arms.pop_back();
+                    [[fallthrough]];
+                case OP_BRANCH:
+                    arms.push_back(i + 1 + instruction.slot);
+                    continue;
+                default:
+                    continue;
+            }
+            auto& counts = arms.empty() ? result.operators : result.conditional;
+            auto lookup = std::find_if(counts.begin(), counts.end(),
+                                       [&](const auto& pair) { return pair.first == name; });
+            if (lookup == counts.end())
+                lookup = counts.insert(lookup, {name, 0});
+            lookup->second += result.calls + result.rows;
+        }
+        return result;
+    }
+
+private:
+    static size_t bucket(const uint64_t ticks)
+    {
+        if (ticks < 4)
+            return ticks;
+        const int log = 63 - std::countl_zero(ticks);
+        return 4 * (log - 1) + ((ticks >> (log - 2)) & 3);
+    }
+
+    // The middle of the bucket, in ticks.
+    static double middle(const size_t bucket)
+    {
+        if (bucket < 4)
+            return (double) bucket;
+        const size_t log = bucket / 4 + 1;
+        const double low = (double) ((4 + bucket % 4) << (log - 2));
+        return low + (double) (1ull << (log - 2)) / 2;
+    }
+
+    [[nodiscard]] double percentile(const double fraction, const uint64_t samples) const
+    {
+        const auto rank = (uint64_t) (fraction * (double) (samples - 1));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < Buckets; ++i)
+        {
+            seen += _histogram[i].load(std::memory_order_relaxed);
+            if (seen > rank)
+                return middle(i);
+        }
+        return middle(Buckets - 1);
+    }
+};
+
+
+#endif //INC_4_FUNCTIONS_PROFILE_HPP
@@ -0,0 +1,297 @@
+#ifndef INC_4_FUNCTIONS_PROGRAM_HPP
+#define INC_4_FUNCTIONS_PROGRAM_HPP
+
+#include <cstddef>
+#include <charconv>
+#include <string>
+#include <span>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+#include "Grammar.hpp"
+#include "Token.hpp"
+
+
+enum OpCode : unsigned char
+{
+    OP_CONSTANT,
+    OP_ARGUMENT,
+    OP_UNARY,
+    OP_BINARY,
+    OP_FMA,
+    OP_STORE,
+    OP_LOAD,
+    OP_MIN,
+    OP_MAX,
+    // c ? a : b in a graph; programs run it as the jumps below.
+    OP_SELECT,
+    // Pops the condition and skips `slot` instructions if it is zero.
+    OP_BRANCH,
+    // Skips `slot` instructions.
+    OP_JUMP
+};
+
+
+template<typename Value>
+struct BasicInstruction
+{
+    OpCode code;
+    unsigned symbol;
+    union
+    {
+        Value value;
+        size_t slot;
+        typename BasicGrammar<Value>::Unary unary;
+        typename BasicGrammar<Value>::Binary binary;
+    };
+};
+
+
+template<typename Value>
+struct BasicSymbol
+{
+    TokenType type;
+    std::string name;
+    typename BasicGrammar<Value>::UnaryOperator unary;
+    typename BasicGrammar<Value>::BinaryOperator binary;
+
+    // The kind of grammar symbol it names.
+    [[nodiscard]] Syntax::Kind kind() const
+    {
+        switch (type)
+        {
+            case TT_PREFIX:
+                return Syntax::PREFIX;
+            case TT_POSTFIX:
+                return Syntax::POSTFIX;
+            case TT_BINARY:
+                return Syntax::BINARY;
+            default:
+                return Syntax::CONSTANT;
+        }
+    }
+};
+
+
+template<typename Value>
+struct BasicProgram
+{
+    using Grammar = BasicGrammar<Value>;
+    using Instruction = BasicInstruction<Value>;
+    using Symbol = BasicSymbol<Value>;
+
+    std::vector<Instruction> instructions;
+    std::vector<std::string> parameters;
+    std::vector<Symbol> symbols;
+    size_t depth = 0;
+    size_t registers = 0;
+    // Set by measure() for the batch interpreter, which may keep the value
+    // of one arm of a conditional on the stack while it computes the other,
+    // and how deeply conditionals nest.
+    size_t blendDepth = 0;
+    size_t nesting = 0;
+
+    static size_t consumes(const OpCode code)
+    {
+        switch (code)
+        {
+            case OP_UNARY:
+            case OP_STORE:
+            case OP_BRANCH:
+                return 1;
+            case OP_BINARY:
+            case OP_MIN:
+            case OP_MAX:
+                return 2;
+            case OP_FMA:
+            case OP_SELECT:
+                return 3;
+            default:
+                return 0;
+        }
+    }
+
+    static size_t produces(const OpCode code)
+    {
+        return code == OP_BRANCH || code == OP_JUMP ? 0 : 1;
+    }
+
+    size_t bind(const std::string_view parameter)
+    {
+        auto lookup = std::find(parameters.begin(), parameters.end(), parameter);
+        if (lookup != parameters.end())
+            return lookup - parameters.begin();
+        parameters.emplace_back(parameter);
+        return parameters.size() - 1;
+    }
+
+    unsigned intern(const TokenType type,
+                    const std::string_view name,
+                    const typename Grammar::UnaryOperator& unary,
+                    const typename Grammar::BinaryOperator& binary)
+    {
+        for (unsigned i = 0; i < symbols.size(); ++i)
+        {
+            if (symbols[i].type == type && symbols[i].name == name)
+                return i;
+        }
+        symbols.push_back(Symbol {type, std::string(name), unary, binary});
+        return symbols.size() - 1;
+    }
+
+    unsigned intern(const Symbol& symbol)
+    {
+        return intern(symbol.type, symbol.name, symbol.unary, symbol.binary);
+    }
+
+    // Checks that the code leaves exactly one value and sets the depth. Code
+    // made of several segments that leave one value each lists their ends.
+    // Jumps go forward within their segment, and every path to an
+    // instruction arrives with the same stack height. A branch skips to just
+    // past the jump that ends its first arm, and conditionals nest.
+    void measure(std::span<const size_t> ends = {})
+    {
+        const size_t whole[] = {instructions.size()};
+        if (ends.empty())
+            ends = whole;
+        // The height jumps arrive with and the conditionals that join, by
+        // target.
+        std::vector<long> landing(instructions.size() + 1, -1);
+        std::vector<unsigned> joins(instructions.size() + 1, 0);
+        // The ends of the arms being measured, innermost last: the jump that
+        // ends a first arm, or the join that ends a second one.
+        std::vector<std::pair<size_t, bool>> arms;
+        size_t height = 0, open = 0, live = 0, i = 0;
+        bool reachable = true;
+        depth = blendDepth = nesting = 0;
+        auto arrive = [&](const size_t at)
+        {
+            if (landing[at] >= 0)
+            {
+                if (reachable && height != (size_t) landing[at])
+                    throw std::logic_error("Unbalanced conditional");
+                height = landing[at];
+                reachable = true;
+                landing[at] = -1;
+            }
+            open -= joins[at];
+            live -= joins[at];
+            joins[at] = 0;
+            while (!arms.empty() && arms.back() == std::pair(at, true))
+                arms.pop_back();
+        };
+        for (const size_t end: ends)
+        {
+            for (; i < end; ++i)
+            {
+                arrive(i);
+                if (!reachable)
+                    throw std::logic_error("Unreachable code");
+                const Instruction& instruction = instructions[i];
+                const OpCode code = instruction.code;
+                if (code == OP_SELECT || code > OP_JUMP)
+                    throw std::logic_error("Invalid instruction");
+                if (height < consumes(code))
+                    throw std::logic_error("Missing operand");
+                height = height - consumes(code) + produces(code);
+                depth = std::max(depth, height);
+                blendDepth = std::max(blendDepth, height + open);
+                if (code != OP_BRANCH && code != OP_JUMP)
+                    continue;
+
+                const size_t target = i + 1 + instruction.slot;
+                if (target > end)
+                    throw std::logic_error("Jump out of range");
+                if (landing[target] >= 0 && (size_t) landing[target] != height)
+                    throw std::logic_error("Unbalanced conditional");
+                landing[target] = (long) height;
+                if (code == OP_BRANCH)
+                {
+                    if (target == i + 1 || instructions[target - 1].code != OP_JUMP
+                        || (!arms.empty() && target > arms.back().first))
+                        throw std::logic_error("Unbalanced conditional");
+                    arms.emplace_back(target - 1, false);
+                    nesting = std::max(nesting, ++live);
+                    continue;
+                }
+                if (arms.empty() || arms.back() != std::pair(i, false))
+                    throw std::logic_error("Unbalanced conditional");
+                arms.pop_back();
+                if (!arms.empty() && target > arms.back().first)
+                    throw std::logic_error("Unbalanced conditional");
+                arms.emplace_back(target, true);
+                // Blending keeps the first arm's value until the join.
+                ++open;
+                ++joins[target];
+                reachable = false;
+            }
+            arrive(end);
+            if (!reachable || height != 1)
+                throw std::logic_error("Incomplete expression");
+            height = 0;
+        }
+        if (i != instructions.size())
+            throw std::logic_error("Incomplete expression");
+    }
+
+    [[nodiscard]] std::string stringify() const
+    {
+        std::string result;
+        for (const Instruction& instruction: instructions)
+        {
+            switch (instruction.code)
+            {
+                case OP_CONSTANT:
+                {
+                    char buffer[48];
+                    auto end = std::to_chars(buffer, buffer + sizeof buffer, instruction.value).ptr;
+                    result.append(buffer, end);
+                    break;
+                }
+                case OP_ARGUMENT:
+                    result += parameters[instruction.slot];
+                    break;
+                case OP_UNARY:
+                case OP_BINARY:
+                    result += symbols[instruction.symbol].name;
+                    break;
+                case OP_FMA:
+                    result += "fma";
+                    break;
+                case OP_STORE:
+                    result += "=t" + std::to_string(instruction.slot);
+                    break;
+                case OP_LOAD:
+                    result += "t" + std::to_string(instruction.slot);
+                    break;
+                case OP_MIN:
+                    result += "min";
+                    break;
+                case OP_MAX:
+                    result += "max";
+                    break;
+                case OP_SELECT:
+                    result += "?:";
+                    break;
+                case OP_BRANCH:
+                    result += "?" + std::to_string(instruction.slot);
+                    break;
+                case OP_JUMP:
+                    result += ":" + std::to_string(instruction.slot);
+                    break;
+            }
+            result += ' ';
+        }
+        return result;
+    }
+};
+
+using Instruction = BasicInstruction<double>;
+using Symbol = BasicSymbol<double>;
+using Program = BasicProgram<double>;
+
+
+#endif //INC_4_FUNCTIONS_PROGRAM_HPP
@@ -0,0 +1,287 @@
+#ifndef INC_4_FUNCTIONS_PROTOCOL_HPP
+#define INC_4_FUNCTIONS_PROTOCOL_HPP
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using std::string;
+
+
+// The request protocol of the server mode. Every message is a frame:
+//
+//   uint32 length       of the rest of the frame
+//   uint32 id           chosen by the client and echoed in the response
+//   uint8  code         the operation, or the status of a response
+//   ...                 payload
+//
+// Numbers are in host byte order, the socket being local. A string is a
+// uint32 length followed by its bytes.
+//
+//   COMPILE  infix                               -> postfix, n, n x parameter
+//   SAVE     name, infix                         -> n, n x parameter
+//   EVAL     infix, n, n x (name, double)        -> double
+//   EVALS    name, n, n x double                 -> double
+//   BATCH    name, rows, n, n x rows x double    -> rows x double
+//
+// EVALS takes the arguments in the order of the saved function's parameters,
+// BATCH a column per parameter. A failed request is answered with ERROR and
+// the message. Responses on one connection may come in a different order
+// than the requests; they are matched by id.
+class Protocol
+{
+public:
+    enum Code : uint8_t
+    {
+        COMPILE = 1,
+        SAVE,
+        EVAL,
+        EVALS,
+        BATCH
+    };
+
+    enum Status : uint8_t
+    {
+        OK,
+        ERROR
+    };
+
+    static constexpr size_t HeaderSize = 9;
+    static constexpr size_t MaxFrame = 64 << 20;
+    // Received bytes already handled are dropped once there are this many.
+    static constexpr size_t Compaction = 64 << 10;
+
+    struct Frame
+    {
+        uint32_t id;
+        uint8_t code;
+        std::string_view payload;
+    };
+
+    // Appends a frame to a buffer; its length is filled in on destruction.
+    class Message
+    {
+    private:
+        string& _buffer;
+        size_t _start;
+
+    public:
+        Message(string& buffer, const uint32_t id, const uint8_t code) : _buffer(buffer), _start(buffer.size())
+        {
+            integer(0);
+            integer(id);
+            _buffer.push_back((char) code);
+        }
+
+        Message(const Message&) = delete;
+        Message& operator=(const Message&) = delete;
+
+        ~Message()
+        {
+            const auto length = (uint32_t) (_buffer.size() - _start - sizeof(uint32_t));
+            std::memcpy(_buffer.data() + _start, &length, sizeof length);
+        }
+
+        Message& integer(const uint32_t value)
+        {
+            _buffer.append(reinterpret_cast<const char*>(&value), sizeof value);
+            return *this;
+        }
+
+        Message& number(const double value)
+        {
+            _buffer.append(reinterpret_cast<const char*>(&value), sizeof value);
+            return *this;
+        }
+
+        Message& numbers(const std::span<const double> values)
+        {
+            _buffer.append(reinterpret_cast<const char*>(values.data()), values.size_bytes());
+            return *this;
+        }
+
+        Message& text(const std::string_view value)
+        {
+            integer((uint32_t) value.size());
+            _buffer.append(value);
+            return *this;
+        }
+    };
+
+    // Reads the fields of a payload in order.
+    class Payload
+    {
+    private:
+        std::string_view _data;
+        size_t _position = 0;
+
+    public:
+        explicit Payload(const std::string_view data) : _data(data) {}
+
+        uint32_t integer()
+        {
+            uint32_t value;
+            std::memcpy(&value, take(sizeof value), sizeof value);
+            return value;
+        }
+
+        double number()
+        {
+            double value;
+            std::memcpy(&value, take(sizeof value), sizeof value);
+            return value;
+        }
+
+        void numbers(double* values, const size_t count)
+        {
+            if (count > _data.size() / sizeof(double))
+                throw std::logic_error("Truncated message");
+            std::memcpy(values, take(count * sizeof(double)), count * sizeof(double));
+        }
+
+        std::string_view text()
+        {
+            const uint32_t length = integer();
+            return {take(length), length};
+        }
+
+    private:
+        const char* take(const size_t size)
+        {
+            if (size > _data.size() - _position)
+                throw std::logic_error("Truncated message");
+            const char* data = _data.data() + _position;
+            _position += size;
+            return data;
+        }
+    };
+
+    // The first complete frame of the data, if there is one, and how many
+    // bytes it takes.
+    static std::optional<Frame> next(const std::string_view data, size_t& size)
+    {
+        if (data.size() < HeaderSize)
+            return std::nullopt;
+        uint32_t length;
+        std::memcpy(&length, data.data(), sizeof length);
+        if (length < HeaderSize - sizeof length || length > MaxFrame)
+            throw std::logic_error("Invalid frame length " + std::to_string(length));
+        size = sizeof length + length;
+        if (data.size() < size)
+            return std::nullopt;
+        Frame frame {};
+        std::memcpy(&frame.id, data.data() + sizeof length, sizeof frame.id);
+        frame.code = (uint8_t) data[sizeof length + sizeof frame.id];
+        frame.payload = data.substr(HeaderSize, size - HeaderSize);
+        return frame;
+    }
+
+    static sockaddr_un address(const string& path)
+    {
+        sockaddr_un address {};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof address.sun_path)
+            throw std::logic_error("Socket path is too long: " + path);
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return address;
+    }
+
+    // A blocking connection to a server.
+    class Client
+    {
+    private:
+        int _fd;
+        string _in;
+        size_t _consumed = 0;
+
+    public:
+        explicit Client(const string& path)
+        {
+            _fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (_fd < 0)
+                throw std::system_error(errno, std::generic_category(), "socket");
+            const sockaddr_un address = Protocol::address(path);
+            if (connect(_fd, reinterpret_cast<const sockaddr*>(&address), sizeof address) < 0)
+            {
+                const int error = errno;
+                close(_fd);
+                throw std::system_error(error, std::generic_category(), path);
+            }
+        }
+
+        Client(const Client&) = delete;
+        Client& operator=(const Client&) = delete;
+
+        ~Client()
+        {
+            close(_fd);
+        }
+
+        // Sends one or more complete frames.
+        void send(const std::string_view frames)
+        {
+            size_t written = 0;
+            while (written < frames.size())
+            {
+                const ssize_t count = ::send(_fd, frames.data() + written, frames.size() - written, MSG_NOSIGNAL);
+                if (count < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    throw std::system_error(errno, std::generic_category(), "send");
+                }
+                written += count;
+            }
+        }
+
+        // Waits for the next response. Its payload is valid until the next
+        // call.
+        Frame receive()
+        {
+            if (_consumed == _in.size() || _consumed > Compaction)
+            {
+                _in.erase(0, _consumed);
+                _consumed = 0;
+            }
+            size_t size = 0;
+            std::optional<Frame> frame;
+            while (!(frame = next(std::string_view(_in).substr(_consumed), size)))
+            {
+                char buffer[1 << 16];
+                const ssize_t count = recv(_fd, buffer, sizeof buffer, 0);
+                if (count < 0 && errno == EINTR)
+                    continue;
+                if (count < 0)
+                    throw std::system_error(errno, std::generic_category(), "recv");
+                if (count == 0)
+                    throw std::logic_error("The server closed the connection");
+                _in.append(buffer, count);
+            }
+            _consumed += size;
+            return *frame;
+        }
+
+        // Sends one request and waits for its response, failing on ERROR.
+        Frame call(const string& request)
+        {
+            send(request);
+            Frame response = receive();
+            if (response.code != OK)
+                throw std::logic_error(string(Payload(response.payload).text()));
+            return response;
+        }
+    };
+};
+
+
+#endif //INC_4_FUNCTIONS_PROTOCOL_HPP
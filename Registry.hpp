@@ -0,0 +1,182 @@
+#ifndef INC_4_FUNCTIONS_REGISTRY_HPP
+#define INC_4_FUNCTIONS_REGISTRY_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Function.hpp"
+
+using std::string;
+
+
+// Saved functions that any number of threads may look up and evaluate while
+// others define and delete them. Every version of the library is immutable:
+// a writer copies the current one, edits the copy and publishes it with one
+// atomic exchange. Readers take no lock; they pin the epoch they started in
+// and the version they saw stays alive until no reader pinned that early is
+// left. Writers are serialized among themselves and free what they retired.
+class Registry
+{
+public:
+    using Library = Function::Library;
+
+    // Readers in a read section at once; more wait for a slot to free up.
+    static constexpr size_t Slots = 128;
+
+private:
+    struct alignas(64) Slot
+    {
+        // The epoch the reader started in, or 0 when the slot is free.
+        std::atomic<uint64_t> pinned = 0;
+    };
+
+    struct Retired
+    {
+        std::unique_ptr<const Library> library;
+        // The epoch that was current when the version was replaced.
+        uint64_t epoch;
+    };
+
+    std::atomic<const Library*> _current;
+    std::atomic<uint64_t> _epoch = 1;
+    mutable std::array<Slot, Slots> _slots;
+    std::mutex _mutex;
+    std::vector<Retired> _retired;
+
+public:
+    // A version of the library, kept alive for as long as the view exists.
+    class View
+    {
+        friend class Registry;
+
+    private:
+        const Library* _library;
+        Slot* _slot;
+
+        View(const Library* library, Slot* slot) : _library(library), _slot(slot) {}
+
+    public:
+        View(View&& other) noexcept : _library(other._library), _slot(std::exchange(other._slot, nullptr)) {}
+
+        View(const View&) = delete;
+        View& operator=(const View&) = delete;
+        View& operator=(View&&) = delete;
+
+        ~View()
+        {
+            if (_slot)
+                _slot->pinned.store(0, std::memory_order_release);
+        }
+
+        [[nodiscard]] const Library& library() const
+        {
+            return *_library;
+        }
+
+        [[nodiscard]] const Function* find(const std::string_view name) const
+        {
+            auto lookup = _library->find(name);
+            return lookup != _library->end() ? &lookup->second : nullptr;
+        }
+    };
+
+    explicit Registry(Library library = {}) : _current(new Library(std::move(library))) {}
+
+    Registry(const Registry&) = delete;
+    Registry& operator=(const Registry&) = delete;
+
+    // No view may outlive the registry.
+    ~Registry()
+    {
+        delete _current.load();
+    }
+
+    // Pins the current version. The epoch is announced before the version is
+    // loaded, so a writer that retires it afterwards sees the pin.
+    [[nodiscard]] View read() const
+    {
+        thread_local const size_t home = std::hash<std::thread::id>()(std::this_thread::get_id());
+        for (size_t i = home;; ++i)
+        {
+            Slot& slot = _slots[i % Slots];
+            uint64_t free = 0;
+            if (slot.pinned.load(std::memory_order_relaxed) == 0
+                && slot.pinned.compare_exchange_strong(free, _epoch.load()))
+                return View(_current.load(), &slot);
+            if (i - home + 1 == Slots)
+                std::this_thread::yield();
+        }
+    }
+
+    // Publishes a copy of the current version changed by edit(Library&).
+    template<typename Edit>
+    void update(Edit edit)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto next = std::make_unique<Library>(*_current.load());
+        edit(*next);
+        const Library* previous = _current.exchange(next.release());
+        _retired.push_back(Retired {std::unique_ptr<const Library>(previous), _epoch.fetch_add(1)});
+        reclaim();
+    }
+
+    void define(const string& name, const Function& function)
+    {
+        update([&](Library& library) { library.insert_or_assign(name, function); });
+    }
+
+    bool erase(const std::string_view name)
+    {
+        bool found = false;
+        update([&](Library& library)
+        {
+            auto lookup = library.find(name);
+            found = lookup != library.end();
+            if (found)
+                library.erase(lookup);
+        });
+        return found;
+    }
+
+    void clear()
+    {
+        update([](Library& library) { library.clear(); });
+    }
+
+    // Replaced versions that readers may still be using.
+    [[nodiscard]] size_t retired()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        reclaim();
+        return _retired.size();
+    }
+
+private:
+    // A version retired in epoch e may be freed once every pinned reader
+    // started after e: it loaded the version that replaced it or a later one.
+    void reclaim()
+    {
+        uint64_t oldest = std::numeric_limits<uint64_t>::max();
+        for (const Slot& slot: _slots)
+        {
+            const uint64_t pinned = slot.pinned.load();
+            if (pinned)
+                oldest = std::min(oldest, pinned);
+        }
+        std::erase_if(_retired, [&](const Retired& retired) { return retired.epoch < oldest; });
+    }
+};
+
+
+#endif //INC_4_FUNCTIONS_REGISTRY_HPP
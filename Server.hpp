@@ -0,0 +1,511 @@
+#ifndef INC_4_FUNCTIONS_SERVER_HPP
+#define INC_4_FUNCTIONS_SERVER_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Compiler.hpp"
+#include "Function.hpp"
+#include "Grammar.hpp"
+#include "Protocol.hpp"
+#include "Registry.hpp"
+
+using std::string;
+
+
+// Serves the requests of Protocol.hpp on a Unix domain socket. A few threads
+// share one epoll instance; connections are armed one-shot, so each is read
+// and written by one thread at a time, and every request that arrived is
+// handled before anything is written back. The evaluations of a saved
+// function that arrive in the same round, from one connection or several,
+// are answered by one evaluateBatch over all their rows. Saved functions
+// live in a Registry, so evaluation never waits for a definition.
+class Server
+{
+public:
+    static constexpr size_t MaxEvents = 64;
+    // Evaluations of one function in a round that go through evaluateBatch
+    // together rather than one by one.
+    static constexpr size_t BatchThreshold = 4;
+    // Unsent responses past which a connection is no longer read from.
+    static constexpr size_t MaxBacklog = 4 << 20;
+    // Unhandled received bytes past which a connection is no longer read from.
+    static constexpr size_t MaxUnread = Protocol::HeaderSize + Protocol::MaxFrame;
+
+private:
+    struct Connection
+    {
+        int fd;
+        string in;
+        size_t consumed = 0;
+        string out;
+        size_t sent = 0;
+        // The peer sent everything it will; answer it and close.
+        bool finished = false;
+        // Close without answering.
+        bool broken = false;
+    };
+
+    // An EVALS request waiting for the end of the round; its arguments are
+    // in the round's values.
+    struct Pending
+    {
+        Connection* connection;
+        uint32_t id;
+        std::string_view name;
+        size_t arguments;
+        size_t count;
+    };
+
+    struct Round
+    {
+        std::vector<Pending> pending;
+        std::vector<double> values;
+        std::vector<double> columns;
+        std::vector<double> results;
+    };
+
+    string _path;
+    Compiler _compiler;
+    Registry _registry;
+    size_t _threads;
+    int _listener = -1;
+    int _epoll = -1;
+    int _wake = -1;
+    std::mutex _mutex;
+    std::unordered_map<int, std::unique_ptr<Connection>> _connections;
+
+public:
+    Server(const string& path, const Grammar& grammar, const size_t threads = 2)
+        : _path(path), _compiler(grammar), _threads(std::max<size_t>(threads, 1))
+    {
+        try
+        {
+            open();
+        }
+        catch (...)
+        {
+            shut();
+            throw;
+        }
+    }
+
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    ~Server()
+    {
+        shut();
+    }
+
+    [[nodiscard]] Registry& registry()
+    {
+        return _registry;
+    }
+
+    // Serves on the calling thread and the others until stop().
+    void run()
+    {
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < _threads; ++i)
+            workers.emplace_back([this]() { work(); });
+        work();
+        for (std::thread& worker: workers)
+            worker.join();
+    }
+
+    // Safe to call from a signal handler.
+    void stop() const
+    {
+        const uint64_t one = 1;
+        [[maybe_unused]] const ssize_t count = write(_wake, &one, sizeof one);
+    }
+
+private:
+    void open()
+    {
+        _listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (_listener < 0)
+            throw std::system_error(errno, std::generic_category(), "socket");
+        const sockaddr_un address = Protocol::address(_path);
+        unlink(_path.c_str());
+        if (bind(_listener, reinterpret_cast<const sockaddr*>(&address), sizeof address) < 0
+            || listen(_listener, SOMAXCONN) < 0)
+            throw std::system_error(errno, std::generic_category(), _path);
+
+        _epoll = epoll_create1(EPOLL_CLOEXEC);
+        _wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (_epoll < 0 || _wake < 0)
+            throw std::system_error(errno, std::generic_category(), "epoll");
+        // The wake-up stays readable, so every thread sees it.
+        watch(EPOLL_CTL_ADD, _wake, EPOLLIN, &_wake);
+        watch(EPOLL_CTL_ADD, _listener, EPOLLIN | EPOLLONESHOT, &_listener);
+    }
+
+    void shut()
+    {
+        for (auto& [fd, connection]: _connections)
+            close(fd);
+        _connections.clear();
+        for (const int fd: {_listener, _epoll, _wake})
+        {
+            if (fd >= 0)
+                close(fd);
+        }
+        if (_listener >= 0)
+            unlink(_path.c_str());
+    }
+
+    void watch(const int operation, const int fd, const uint32_t events, void* data) const
+    {
+        epoll_event event {};
+        event.events = events;
+        event.data.ptr = data;
+        if (epoll_ctl(_epoll, operation, fd, &event) < 0)
+            throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+    }
+
+    void work()
+    {
+        Compiler compiler(_compiler);
+        Round round;
+        std::vector<Connection*> ready;
+        epoll_event events[MaxEvents];
+        while (true)
+        {
+            const int count = epoll_wait(_epoll, events, MaxEvents, -1);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count < 0)
+                throw std::system_error(errno, std::generic_category(), "epoll_wait");
+            ready.clear();
+            for (int i = 0; i < count; ++i)
+            {
+                void* source = events[i].data.ptr;
+                if (source == &_wake)
+                    return;
+                if (source == &_listener)
+                {
+                    accept();
+                    continue;
+                }
+                auto* connection = static_cast<Connection*>(source);
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    receive(*connection, compiler, round);
+                ready.push_back(connection);
+            }
+            evaluate(round);
+            for (Connection* connection: ready)
+                flush(*connection);
+        }
+    }
+
+    void accept()
+    {
+        while (true)
+        {
+            const int fd = accept4(_listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0 && errno == EINTR)
+                continue;
+            if (fd < 0)
+                break;
+            auto connection = std::make_unique<Connection>();
+            connection->fd = fd;
+            Connection* pointer = connection.get();
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _connections.emplace(fd, std::move(connection));
+            }
+            watch(EPOLL_CTL_ADD, fd, EPOLLIN | EPOLLONESHOT, pointer);
+        }
+        watch(EPOLL_CTL_MOD, _listener, EPOLLIN | EPOLLONESHOT, &_listener);
+    }
+
+    void receive(Connection& connection, Compiler& compiler, Round& round)
+    {
+        char buffer[1 << 16];
+        // Reading stops once a largest frame could be waiting, so a peer that
+        // never stops writing neither holds the thread nor grows the buffer;
+        // the rest stays in the socket until the frames read are handled.
+        while (connection.in.size() - connection.consumed < MaxUnread)
+        {
+            const ssize_t count = read(connection.fd, buffer, sizeof buffer);
+            if (count > 0)
+            {
+                connection.in.append(buffer, count);
+                continue;
+            }
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count == 0)
+                connection.finished = true;
+            else if (errno != EAGAIN && errno != EWOULDBLOCK)
+                connection.broken = true;
+            break;
+        }
+
+        try
+        {
+            size_t size = 0;
+            const std::string_view in(connection.in);
+            while (auto frame = Protocol::next(in.substr(connection.consumed), size))
+            {
+                connection.consumed += size;
+                handle(connection, *frame, compiler, round);
+            }
+        }
+        catch (const std::logic_error&)
+        {
+            // The stream is out of step and cannot be resynchronized.
+            connection.broken = true;
+        }
+    }
+
+    Function compile(Compiler& compiler, const std::string_view infix)
+    {
+        const Registry::View view = _registry.read();
+        compiler.link(&view.library());
+        return compiler.compile(string(infix));
+    }
+
+    static void describe(Protocol::Message& response, const Function& function)
+    {
+        response.integer((uint32_t) function.parameters().size());
+        for (const string& parameter: function.parameters())
+            response.text(parameter);
+    }
+
+    static const Function& find(const Registry::View& view, const std::string_view name)
+    {
+        const Function* function = view.find(name);
+        if (!function)
+            throw std::logic_error("There is no saved function '" + string(name) + "'");
+        return *function;
+    }
+
+    // Answers the request, or queues it for the end of the round if it is
+    // an evaluation of a saved function.
+    void handle(Connection& connection, const Protocol::Frame& frame, Compiler& compiler, Round& round)
+    {
+        try
+        {
+            Protocol::Payload payload(frame.payload);
+            switch (frame.code)
+            {
+                case Protocol::COMPILE:
+                {
+                    const Function function = compile(compiler, payload.text());
+                    Protocol::Message response(connection.out, frame.id, Protocol::OK);
+                    response.text(function.postfix());
+                    describe(response, function);
+                    break;
+                }
+                case Protocol::SAVE:
+                {
+                    const std::string_view name = payload.text();
+                    if (name.empty())
+                        throw std::logic_error("A function needs a name");
+                    const Function function = compile(compiler, payload.text());
+                    // Evaluations that came before see the previous definition.
+                    evaluate(round);
+                    _registry.define(string(name), function);
+                    Protocol::Message response(connection.out, frame.id, Protocol::OK);
+                    describe(response, function);
+                    break;
+                }
+                case Protocol::EVAL:
+                {
+                    const Function function = compile(compiler, payload.text());
+                    Function::Args args;
+                    for (uint32_t count = payload.integer(); count > 0; --count)
+                    {
+                        const std::string_view name = payload.text();
+                        args.insert_or_assign(string(name), payload.number());
+                    }
+                    const double value = function.evaluate(args);
+                    Protocol::Message(connection.out, frame.id, Protocol::OK).number(value);
+                    break;
+                }
+                case Protocol::EVALS:
+                {
+                    Pending pending {&connection, frame.id, payload.text(), round.values.size(), payload.integer()};
+                    round.values.resize(pending.arguments + std::min<size_t>(pending.count, frame.payload.size()));
+                    payload.numbers(round.values.data() + pending.arguments, pending.count);
+                    round.pending.push_back(pending);
+                    break;
+                }
+                case Protocol::BATCH:
+                {
+                    const std::string_view name = payload.text();
+                    const size_t rows = payload.integer();
+                    const size_t count = payload.integer();
+                    // Before anything is allocated: the results must fit in a
+                    // frame, and the arguments in the one that came.
+                    if (rows > (Protocol::MaxFrame - (Protocol::HeaderSize - sizeof(uint32_t))) / sizeof(double))
+                        throw std::logic_error("Too many rows: " + std::to_string(rows));
+                    if (rows * count > frame.payload.size() / sizeof(double))
+                        throw std::logic_error("Truncated message");
+                    const Registry::View view = _registry.read();
+                    const Function& function = find(view, name);
+                    if (count != function.parameters().size())
+                        throw std::logic_error(arity(name, function, count));
+                    std::vector<double> data(rows * count);
+                    payload.numbers(data.data(), rows * count);
+                    std::vector<const double*> columns;
+                    for (size_t k = 0; k < count; ++k)
+                        columns.push_back(data.data() + k * rows);
+                    round.results.resize(rows);
+                    function.evaluateBatch(columns, rows, round.results.data());
+                    Protocol::Message(connection.out, frame.id, Protocol::OK)
+                            .numbers(std::span<const double>(round.results.data(), rows));
+                    break;
+                }
+                default:
+                    throw std::logic_error("Unknown request " + std::to_string(frame.code));
+            }
+        }
+        catch (const std::exception& e)
+        {
+            Protocol::Message(connection.out, frame.id, Protocol::ERROR).text(e.what());
+        }
+    }
+
+    static string arity(const std::string_view name, const Function& function, const size_t given)
+    {
+        return "'" + string(name) + "' takes " + std::to_string(function.parameters().size())
+               + " argument(s), " + std::to_string(given) + " given";
+    }
+
+    // Answers the queued evaluations, those of one function together.
+    void evaluate(Round& round)
+    {
+        if (round.pending.empty())
+            return;
+        std::stable_sort(round.pending.begin(), round.pending.end(),
+                         [](const Pending& a, const Pending& b) { return a.name < b.name; });
+        const Registry::View view = _registry.read();
+        const std::vector<Pending>& pending = round.pending;
+        std::vector<const Pending*> accepted;
+        for (size_t begin = 0, end; begin < pending.size(); begin = end)
+        {
+            end = begin + 1;
+            while (end < pending.size() && pending[end].name == pending[begin].name)
+                ++end;
+
+            const Function* function = view.find(pending[begin].name);
+            accepted.clear();
+            for (size_t i = begin; i < end; ++i)
+            {
+                const Pending& request = pending[i];
+                string error;
+                if (!function)
+                    error = "There is no saved function '" + string(request.name) + "'";
+                else if (request.count != function->parameters().size())
+                    error = arity(request.name, *function, request.count);
+                if (error.empty())
+                    accepted.push_back(&request);
+                else
+                    Protocol::Message(request.connection->out, request.id, Protocol::ERROR).text(error);
+            }
+            if (accepted.empty())
+                continue;
+
+            const size_t m = accepted.size();
+            if (m < BatchThreshold)
+            {
+                for (const Pending* request: accepted)
+                {
+                    const double value = function->evaluate(
+                            std::span<const double>(round.values).subspan(request->arguments, request->count));
+                    Protocol::Message(request->connection->out, request->id, Protocol::OK).number(value);
+                }
+                continue;
+            }
+
+            // One row per request, transposed into a column per parameter.
+            const size_t count = function->parameters().size();
+            round.columns.resize(count * m);
+            std::vector<const double*> columns(count);
+            for (size_t k = 0; k < count; ++k)
+            {
+                columns[k] = round.columns.data() + k * m;
+                for (size_t j = 0; j < m; ++j)
+                    round.columns[k * m + j] = round.values[accepted[j]->arguments + k];
+            }
+            round.results.resize(m);
+            function->evaluateBatch(columns, m, round.results.data());
+            for (size_t j = 0; j < m; ++j)
+                Protocol::Message(accepted[j]->connection->out, accepted[j]->id, Protocol::OK)
+                        .number(round.results[j]);
+        }
+        round.pending.clear();
+        round.values.clear();
+    }
+
+    // Writes what the round produced and arms the connection for the next.
+    void flush(Connection& connection)
+    {
+        connection.in.erase(0, connection.consumed);
+        connection.consumed = 0;
+        while (!connection.broken && connection.sent < connection.out.size())
+        {
+            const ssize_t count = send(connection.fd, connection.out.data() + connection.sent,
+                                       connection.out.size() - connection.sent, MSG_NOSIGNAL);
+            if (count > 0)
+                connection.sent += count;
+            else if (count < 0 && errno == EINTR)
+                continue;
+            else if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            else
+                connection.broken = true;
+        }
+        if (connection.sent == connection.out.size())
+        {
+            connection.out.clear();
+            connection.sent = 0;
+        }
+
+        const bool backlog = !connection.out.empty();
+        if (connection.broken || (connection.finished && !backlog))
+        {
+            drop(connection);
+            return;
+        }
+        uint32_t events = EPOLLONESHOT;
+        if (!connection.finished && connection.out.size() - connection.sent < MaxBacklog
+            && connection.in.size() < MaxUnread)
+            events |= EPOLLIN;
+        if (backlog)
+            events |= EPOLLOUT;
+        watch(EPOLL_CTL_MOD, connection.fd, events, &connection);
+    }
+
+    void drop(Connection& connection)
+    {
+        const int fd = connection.fd;
+        epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, nullptr);
+        std::lock_guard<std::mutex> lock(_mutex);
+        close(fd);
+        _connections.erase(fd);
+    }
+};
+
+
+#endif //INC_4_FUNCTIONS_SERVER_HPP
@@ -0,0 +1,522 @@
+#ifndef INC_4_FUNCTIONS_STATICCOMPILER_HPP
+#define INC_4_FUNCTIONS_STATICCOMPILER_HPP
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+
+#include "Operators.hpp"
+#include "Optimizer.hpp"
+
+
+// Compile-time front end for the stock grammar of Calculator::setupGrammar.
+// The expression is tokenized and converted to postfix with the rules of
+// Compiler, and evaluation repeats the rewrites of the chosen Optimizer
+// level, so a StaticFunction returns exactly what the runtime Function
+// returns for the same arguments. Arguments are passed positionally in
+// the order of Function::parameters(). Comparisons, conditionals and
+// min/max are left to the runtime compiler and are unexpected tokens here.
+namespace functions
+{
+    template<size_t N>
+    struct FixedString
+    {
+        char data[N] {};
+
+        constexpr FixedString(const char (& s)[N])
+        {
+            for (size_t i = 0; i < N; ++i)
+                data[i] = s[i];
+        }
+
+        [[nodiscard]] constexpr size_t size() const
+        {
+            return N - 1;
+        }
+
+        constexpr char operator[](const size_t i) const
+        {
+            return i < N ? data[i] : '\0';
+        }
+    };
+
+    namespace detail
+    {
+        enum Kind : unsigned char
+        {
+            K_NUMBER,
+            K_ARGUMENT,
+            K_PREFIX,
+            K_BINARY,
+            K_POSTFIX,
+            K_OPEN
+        };
+
+        enum Operation : unsigned char
+        {
+            NEGATE, CEIL, COS, EXP, FLOOR, ROUND, SIN,
+            MULTIPLY, ADD, SUBTRACT, DIVIDE, POWER,
+            FACTORIAL,
+            NONE
+        };
+
+        struct Entry
+        {
+            std::string_view signature;
+            Operation operation;
+            unsigned char precedence;
+        };
+
+        constexpr Entry Prefix[] = {{"-", NEGATE, 0}, {"ceil", CEIL, 0}, {"cos", COS, 0},
+                                    {"exp", EXP, 0}, {"floor", FLOOR, 0}, {"round", ROUND, 0},
+                                    {"sin", SIN, 0}};
+        constexpr Entry Binary[] = {{"*", MULTIPLY, 2}, {"+", ADD, 1}, {"-", SUBTRACT, 1},
+                                    {"/", DIVIDE, 2}, {"^", POWER, 3}};
+        constexpr Entry Postfix[] = {{"!", FACTORIAL, 0}};
+
+        struct Token
+        {
+            Kind kind = K_NUMBER;
+            Operation operation = NONE;
+            double value = 0;
+            size_t slot = 0;
+        };
+
+        template<size_t N>
+        struct Expression
+        {
+            Token tokens[N] {};
+            size_t size = 0;
+            size_t offsets[N] {};
+            size_t lengths[N] {};
+            size_t parameters = 0;
+        };
+
+        constexpr bool isDigit(const char c) { return c >= '0' && c <= '9'; }
+        constexpr bool isAlpha(const char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+
+        template<size_t N>
+        constexpr size_t matchNumber(const FixedString<N>& s, const size_t start)
+        {
+            bool isSigned = (s[start] == '-' || s[start] == '+');
+            size_t length = isSigned;
+            while (isDigit(s[start + length])) ++length;
+            length += s[start + length] == '.';
+            while (isDigit(s[start + length])) ++length;
+            return length * (!isSigned || length > 1);
+        }
+
+        template<size_t N>
+        constexpr size_t matchArgument(const FixedString<N>& s, const size_t start)
+        {
+            size_t length = 0;
+            while (isAlpha(s[start + length]) || s[start + length] == '_') ++length;
+            return length;
+        }
+
+        // Longest match, like Grammar::matchPrefix and friends.
+        template<size_t N, size_t M>
+        constexpr size_t match(const FixedString<N>& s, const size_t start, const Entry (& entries)[M], Entry& found)
+        {
+            size_t longest = 0;
+            for (const Entry& entry: entries)
+            {
+                size_t length = entry.signature.size();
+                bool equal = length > longest && start + length <= s.size();
+                for (size_t i = 0; equal && i < length; ++i)
+                    equal = s[start + i] == entry.signature[i];
+                if (equal)
+                {
+                    found = entry;
+                    longest = length;
+                }
+            }
+            return longest;
+        }
+
+        // Decimal literals are converted with a single correctly rounded
+        // division, which agrees with stod whenever the digits fit into the
+        // mantissa and the power of ten is exact.
+        template<size_t N>
+        constexpr double parseNumber(const FixedString<N>& s, const size_t start, const size_t length)
+        {
+            size_t i = start;
+            bool negative = s[i] == '-';
+            i += s[i] == '-' || s[i] == '+';
+            unsigned long long mantissa = 0;
+            unsigned scale = 0;
+            bool fraction = false;
+            for (; i < start + length; ++i)
+            {
+                if (s[i] == '.')
+                {
+                    fraction = true;
+                    continue;
+                }
+                mantissa = mantissa * 10 + (s[i] - '0');
+                scale += fraction;
+                if (mantissa > (1ull << 53) || scale > 22)
+                    throw std::logic_error("Number literal is not exact at compile time");
+            }
+            double power = 1;
+            for (unsigned k = 0; k < scale; ++k)
+                power *= 10;
+            double value = (double) mantissa / power;
+            return negative ? -value : value;
+        }
+
+        template<size_t N>
+        constexpr Expression<N> parse(const FixedString<N>& infix)
+        {
+            Expression<N> expression;
+            Token stack[N] {};
+            unsigned char precedences[N] {};
+            size_t top = 0;
+            bool expectOperand = true;
+
+            auto output = [&](const Token& token) { expression.tokens[expression.size++] = token; };
+
+            size_t length, i = 0;
+            while (infix[i] == ' ') ++i;
+            while (i < infix.size())
+            {
+                Entry entry {};
+                if (expectOperand && (length = matchNumber(infix, i)))
+                {
+                    output(Token {K_NUMBER, NONE, parseNumber(infix, i, length)});
+                    expectOperand = false;
+                }
+                else if (expectOperand && (length = match(infix, i, Prefix, entry)))
+                {
+                    stack[top++] = Token {K_PREFIX, entry.operation};
+                }
+                else if (!expectOperand && (length = match(infix, i, Binary, entry)))
+                {
+                    const bool right = entry.operation == POWER;
+                    while (top
+                           && (stack[top - 1].kind == K_PREFIX
+                               || (stack[top - 1].kind == K_BINARY
+                                   && (precedences[top - 1] > entry.precedence
+                                       || (precedences[top - 1] == entry.precedence && !right)))))
+                        output(stack[--top]);
+                    precedences[top] = entry.precedence;
+                    stack[top++] = Token {K_BINARY, entry.operation};
+                    expectOperand = true;
+                }
+                else if (!expectOperand && (length = match(infix, i, Postfix, entry)))
+                {
+                    output(Token {K_POSTFIX, entry.operation});
+                }
+                else if (expectOperand && (length = infix[i] == '('))
+                {
+                    stack[top++] = Token {K_OPEN};
+                }
+                else if (!expectOperand && (length = infix[i] == ')'))
+                {
+                    while (top && stack[top - 1].kind != K_OPEN)
+                        output(stack[--top]);
+                    if (!top)
+                        throw std::logic_error("Unbalanced parenthesis");
+                    --top;
+                }
+                else if (expectOperand && (length = matchArgument(infix, i)))
+                {
+                    std::string_view name(infix.data + i, length);
+                    if (name == "pi")
+                        output(Token {K_NUMBER, NONE, M_PI});
+                    else if (name == "e")
+                        output(Token {K_NUMBER, NONE, M_E});
+                    else
+                    {
+                        size_t slot = 0;
+                        while (slot < expression.parameters
+                               && std::string_view(infix.data + expression.offsets[slot],
+                                                   expression.lengths[slot]) != name)
+                            ++slot;
+                        if (slot == expression.parameters)
+                        {
+                            expression.offsets[slot] = i;
+                            expression.lengths[slot] = length;
+                            ++expression.parameters;
+                        }
+                        output(Token {K_ARGUMENT, NONE, 0, slot});
+                    }
+                    expectOperand = false;
+                }
+                else
+                {
+                    throw std::logic_error("Unexpected token");
+                }
+                i += length;
+                while (infix[i] == ' ') ++i;
+            }
+            while (top)
+            {
+                if (stack[top - 1].kind == K_OPEN)
+                    throw std::logic_error("Unbalanced parenthesis");
+                output(stack[--top]);
+            }
+
+            long height = 0;
+            for (size_t k = 0; k < expression.size; ++k)
+            {
+                const Kind kind = expression.tokens[k].kind;
+                height -= kind == K_PREFIX || kind == K_POSTFIX ? 1 : kind == K_BINARY ? 2 : 0;
+                if (height < 0)
+                    throw std::logic_error("Missing operand");
+                ++height;
+            }
+            if (height != 1)
+                throw std::logic_error("Incomplete expression");
+            return expression;
+        }
+
+        template<size_t N>
+        constexpr size_t start(const Expression<N>& expression, size_t index)
+        {
+            long needed = 1;
+            while (true)
+            {
+                const Kind kind = expression.tokens[index].kind;
+                needed += kind == K_BINARY ? 1 : kind == K_PREFIX || kind == K_POSTFIX ? 0 : -1;
+                if (needed == 0)
+                    return index;
+                --index;
+            }
+        }
+
+        template<size_t N>
+        constexpr bool constant(const Expression<N>& expression, const size_t index)
+        {
+            for (size_t k = start(expression, index); k <= index; ++k)
+            {
+                if (expression.tokens[k].kind == K_ARGUMENT)
+                    return false;
+            }
+            return true;
+        }
+
+        // Keeps the compiler from evaluating or specializing library calls on
+        // constant arguments, which need not round like the library does.
+        inline double opaque(const double x)
+        {
+            volatile double value = x;
+            return value;
+        }
+
+        inline double apply(const Operation operation, const double x)
+        {
+            switch (operation)
+            {
+                case NEGATE: return operators::negate(x);
+                case CEIL: return operators::ceil(x);
+                case COS: return operators::cos(opaque(x));
+                case EXP: return operators::exp(opaque(x));
+                case FLOOR: return operators::floor(x);
+                case ROUND: return operators::round(x);
+                case SIN: return operators::sin(opaque(x));
+                default: return operators::factorial(x);
+            }
+        }
+
+        inline double apply(const Operation operation, const double a, const double b)
+        {
+            switch (operation)
+            {
+                case MULTIPLY: return operators::multiply(a, b);
+                case ADD: return operators::add(a, b);
+                case SUBTRACT: return operators::subtract(a, b);
+                case DIVIDE: return operators::divide(a, b);
+                default: return operators::power(opaque(a), opaque(b));
+            }
+        }
+
+        template<auto E, size_t I, bool Optimize>
+        struct Node
+        {
+            static constexpr Token token = E.tokens[I];
+            static constexpr bool fold = constant(E, I);
+            static constexpr bool optimize = Optimize && !fold;
+
+            static constexpr size_t right = I - 1;
+            static constexpr size_t left = token.kind == K_BINARY ? start(E, right) - 1 : right;
+
+            using Left = Node<E, left, optimize>;
+            using Right = Node<E, right, optimize>;
+
+            [[gnu::always_inline]] static inline double value(const double* args)
+            {
+                if constexpr (token.kind == K_NUMBER)
+                {
+                    return token.value;
+                }
+                else if constexpr (token.kind == K_ARGUMENT)
+                {
+                    return args[token.slot];
+                }
+                else if constexpr (token.kind == K_PREFIX || token.kind == K_POSTFIX)
+                {
+                    return apply(token.operation, Right::value(args));
+                }
+                else if constexpr (optimize && simd::Fused && token.operation == ADD)
+                {
+                    double a, b;
+                    if (Left::factors(args, a, b))
+                        return std::fma(a, b, Right::value(args));
+                    if (Right::factors(args, a, b))
+                        return std::fma(a, b, Left::value(args));
+                    return apply(ADD, Left::value(args), Right::value(args));
+                }
+                else if constexpr (optimize && token.operation == POWER)
+                {
+                    double a, b;
+                    if (power(args, a, b))
+                        return a * b;
+                    return a;
+                }
+                else
+                {
+                    return apply(token.operation, Left::value(args), Right::value(args));
+                }
+            }
+
+            // Whether the optimized node is a multiplication, and its factors.
+            [[gnu::always_inline]] static inline bool factors(const double* args, double& a, double& b)
+            {
+                if constexpr (!optimize || token.kind != K_BINARY)
+                {
+                    return false;
+                }
+                else if constexpr (token.operation == MULTIPLY)
+                {
+                    a = Left::value(args);
+                    b = Right::value(args);
+                    return true;
+                }
+                else if constexpr (token.operation == POWER)
+                {
+                    if constexpr (!Right::fold)
+                    {
+                        return false;
+                    }
+                    else
+                    {
+                        const double n = Right::value(args);
+                        if (n == 1)
+                            return Left::factors(args, a, b);
+                        return n != std::floor(n) || n < 0 || n > Optimizer::MaxPower ? false : power(args, a, b);
+                    }
+                }
+                else
+                {
+                    return false;
+                }
+            }
+
+            // Repeats Optimizer::reduce. Returns true with the factors of the
+            // final multiplication, or false with the result in a.
+            static inline bool power(const double* args, double& a, double& b)
+            {
+                const double exponent = Right::value(args);
+                if (!Right::fold
+                    || exponent != std::floor(exponent)
+                    || exponent < 0
+                    || exponent > Optimizer::MaxPower)
+                {
+                    a = apply(POWER, Left::value(args), exponent);
+                    return false;
+                }
+                auto n = (unsigned) exponent;
+                if (n == 0)
+                {
+                    a = 1;
+                    return false;
+                }
+
+                double square = Left::value(args), product = 0;
+                double squareFactors[2] {}, productFactors[2] {};
+                bool squared = false, multiplied = false, first = true;
+                while (true)
+                {
+                    if (n & 1)
+                    {
+                        if (first)
+                        {
+                            product = square;
+                            productFactors[0] = squareFactors[0];
+                            productFactors[1] = squareFactors[1];
+                            multiplied = squared;
+                            first = false;
+                        }
+                        else
+                        {
+                            productFactors[0] = product;
+                            productFactors[1] = square;
+                            product = product * square;
+                            multiplied = true;
+                        }
+                    }
+                    n >>= 1;
+                    if (n == 0)
+                        break;
+                    squareFactors[0] = squareFactors[1] = square;
+                    square = square * square;
+                    squared = true;
+                }
+                if (!multiplied)
+                {
+                    a = product;
+                    return false;
+                }
+                a = productFactors[0];
+                b = productFactors[1];
+                return true;
+            }
+        };
+    }
+
+    template<FixedString Infix, Optimizer::Level Level>
+    struct StaticFunction
+    {
+        static constexpr auto expression = detail::parse(Infix);
+        static constexpr size_t arity = expression.parameters;
+
+        using Root = detail::Node<expression, expression.size - 1, Level >= Optimizer::O2>;
+
+        static constexpr std::array<std::string_view, arity> parameters()
+        {
+            std::array<std::string_view, arity> names;
+            for (size_t i = 0; i < arity; ++i)
+                names[i] = std::string_view(Infix.data + expression.offsets[i], expression.lengths[i]);
+            return names;
+        }
+
+        template<typename... Args>
+        requires (sizeof...(Args) == arity && (std::is_arithmetic_v<Args> && ...))
+        double operator()(const Args... args) const
+        {
+            const std::array<double, sizeof...(Args)> values {static_cast<double>(args)...};
+            return Root::value(values.data());
+        }
+
+        double operator()(std::span<const double> args) const
+        {
+            if (args.size() < arity)
+                throw std::out_of_range("Not enough arguments");
+            return Root::value(args.data());
+        }
+    };
+
+    template<FixedString Infix, Optimizer::Level Level = Optimizer::O2>
+    constexpr auto compile()
+    {
+        return StaticFunction<Infix, Level> {};
+    }
+}
+
+
+#endif //INC_4_FUNCTIONS_STATICCOMPILER_HPP
@@ -0,0 +1,286 @@
+#ifndef INC_4_FUNCTIONS_STREAM_HPP
+#define INC_4_FUNCTIONS_STREAM_HPP
+
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Function.hpp"
+#include "MappedFile.hpp"
+
+using std::string;
+
+
+// Accumulates output in a large buffer and hands it to the file descriptor
+// in few big writes.
+class Writer
+{
+public:
+    static constexpr size_t Capacity = 1 << 20;
+
+private:
+    int _fd;
+    bool _owned;
+    std::unique_ptr<char[]> _buffer;
+    size_t _size = 0;
+
+public:
+    // "-" writes to the standard output.
+    explicit Writer(const string& path) : _buffer(std::make_unique<char[]>(Capacity))
+    {
+        _owned = path != "-";
+        _fd = _owned ? open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+        if (_fd < 0)
+            throw std::system_error(errno, std::generic_category(), path);
+    }
+
+    Writer(const Writer&) = delete;
+    Writer& operator=(const Writer&) = delete;
+
+    ~Writer()
+    {
+        try
+        {
+            flush();
+        }
+        catch (const std::exception&)
+        {
+        }
+        if (_owned)
+            close(_fd);
+    }
+
+    void write(const void* data, size_t size)
+    {
+        auto bytes = static_cast<const char*>(data);
+        while (size > 0)
+        {
+            if (_size == Capacity)
+                flush();
+            const size_t count = std::min(size, Capacity - _size);
+            std::memcpy(_buffer.get() + _size, bytes, count);
+            _size += count;
+            bytes += count;
+            size -= count;
+        }
+    }
+
+    // Writes the shortest representation that reads back to the same value,
+    // followed by a newline.
+    void line(const double value)
+    {
+        if (Capacity - _size < 32)
+            flush();
+        char* end = std::to_chars(_buffer.get() + _size, _buffer.get() + Capacity, value).ptr;
+        *end++ = '\n';
+        _size = end - _buffer.get();
+    }
+
+    void flush()
+    {
+        size_t written = 0;
+        while (written < _size)
+        {
+            const ssize_t count = ::write(_fd, _buffer.get() + written, _size - written);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                _size = 0;
+                throw std::system_error(errno, std::generic_category(), "write");
+            }
+            written += count;
+        }
+        _size = 0;
+    }
+};
+
+
+// Evaluates a function over every row of an argument file and writes one
+// result per row. Two formats are recognised by extension:
+//   .bin - raw little-endian doubles, one column per parameter stored one
+//          after another; the results are written as raw doubles too.
+//   else - CSV with one row per line and an optional header naming the
+//          parameters; the results are written one per line.
+class Stream
+{
+public:
+    static constexpr size_t Rows = 16 * Function::BlockSize;
+
+    struct Report
+    {
+        size_t rows = 0;
+        double seconds = 0;
+
+        [[nodiscard]] double throughput() const
+        {
+            return seconds > 0 ? (double) rows / seconds : 0;
+        }
+    };
+
+    static bool binary(const string& path)
+    {
+        return path.size() >= 4 && path.compare(path.size() - 4, 4, ".bin") == 0;
+    }
+
+    static Report run(const Function& function, const string& input, const string& output)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const MappedFile file(input);
+        Writer writer(output);
+        Report report;
+        report.rows = binary(input) ? columns(function, file, writer) : csv(function, file, writer);
+        writer.flush();
+        report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return report;
+    }
+
+private:
+    static size_t columns(const Function& function, const MappedFile& file, Writer& writer)
+    {
+        if constexpr (std::endian::native != std::endian::little)
+            throw std::logic_error("Binary argument files require a little-endian host");
+
+        const size_t n = function.parameters().size();
+        if (n == 0)
+            throw std::logic_error("The function takes no arguments");
+        if (file.size() % (n * sizeof(double)) != 0)
+            throw std::logic_error("File size is not a multiple of " + std::to_string(n) + " columns");
+
+        const size_t rows = file.size() / (n * sizeof(double));
+        const auto base = reinterpret_cast<const double*>(file.data());
+        std::vector<const double*> columns(n);
+        std::vector<double> out(Function::ChunkSize);
+        for (size_t start = 0; start < rows; start += Function::ChunkSize)
+        {
+            const size_t count = std::min(Function::ChunkSize, rows - start);
+            for (size_t k = 0; k < n; ++k)
+                columns[k] = base + k * rows + start;
+            function.evaluateParallel(columns, count, out.data());
+            writer.write(out.data(), count * sizeof(double));
+            for (size_t k = 0; k < n; ++k)
+                file.release((k * rows + start) * sizeof(double), count * sizeof(double));
+        }
+        return rows;
+    }
+
+    static size_t csv(const Function& function, const MappedFile& file, Writer& writer)
+    {
+        const std::vector<string>& parameters = function.parameters();
+        const size_t n = parameters.size();
+        const char* p = file.data();
+        const char* const end = p + file.size();
+
+        // Maps every column to the parameter slot it feeds, or -1.
+        std::vector<long> slots;
+        double probe;
+        const bool header = p != end && std::from_chars(skip(p, end), end, probe).ec != std::errc();
+        if (header)
+        {
+            const char* line = p;
+            while (p != end && *p != '\n') ++p;
+            for (const char* field = line; field <= p; ++field)
+            {
+                const char* next = std::find(field, p, ',');
+                string name(skip(field, next), next);
+                while (!name.empty() && std::isspace((unsigned char) name.back())) name.pop_back();
+                auto lookup = std::find(parameters.begin(), parameters.end(), name);
+                slots.push_back(lookup != parameters.end() ? lookup - parameters.begin() : -1);
+                field = next;
+            }
+            for (size_t slot = 0; slot < n; ++slot)
+            {
+                if (std::find(slots.begin(), slots.end(), (long) slot) == slots.end())
+                    throw std::logic_error("No column for '" + parameters[slot] + "'");
+            }
+            p += p != end;
+        }
+        else
+        {
+            for (size_t slot = 0; slot < n; ++slot)
+                slots.push_back((long) slot);
+        }
+
+        std::vector<double> values(n * Rows);
+        std::vector<const double*> columns(n);
+        for (size_t slot = 0; slot < n; ++slot)
+            columns[slot] = values.data() + slot * Rows;
+        std::vector<double> out(Rows);
+
+        size_t rows = 0, line = header, row = 0;
+        const char* released = file.data();
+        auto drain = [&]()
+        {
+            if (row > 0)
+                function.evaluateBatch(columns, row, out.data());
+            for (size_t i = 0; i < row; ++i)
+                writer.line(out[i]);
+            rows += row;
+            row = 0;
+            file.release(released - file.data(), p - released);
+            released = p;
+        };
+
+        while (p != end)
+        {
+            ++line;
+            p = skip(p, end);
+            while (p != end && *p == '\r') ++p;
+            if (p == end)
+                break;
+            if (*p == '\n')
+            {
+                ++p;
+                continue;
+            }
+            size_t column = 0, filled = 0;
+            while (true)
+            {
+                p = skip(p, end);
+                if (column < slots.size() && slots[column] >= 0)
+                {
+                    double& value = values[slots[column] * Rows + row];
+                    auto [next, error] = std::from_chars(p, end, value);
+                    if (error != std::errc())
+                        throw std::logic_error("Invalid number on line " + std::to_string(line));
+                    p = skip(next, end);
+                    ++filled;
+                }
+                else
+                {
+                    while (p != end && *p != ',' && *p != '\n') ++p;
+                }
+                if (p == end || *p != ',')
+                    break;
+                ++p;
+                ++column;
+            }
+            while (p != end && *p == '\r') ++p;
+            if (p != end && *p != '\n')
+                throw std::logic_error("Unexpected character on line " + std::to_string(line));
+            p += p != end;
+            if (filled < n)
+                throw std::logic_error("Missing arguments on line " + std::to_string(line));
+            if (++row == Rows)
+                drain();
+        }
+        drain();
+        return rows;
+    }
+
+    static const char* skip(const char* p, const char* const end)
+    {
+        while (p != end && (*p == ' ' || *p == '\t')) ++p;
+        return p;
+    }
+};
+
+
+#endif //INC_4_FUNCTIONS_STREAM_HPP
@@ -0,0 +1,181 @@
+#ifndef INC_4_FUNCTIONS_THREADPOOL_HPP
+#define INC_4_FUNCTIONS_THREADPOOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+class ThreadPool
+{
+private:
+    struct Job
+    {
+        std::function<void(size_t)> body;
+        std::atomic<size_t> remaining;
+        // The first exception a body threw; the tasks left are then skipped.
+        std::atomic<bool> failed = false;
+        std::exception_ptr error;
+    };
+
+    struct Task
+    {
+        Job* job;
+        size_t index;
+    };
+
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> _queues;
+    std::vector<std::thread> _workers;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _done;
+    std::atomic<size_t> _pending = 0;
+    bool _stopping = false;
+
+public:
+    explicit ThreadPool(size_t threads = std::thread::hardware_concurrency())
+    {
+        threads = std::max<size_t>(threads, 1);
+        for (size_t i = 0; i < threads; ++i)
+            _queues.push_back(std::make_unique<Queue>());
+        for (size_t i = 0; i < threads; ++i)
+            _workers.emplace_back([this, i]() { work(i); });
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _wake.notify_all();
+        for (auto& worker: _workers)
+            worker.join();
+    }
+
+    static ThreadPool& shared()
+    {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        return _workers.size();
+    }
+
+    // Runs body(0) ... body(count - 1) across the workers and returns once all
+    // of them have finished. The calling thread takes part in the work. If a
+    // body throws, the first exception is rethrown here once the rest are done.
+    void parallelFor(const size_t count, std::function<void(size_t)> body)
+    {
+        if (count == 0)
+            return;
+
+        Job job {.body = std::move(body), .remaining = count, .failed = false, .error = nullptr};
+        for (size_t i = 0; i < count; ++i)
+        {
+            Queue& queue = *_queues[i % _queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(Task {&job, i});
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _pending += count;
+        }
+        _wake.notify_all();
+
+        Task task {};
+        while (job.remaining.load(std::memory_order_acquire) != 0 && steal(0, task))
+            run(task);
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done.wait(lock, [&job]() { return job.remaining.load(std::memory_order_acquire) == 0; });
+        if (job.error)
+            std::rethrow_exception(job.error);
+    }
+
+private:
+    void work(const size_t index)
+    {
+        Task task {};
+        while (true)
+        {
+            if (pop(index, task) || steal(index + 1, task))
+            {
+                run(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(_mutex);
+            _wake.wait(lock, [this]() { return _stopping || _pending.load() != 0; });
+            if (_stopping && _pending.load() == 0)
+                return;
+        }
+    }
+
+    bool pop(const size_t index, Task& task)
+    {
+        Queue& queue = *_queues[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+            return false;
+        task = queue.tasks.back();
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(const size_t start, Task& task)
+    {
+        for (size_t i = 0; i < _queues.size(); ++i)
+        {
+            Queue& queue = *_queues[(start + i) % _queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty())
+            {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(const Task& task)
+    {
+        _pending.fetch_sub(1);
+        Job& job = *task.job;
+        try
+        {
+            if (!job.failed.load(std::memory_order_relaxed))
+                job.body(task.index);
+        }
+        catch (...)
+        {
+            if (!job.failed.exchange(true))
+                job.error = std::current_exception();
+        }
+        if (job.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _done.notify_all();
+        }
+    }
+};
+
+
+#endif //INC_4_FUNCTIONS_THREADPOOL_HPP
@@ -1,33 +1,48 @@
 #ifndef INC_4_FUNCTIONS_TOKEN_HPP
 #define INC_4_FUNCTIONS_TOKEN_HPP
 
-#include <string>
-#include <stack>
-#include <functional>
-#include <map>
+#include <string_view>
 
-using Stack = std::stack<double>&;
-using Args = const std::map<std::string, double>&;
-using Unit = std::function<double (Stack, Args)>;
+#include "Grammar.hpp"
 
+template<typename Value>
+class BasicFunction;
 
-enum TokenType : unsigned char
+enum TokenType : unsigned short
 {
-    TT_NUMBER   = 0b00000001,
-    TT_PREFIX   = 0b00000010,
-    TT_BINARY   = 0b00000100,
-    TT_POSTFIX  = 0b00001000,
-    TT_OPEN     = 0b00010000,
-    TT_CLOSE    = 0b00100000,
-    TT_ARGUMENT = 0b01000000
+    TT_NUMBER   = 0b00000000001,
+    TT_PREFIX   = 0b00000000010,
+    TT_BINARY   = 0b00000000100,
+    TT_POSTFIX  = 0b00000001000,
+    TT_OPEN     = 0b00000010000,
+    TT_CLOSE    = 0b00000100000,
+    TT_ARGUMENT = 0b00001000000,
+    TT_CALL     = 0b00010000000,
+    TT_COMMA    = 0b00100000000,
+    // The '?' of a conditional, and its ':', which in postfix stands for
+    // the whole conditional.
+    TT_IF       = 0b01000000000,
+    TT_ELSE     = 0b10000000000
 };
 
 
-struct Token
+// A token refers to its text in the infix expression it was read from and
+// to the operator or function it was resolved to, so compiling it needs
+// neither copies of names nor further lookups. A call without a callee is
+// to the built-in min or max.
+template<typename Value>
+struct BasicToken
 {
     TokenType type;
-    std::string value;
+    std::string_view value;
+    unsigned arity = 0;
+    Syntax::Precedence precedence = 0;
+    const typename BasicGrammar<Value>::UnaryOperator* unary = nullptr;
+    const typename BasicGrammar<Value>::BinaryOperator* binary = nullptr;
+    const BasicFunction<Value>* callee = nullptr;
 };
 
+using Token = BasicToken<double>;
+
 
 #endif //INC_4_FUNCTIONS_TOKEN_HPP
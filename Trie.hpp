@@ -0,0 +1,67 @@
+#ifndef INC_4_FUNCTIONS_TRIE_HPP
+#define INC_4_FUNCTIONS_TRIE_HPP
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+class Trie
+{
+private:
+    struct Node
+    {
+        std::vector<std::pair<char, unsigned>> children;
+        bool terminal = false;
+    };
+
+    std::vector<Node> _nodes {Node {}};
+
+public:
+    void insert(const std::string& key)
+    {
+        unsigned node = 0;
+        for (const char c: key)
+        {
+            unsigned next = child(node, c);
+            if (next == 0)
+            {
+                next = _nodes.size();
+                auto& children = _nodes[node].children;
+                children.insert(std::lower_bound(children.begin(), children.end(), std::make_pair(c, 0u)),
+                                std::make_pair(c, next));
+                _nodes.emplace_back();
+            }
+            node = next;
+        }
+        _nodes[node].terminal = true;
+    }
+
+    // Length of the longest key that s has at position start, 0 if none.
+    [[nodiscard]] size_t match(const std::string& s, const size_t start) const
+    {
+        unsigned node = 0;
+        size_t length = 0;
+        for (size_t i = start; i < s.size(); ++i)
+        {
+            node = child(node, s[i]);
+            if (node == 0)
+                break;
+            if (_nodes[node].terminal)
+                length = i - start + 1;
+        }
+        return length;
+    }
+
+private:
+    [[nodiscard]] unsigned child(const unsigned node, const char c) const
+    {
+        const auto& children = _nodes[node].children;
+        auto lookup = std::lower_bound(children.begin(), children.end(), std::make_pair(c, 0u));
+        return (lookup != children.end() && lookup->first == c) ? lookup->second : 0;
+    }
+};
+
+
+#endif //INC_4_FUNCTIONS_TRIE_HPP
@@ -0,0 +1,1075 @@
+// functions_bench [--json] [--quick] [--filter text] [--repetitions n] [--warmup n]
+//
+// Every case runs `warmup` times untimed and then `repetitions` times; the
+// statistics are taken over the per-operation time of each repetition.
+// --json prints the results as a single JSON document on stdout, --quick
+// divides the work of every case by ten and --filter keeps the cases whose
+// "group/name" contains the given text.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Calculator.hpp"
+#include "Grid.hpp"
+#include "Incremental.hpp"
+#include "Registry.hpp"
+#include "StaticCompiler.hpp"
+
+
+static volatile double sink;
+
+static double seconds(const std::chrono::steady_clock::duration duration)
+{
+    return std::chrono::duration<double>(duration).count();
+}
+
+// Reference corpus. Entries are only ever appended, so that results stay
+// comparable from one commit to the next.
+static const char* corpus[] = {
+        "x*y+z",
+        "2*pi*x+e",
+        "(x+1)^2-3*x*y+y/z",
+        "-x*(y-z)/(x*x+y*y+1)",
+        "sin(x)*cos(y)+exp(-z)",
+        "round(x*3)-floor(y)/(x*x+1)+ceil(x/y)*sin(y)",
+        "a*b*c*d+e^(a-b)/(c*c+d*d+1)-sin(a*e)*cos(b+c)",
+        "((x+y)*(x-y)+(x*y)^3)/((x+1)*(y+1)*(z+1)+1)"
+};
+
+// A deterministic expression of the given number of terms over x, y and z.
+static string huge(const size_t terms)
+{
+    static const char* patterns[] = {"x*%zu", "sin(y-%zu)", "(x+%zu)/(z*z+1)", "y^2*%zu", "-z*exp(-x/%zu)"};
+    string expression;
+    char term[64];
+    for (size_t i = 0; i < terms; ++i)
+    {
+        snprintf(term, sizeof term, patterns[i % 5], i + 1);
+        expression += i ? " + " : "";
+        expression += term;
+    }
+    return expression;
+}
+
+static std::vector<double> sample(const size_t n, const unsigned seed, const double low, const double high)
+{
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> distribution(low, high);
+    std::vector<double> values(n);
+    for (double& value: values)
+        value = distribution(random);
+    return values;
+}
+
+// The thread counts to measure, from two up to the number of cores. A pool
+// of n workers runs n + 1 threads, as the caller of parallelFor takes part.
+static std::vector<size_t> threadCounts()
+{
+    const size_t cores = std::max<unsigned>(std::thread::hardware_concurrency(), 2);
+    std::vector<size_t> counts;
+    for (size_t threads = 2; threads < cores; threads *= 2)
+        counts.push_back(threads);
+    counts.push_back(cores);
+    return counts;
+}
+
+
+class Suite
+{
+public:
+    struct Result
+    {
+        string group;
+        string name;
+        size_t operations = 0;
+        double min = 0;
+        double median = 0;
+        double mean = 0;
+        double stddev = 0;
+        std::vector<std::pair<string, double>> metrics;
+    };
+
+private:
+    bool _json = false;
+    bool _quick = false;
+    string _filter;
+    size_t _repetitions = 10;
+    size_t _warmup = 2;
+    std::vector<Result> _results;
+    bool _ran = false;
+
+public:
+    Suite(const int argc, char* argv[])
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            const string option = argv[i];
+            if (option == "--json")
+                _json = true;
+            else if (option == "--quick")
+                _quick = true;
+            else if (option == "--filter" && i + 1 < argc)
+                _filter = argv[++i];
+            else if (option == "--repetitions" && i + 1 < argc)
+                _repetitions = std::max(1ul, std::stoul(argv[++i]));
+            else if (option == "--warmup" && i + 1 < argc)
+                _warmup = std::stoul(argv[++i]);
+            else
+                throw std::logic_error("Unknown option: " + option);
+        }
+    }
+
+    // Scales the work of a case down in quick mode.
+    [[nodiscard]] size_t work(const size_t operations) const
+    {
+        return _quick ? std::max<size_t>(operations / 10, 1) : operations;
+    }
+
+    [[nodiscard]] bool enabled(const string& group, const string& name) const
+    {
+        return (group + '/' + name).find(_filter) != string::npos;
+    }
+
+    // Times body(), which performs `operations` operations.
+    template<typename Body>
+    void run(const string& group, const string& name, const size_t operations, Body body)
+    {
+        _ran = enabled(group, name);
+        if (!_ran)
+            return;
+        for (size_t i = 0; i < _warmup; ++i)
+            body();
+        std::vector<double> times(_repetitions);
+        for (double& time: times)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            body();
+            time = seconds(std::chrono::steady_clock::now() - start) * 1e9 / (double) operations;
+        }
+        std::sort(times.begin(), times.end());
+
+        Result result {group, name, operations};
+        result.min = times.front();
+        result.median = times.size() % 2 ? times[times.size() / 2]
+                                         : (times[times.size() / 2 - 1] + times[times.size() / 2]) / 2;
+        for (const double time: times)
+            result.mean += time / (double) times.size();
+        for (const double time: times)
+            result.stddev += (time - result.mean) * (time - result.mean) / (double) times.size();
+        result.stddev = std::sqrt(result.stddev);
+        _results.push_back(result);
+        if (!_json)
+            print(result, false);
+    }
+
+    // Median time per operation of the last case, in nanoseconds.
+    [[nodiscard]] double median() const
+    {
+        return _ran ? _results.back().median : 0;
+    }
+
+    // Attaches a named figure to the last case, unless it was filtered out.
+    void metric(const string& name, const double value)
+    {
+        if (!_ran)
+            return;
+        _results.back().metrics.emplace_back(name, value);
+        if (!_json)
+            printf("      %-24s %g\n", name.c_str(), value);
+    }
+
+    void group(const string& title) const
+    {
+        if (!_json)
+            printf("%s\n", title.c_str());
+    }
+
+    void report() const
+    {
+        if (!_json)
+            return;
+        printf("{\n  \"suite\": \"functions_bench\",\n  \"version\": 1,\n");
+        printf("  \"fused\": %s,\n", simd::Fused ? "true" : "false");
+        printf("  \"profiling\": %s,\n", Function::Profiling ? "true" : "false");
+        printf("  \"repetitions\": %zu,\n  \"warmup\": %zu,\n  \"quick\": %s,\n",
+               _repetitions, _warmup, _quick ? "true" : "false");
+        printf("  \"results\": [");
+        for (size_t i = 0; i < _results.size(); ++i)
+        {
+            printf(i ? ",\n    " : "\n    ");
+            print(_results[i], true);
+        }
+        printf("\n  ]\n}\n");
+    }
+
+private:
+    static string escape(const string& text)
+    {
+        string result;
+        for (const char c: text)
+        {
+            if (c == '"' || c == '\\')
+                result += '\\';
+            result += c;
+        }
+        return result;
+    }
+
+    static void print(const Result& result, const bool json)
+    {
+        if (!json)
+        {
+            printf("  %-52s %10.2f ns/op  min %10.2f  mean %10.2f  sd %8.2f\n",
+                   result.name.c_str(), result.median, result.min, result.mean, result.stddev);
+            return;
+        }
+        printf("{\"group\": \"%s\", \"name\": \"%s\", \"operations\": %zu, "
+               "\"ns_per_op\": {\"min\": %.4f, \"median\": %.4f, \"mean\": %.4f, \"stddev\": %.4f}",
+               escape(result.group).c_str(), escape(result.name).c_str(), result.operations,
+               result.min, result.median, result.mean, result.stddev);
+        if (!result.metrics.empty())
+        {
+            printf(", \"metrics\": {");
+            for (size_t i = 0; i < result.metrics.size(); ++i)
+                printf("%s\"%s\": %.6g", i ? ", " : "", escape(result.metrics[i].first).c_str(),
+                       result.metrics[i].second);
+            printf("}");
+        }
+        printf("}");
+    }
+};
+
+
+static std::vector<string> expressions()
+{
+    std::vector<string> result(std::begin(corpus), std::end(corpus));
+    result.push_back(huge(100));
+    result.push_back(huge(1000));
+    return result;
+}
+
+static string label(const string& expression)
+{
+    return expression.size() <= 48 ? expression : "huge(" + std::to_string(expression.size()) + " chars)";
+}
+
+static void benchmarkTokenize(Suite& suite, Compiler& compiler)
+{
+    suite.group("tokenize: infix to postfix tokens");
+    for (const string& expression: expressions())
+    {
+        const size_t count = suite.work(std::max<size_t>(200'000 / expression.size(), 10));
+        suite.run("tokenize", label(expression), count, [&]()
+        {
+            size_t tokens = 0;
+            for (size_t i = 0; i < count; ++i)
+                tokens += compiler.tokenize(expression).size();
+            sink = (double) tokens;
+        });
+        suite.metric("MB/s", (double) expression.size() * 1e3 / suite.median());
+    }
+}
+
+static void benchmarkCompile(Suite& suite, Compiler& compiler)
+{
+    suite.group("compile: infix to optimized program");
+    for (const string& expression: expressions())
+    {
+        const size_t count = suite.work(std::max<size_t>(50'000 / expression.size(), 5));
+        suite.run("compile", label(expression), count, [&]()
+        {
+            size_t size = 0;
+            for (size_t i = 0; i < count; ++i)
+                size += compiler.compile(expression).program().instructions.size();
+            sink = (double) size;
+        });
+        suite.metric("MB/s", (double) expression.size() * 1e3 / suite.median());
+    }
+}
+
+static void benchmarkGrammarSize(Suite& suite)
+{
+    suite.group("compile: throughput by grammar size");
+    for (const size_t functions: {10, 100, 1000, 5000})
+    {
+        Grammar grammar;
+        Calculator::setupGrammar(grammar);
+        std::mt19937 random(11);
+        std::vector<string> names;
+        for (size_t i = 0; i < functions; ++i)
+        {
+            string name;
+            for (size_t length = 3 + random() % 8; length > 0; --length)
+                name += static_cast<char>('a' + random() % 26);
+            names.push_back(name);
+            grammar.addPrefixOperator(name, operators::sin);
+        }
+        Compiler compiler(grammar);
+
+        std::vector<string> sources;
+        for (size_t i = 0; i < 256; ++i)
+        {
+            string expression = "x";
+            for (size_t term = 0; term < 8; ++term)
+                expression += " + " + names[random() % names.size()] + "(x*y-" + std::to_string(term) + ")";
+            sources.push_back(expression);
+        }
+
+        const size_t count = suite.work(2'000);
+        suite.run("grammar", "functions=" + std::to_string(grammar.prefix().size()), count, [&]()
+        {
+            size_t size = 0;
+            for (size_t i = 0; i < count; ++i)
+                size += compiler.compile(sources[i % sources.size()]).program().instructions.size();
+            sink = (double) size;
+        });
+    }
+}
+
+static void benchmarkBulk(Suite& suite, const Compiler& compiler)
+{
+    suite.group("bulk: parallel compilation of a catalog by thread count");
+    std::vector<string> catalog;
+    for (size_t i = 0; i < suite.work(8192); ++i)
+        catalog.push_back(string(corpus[i % std::size(corpus)]) + "+" + std::to_string(i));
+
+    for (const size_t threads: threadCounts())
+    {
+        ThreadPool pool(threads - 1);
+        size_t failures = 0;
+        suite.run("bulk", "threads=" + std::to_string(threads), catalog.size(), [&]()
+        {
+            failures = 0;
+            for (const Compiler::Result& result: compiler.compile(catalog, pool))
+                failures += !result.function;
+        });
+        suite.metric("expressions/s", 1e9 / suite.median());
+        suite.metric("failures", (double) failures);
+    }
+}
+
+// Latency of a single call on each tier: the interpreter and native code.
+static void benchmarkTiers(Suite& suite,
+                           const string& group,
+                           const string& name,
+                           const string& expression,
+                           Compiler& compiler)
+{
+    Function f = compiler.compile(expression);
+    f.jitThreshold(0);
+    std::vector<double> args = sample(f.parameters().size(), 3, 0.5, 2);
+    const size_t count = suite.work(1'000'000);
+    suite.run(group, name + " [interpreter]", count, [&]()
+    {
+        double total = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            args[0] = 0.5 + 1e-7 * (double) i;
+            total += f.interpret(args);
+        }
+        sink = total;
+    });
+    if (!f.jit())
+        return;
+    suite.run(group, name + " [native]", count, [&]()
+    {
+        double total = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            args[0] = 0.5 + 1e-7 * (double) i;
+            total += f.evaluate(args);
+        }
+        sink = total;
+    });
+}
+
+static void benchmarkOperators(Suite& suite, Compiler& compiler)
+{
+    suite.group("evaluate: latency per operator class");
+    for (const char* expression: {"x+y", "x-y", "x*y", "x/y", "x^y", "x^3", "-x", "exp(x)", "sin(x)", "cos(x)",
+                                  "floor(x)", "round(x)", "x!", "x*y+z"})
+        benchmarkTiers(suite, "operator", expression, expression, compiler);
+}
+
+static void benchmarkExpressions(Suite& suite, Compiler& compiler)
+{
+    suite.group("evaluate: reference corpus");
+    for (const char* expression: corpus)
+        benchmarkTiers(suite, "expression", expression, expression, compiler);
+}
+
+static void benchmarkArguments(Suite& suite, Compiler& compiler)
+{
+    suite.group("evaluate: scaling with the number of arguments");
+    for (const size_t count: {1, 2, 4, 8, 16, 32})
+    {
+        string expression;
+        for (size_t i = 0; i < count; ++i)
+        {
+            expression += i ? "+v" : "v";
+            for (size_t digits = i; ; digits /= 26)
+            {
+                expression += (char) ('a' + digits % 26);
+                if (digits < 26)
+                    break;
+            }
+        }
+        benchmarkTiers(suite, "arguments", "n=" + std::to_string(count), expression, compiler);
+    }
+}
+
+static void benchmarkBatch(Suite& suite, Compiler& compiler)
+{
+    suite.group("batch: evaluateBatch per row");
+    const size_t rows = suite.work(1 << 20);
+    std::vector<std::vector<double>> data;
+    for (unsigned k = 0; k < 8; ++k)
+        data.push_back(sample(rows, 5 + k, 0.5, 2));
+    std::vector<double> out(rows);
+    for (const char* expression: corpus)
+    {
+        Function f = compiler.compile(expression);
+        std::vector<const double*> columns;
+        for (size_t k = 0; k < f.parameters().size(); ++k)
+            columns.push_back(data[k % data.size()].data());
+        suite.run("batch", expression, rows, [&]()
+        {
+            f.evaluateBatch(columns, rows, out.data());
+            sink = out[rows / 2];
+        });
+        suite.metric("rows/s", 1e9 / suite.median());
+    }
+}
+
+// The vector rounding kernels against the scalar operators, over fractions
+// of both signs and zeros of both signs, which must come out bit for bit.
+static void benchmarkRounding(Suite& suite, Compiler& compiler)
+{
+    suite.group("rounding: batch kernels (bit-exact against evaluate)");
+    const size_t rows = suite.work(1 << 20);
+    std::vector<double> x = sample(rows, 61, -4, 4), out(rows);
+    for (size_t i = 0; i + 1 < rows; i += 16)
+    {
+        x[i] = i % 32 ? -0.0 : 0.0;
+        x[i + 1] = std::round(x[i + 1] * 2) / 2;
+    }
+    const double* columns[] = {x.data()};
+    for (const char* expression: {"floor(x)", "ceil(x)", "round(x)"})
+    {
+        Function f = compiler.compile(expression);
+        if (!suite.enabled("rounding", expression))
+            continue;
+        f.evaluateBatch(columns, rows, out.data());
+        size_t mismatches = 0;
+        for (size_t i = 0; i < rows; ++i)
+        {
+            const double expected = f.interpret(std::span<const double>(&x[i], 1));
+            mismatches += std::memcmp(&expected, &out[i], sizeof expected) != 0;
+        }
+        if (mismatches)
+            throw std::logic_error("The batch and scalar results of '" + string(expression) + "' differ for "
+                                   + std::to_string(mismatches) + " of " + std::to_string(rows) + " rows");
+        suite.run("rounding", expression, rows, [&]()
+        {
+            f.evaluateBatch(columns, rows, out.data());
+            sink = out[rows / 2];
+        });
+        suite.metric("mismatches", (double) mismatches);
+    }
+}
+
+static void benchmarkParallel(Suite& suite, Compiler& compiler)
+{
+    suite.group("parallel: evaluateParallel per row by thread count");
+    Function f = compiler.compile("round(x*3)-floor(y)/(x*x+1)+ceil(x/y)*sin(y)");
+    const size_t rows = suite.work(1 << 22);
+    std::vector<double> x = sample(rows, 42, -100, 100), y = sample(rows, 43, -100, 100), out(rows), serial(rows);
+    std::vector<const double*> columns;
+    for (const string& parameter: f.parameters())
+        columns.push_back(parameter == "x" ? x.data() : y.data());
+    f.evaluateBatch(columns, rows, serial.data());
+
+    for (const size_t threads: threadCounts())
+    {
+        ThreadPool pool(threads - 1);
+        suite.run("parallel", "threads=" + std::to_string(threads), rows, [&]()
+        {
+            f.evaluateParallel(columns, rows, out.data(), pool);
+        });
+        suite.metric("rows/s", 1e9 / suite.median());
+        double deviation = 0;
+        for (size_t i = 0; i < rows; ++i)
+            deviation = std::max(deviation, std::abs(out[i] - serial[i]));
+        suite.metric("max deviation", deviation);
+    }
+}
+
+// A family of functions of the same arguments built from common parts,
+// evaluated one by one and as a bundle.
+static void benchmarkBundle(Suite& suite, Compiler& compiler)
+{
+    suite.group("bundle: 32 functions sharing subexpressions, one row and batches");
+    const char* parts[] = {"sin(x)*cos(y)", "exp(-z*z)", "(x*x+y*y+1)", "(x-y)/(z*z+1)"};
+    std::vector<Function> functions;
+    for (size_t i = 0; i < 32; ++i)
+    {
+        const string k = std::to_string(i + 1);
+        functions.push_back(compiler.compile(string(parts[i % 4]) + "*" + k + "+" + parts[(i / 4) % 4]
+                                             + "/" + parts[(i + 1) % 4]));
+        functions.back().jitThreshold(0);
+    }
+    std::vector<const Function*> pointers;
+    for (const Function& f: functions)
+        pointers.push_back(&f);
+    const Bundle bundle(pointers);
+    size_t separate = 0;
+    for (const Function& f: functions)
+        separate += f.program().instructions.size();
+
+    const double args[] = {0.7, -1.3, 0.4};
+    std::vector<double> results(functions.size());
+    const size_t count = suite.work(20'000);
+    suite.run("bundle", "separate, one row", count, [&]()
+    {
+        double total = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            for (const Function& f: functions)
+            {
+                const double values[] = {args[0], args[1], args[2]};
+                double row[3];
+                for (size_t slot = 0; slot < f.parameters().size(); ++slot)
+                    row[slot] = values[f.parameters()[slot][0] - 'x'];
+                total += f.interpret(row);
+            }
+        }
+        sink = total;
+    });
+    suite.metric("instructions", (double) separate);
+    suite.run("bundle", "bundled, one row", count, [&]()
+    {
+        double total = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            double row[3];
+            for (size_t slot = 0; slot < bundle.parameters().size(); ++slot)
+                row[slot] = args[bundle.parameters()[slot][0] - 'x'];
+            bundle.evaluate(row, results);
+            total += results[i % results.size()];
+        }
+        sink = total;
+    });
+    suite.metric("instructions", (double) bundle.program().instructions.size());
+
+    const size_t rows = suite.work(1 << 16);
+    std::vector<std::vector<double>> data {sample(rows, 51, -2, 2), sample(rows, 52, -2, 2), sample(rows, 53, -2, 2)};
+    std::vector<std::vector<double>> out(functions.size(), std::vector<double>(rows));
+    std::vector<double*> columns;
+    for (auto& column: out)
+        columns.push_back(column.data());
+    auto arguments = [&](const std::vector<string>& parameters)
+    {
+        std::vector<const double*> result;
+        for (const string& parameter: parameters)
+            result.push_back(data[parameter[0] - 'x'].data());
+        return result;
+    };
+    suite.run("bundle", "separate, batch", rows, [&]()
+    {
+        for (size_t k = 0; k < functions.size(); ++k)
+            functions[k].evaluateBatch(arguments(functions[k].parameters()), rows, columns[k]);
+    });
+    suite.run("bundle", "bundled, batch", rows, [&]()
+    {
+        bundle.evaluateBatch(arguments(bundle.parameters()), rows, columns);
+    });
+
+    double deviation = 0;
+    std::vector<double> row(bundle.parameters().size());
+    for (size_t slot = 0; slot < row.size(); ++slot)
+        row[slot] = args[bundle.parameters()[slot][0] - 'x'];
+    bundle.evaluate(row, results);
+    for (size_t k = 0; k < functions.size(); ++k)
+        deviation = std::max(deviation, std::abs(results[k] - functions[k].evaluate(
+                Function::Args {{"x", args[0]}, {"y", args[1]}, {"z", args[2]}})));
+    suite.metric("max deviation", deviation);
+}
+
+// Runs the batch case of one expression in the given value type and returns
+// its results.
+template<typename Value>
+static std::vector<Value> batchIn(Suite& suite,
+                                  const string& type,
+                                  const char* expression,
+                                  const std::vector<std::vector<double>>& data)
+{
+    BasicGrammar<Value> grammar;
+    Calculator::setupGrammar(grammar);
+    const BasicFunction<Value> f = BasicCompiler<Value>(grammar).compile(expression);
+    const size_t rows = data.front().size();
+    std::vector<std::vector<Value>> converted;
+    for (const std::vector<double>& column: data)
+        converted.emplace_back(column.begin(), column.end());
+    std::vector<const Value*> columns;
+    for (size_t k = 0; k < f.parameters().size(); ++k)
+        columns.push_back(converted[k % converted.size()].data());
+    std::vector<Value> out(rows);
+    f.evaluateBatch(columns, rows, out.data());
+    suite.run("precision", string(expression) + " [" + type + "]", rows, [&]()
+    {
+        f.evaluateBatch(columns, rows, out.data());
+        sink = (double) out[rows / 2];
+    });
+    suite.metric("rows/s", 1e9 / suite.median());
+    return out;
+}
+
+// The largest error relative to the long double results.
+template<typename Value>
+static double relativeError(const std::vector<Value>& values, const std::vector<long double>& reference)
+{
+    double error = 0;
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+        if (reference[i] != 0 && std::isfinite((double) reference[i]))
+            error = std::max(error, (double) std::abs((reference[i] - values[i]) / reference[i]));
+    }
+    return error;
+}
+
+static void benchmarkPrecision(Suite& suite)
+{
+    suite.group("precision: batch throughput in float, double and long double");
+    const size_t rows = suite.work(1 << 18);
+    std::vector<std::vector<double>> data;
+    for (unsigned k = 0; k < 8; ++k)
+        data.push_back(sample(rows, 61 + k, 0.5, 2));
+    for (const char* expression: {corpus[0], corpus[2], corpus[4], corpus[5]})
+    {
+        const std::vector<long double> reference = batchIn<long double>(suite, "long double", expression, data);
+        const std::vector<double> doubles = batchIn<double>(suite, "double", expression, data);
+        suite.metric("max relative error", relativeError(doubles, reference));
+        const std::vector<float> floats = batchIn<float>(suite, "float", expression, data);
+        suite.metric("max relative error", relativeError(floats, reference));
+    }
+}
+
+// Readers looking up and evaluating saved functions while a writer keeps
+// redefining them, with the lock-free registry and with a map behind a
+// reader-writer lock.
+static void benchmarkRegistry(Suite& suite, Compiler& compiler)
+{
+    suite.group("registry: lookups and evaluations while a writer redefines functions");
+    const Function versions[] = {compiler.compile("x*y+1"), compiler.compile("sin(x)-y")};
+    std::vector<string> names;
+    Function::Library library;
+    for (size_t i = 0; i < 64; ++i)
+    {
+        names.push_back("f" + std::to_string(i));
+        library.insert_or_assign(names.back(), versions[0]);
+    }
+    Registry registry(library);
+    std::shared_mutex mutex;
+    const double args[] = {0.5, 2};
+    const size_t count = suite.work(100'000);
+
+    // Runs the readers to completion against a writer that defines a
+    // function every few microseconds, and returns how many it defined.
+    auto contend = [&](const size_t readers, auto read, auto write)
+    {
+        std::atomic<bool> done = false;
+        size_t writes = 0;
+        std::thread writer([&]()
+        {
+            while (!done.load())
+            {
+                write(names[writes % names.size()], versions[writes % 2]);
+                ++writes;
+                std::this_thread::sleep_for(std::chrono::microseconds(20));
+            }
+        });
+        std::vector<double> totals(readers);
+        std::vector<std::thread> threads;
+        for (size_t r = 0; r < readers; ++r)
+        {
+            threads.emplace_back([&, r]()
+            {
+                double total = 0;
+                for (size_t i = 0; i < count; ++i)
+                    total += read(names[(r * 7 + i) % names.size()]);
+                totals[r] = total;
+            });
+        }
+        for (std::thread& thread: threads)
+            thread.join();
+        done = true;
+        writer.join();
+        sink = totals.front();
+        return writes;
+    };
+
+    for (const size_t readers: {1, 2, 4, 8})
+    {
+        size_t writes = 0;
+        suite.run("registry", "lock-free, readers=" + std::to_string(readers), readers * count, [&]()
+        {
+            writes = contend(readers,
+                             [&](const string& name)
+                             {
+                                 const Registry::View view = registry.read();
+                                 return view.find(name)->evaluate(args);
+                             },
+                             [&](const string& name, const Function& function)
+                             {
+                                 registry.define(name, function);
+                             });
+        });
+        suite.metric("lookups/s", 1e9 / suite.median());
+        suite.metric("writes", (double) writes);
+        suite.metric("retired versions", (double) registry.retired());
+
+        suite.run("registry", "shared_mutex, readers=" + std::to_string(readers), readers * count, [&]()
+        {
+            writes = contend(readers,
+                             [&](const string& name)
+                             {
+                                 std::shared_lock<std::shared_mutex> lock(mutex);
+                                 return library.find(name)->second.evaluate(args);
+                             },
+                             [&](const string& name, const Function& function)
+                             {
+                                 std::unique_lock<std::shared_mutex> lock(mutex);
+                                 library.insert_or_assign(name, function);
+                             });
+        });
+        suite.metric("lookups/s", 1e9 / suite.median());
+        suite.metric("writes", (double) writes);
+    }
+}
+
+template<functions::FixedString Infix>
+static void benchmarkStatic(Suite& suite, Compiler& compiler)
+{
+    constexpr auto f = functions::compile<Infix>();
+    const Function g = compiler.compile(Infix.data);
+    if (!suite.enabled("static", Infix.data))
+        return;
+
+    std::vector<double> args(f.arity);
+    std::mt19937 random(7);
+    std::uniform_real_distribution<double> distribution(-10, 10);
+    size_t mismatches = 0;
+    for (size_t i = 0; i < 100'000; ++i)
+    {
+        for (double& arg: args)
+            arg = distribution(random);
+        const double a = f(args), b = g.interpret(args);
+        mismatches += std::memcmp(&a, &b, sizeof a) != 0;
+    }
+    if (mismatches)
+        throw std::logic_error("The static and runtime compilers disagree on '" + string(Infix.data) + "' for "
+                               + std::to_string(mismatches) + " of 100000 argument rows");
+
+    const size_t count = suite.work(10'000'000);
+    suite.run("static", Infix.data, count, [&]()
+    {
+        double total = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            args[0] = (double) i;
+            total += f(args);
+        }
+        sink = total;
+    });
+    suite.metric("mismatches", (double) mismatches);
+}
+
+// Piecewise formulas written with ?: against the same formulas written as
+// masks, which compute every piece. The batch cases feed conditions that are
+// uniform within a block (sorted x) and mixed within every block.
+static void benchmarkConditionals(Suite& suite, Compiler& compiler)
+{
+    suite.group("conditionals: ?: against arithmetic masks");
+    const std::pair<const char*, const char*> formulas[] = {
+            {"x < 1 ? exp(-x*y)*sin(z) : cos(x)*cos(y)",
+             "(x < 1)*exp(-x*y)*sin(z) + (x >= 1)*cos(x)*cos(y)"},
+            {"x < 0 ? sin(x)*y : x < 1 ? exp(x)*z : x < 2 ? cos(x*y) : x*x",
+             "(x < 0)*sin(x)*y + (x >= 0)*(x < 1)*exp(x)*z + (x >= 1)*(x < 2)*cos(x*y) + (x >= 2)*x*x"},
+            {"min(max(x*y, 0), 2)*exp(-z)", "((x*y > 0)*(x*y < 2)*x*y + (x*y >= 2)*2)*exp(-z)"}};
+    const size_t rows = suite.work(1 << 20);
+    std::vector<double> x = sample(rows, 11, -1, 3), y = sample(rows, 12, 0.5, 2), z = sample(rows, 13, 0.5, 2);
+    std::vector<double> sorted = x, out(rows);
+    std::sort(sorted.begin(), sorted.end());
+
+    for (const auto& [conditional, masked]: formulas)
+    {
+        for (const char* expression: {masked, conditional})
+        {
+            const string name = expression == masked ? "masked" : "?:";
+            benchmarkTiers(suite, "conditional", name + " " + conditional, expression, compiler);
+            Function f = compiler.compile(expression);
+            for (const bool uniform: {true, false})
+            {
+                std::vector<const double*> columns;
+                for (const string& parameter: f.parameters())
+                    columns.push_back(parameter == "x" ? (uniform ? sorted : x).data()
+                                                       : parameter == "y" ? y.data() : z.data());
+                suite.run("conditional", name + " " + conditional + (uniform ? " [batch uniform]" : " [batch mixed]"),
+                          rows, [&]()
+                {
+                    f.evaluateBatch(columns, rows, out.data());
+                    sink = out[rows / 2];
+                });
+                suite.metric("rows/s", 1e9 / suite.median());
+            }
+        }
+    }
+}
+
+static void benchmarkGradient(Suite& suite, Compiler& compiler)
+{
+    suite.group("gradient: forward mode vs central differences");
+    for (const char* expression: {"x*y+z", "(x+1)^2-3*x*y+y/z", "-x*(y-z)/(x*x+y*y+1)", "sin(x)*cos(y)+exp(-z)",
+                                  "a*b*c*d+e^(a-b)/(c*c+d*d+1)-sin(a*e)*cos(b+c)"})
+    {
+        Function f = compiler.compile(expression);
+        const size_t n = f.parameters().size();
+        std::vector<double> args(n), gradient(n), estimate(n);
+        for (size_t k = 0; k < n; ++k)
+            args[k] = 0.3 + 0.1 * (double) k;
+        const size_t count = suite.work(300'000);
+
+        suite.run("gradient", string(expression) + " [forward]", count, [&]()
+        {
+            double total = 0;
+            for (size_t i = 0; i < count; ++i)
+                total += f.differentiate(args, gradient);
+            sink = total;
+        });
+        suite.run("gradient", string(expression) + " [differences]", count, [&]()
+        {
+            double total = 0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                total += f.evaluate(args);
+                for (size_t k = 0; k < n; ++k)
+                {
+                    const double x = args[k];
+                    const double h = 1e-6 * std::max(1.0, std::abs(x));
+                    args[k] = x + h;
+                    const double above = f.evaluate(args);
+                    args[k] = x - h;
+                    const double below = f.evaluate(args);
+                    args[k] = x;
+                    estimate[k] = (above - below) / (2 * h);
+                }
+            }
+            sink = total;
+        });
+
+        f.differentiate(args, gradient);
+        double deviation = 0;
+        for (size_t k = 0; k < n; ++k)
+            deviation = std::max(deviation, std::abs(gradient[k] - estimate[k]) / std::max(1.0, std::abs(gradient[k])));
+        suite.metric("max deviation", deviation);
+    }
+}
+
+// Tabulation over x, y and z of functions whose costly parts depend on the
+// outer axes, point by point, as one batch over the materialized product
+// and as a grid that hoists what the inner loops do not change.
+static void benchmarkGrid(Suite& suite, Compiler& compiler)
+{
+    suite.group("grid: x by y by z tabulation per point");
+    const size_t inner = 256;
+    const size_t outer = std::max<size_t>(2, (size_t) std::sqrt((double) suite.work(1 << 20) / inner));
+    const Grid::Axis axes[] = {{"x", -2, 2, outer}, {"y", -2, 2, outer}, {"z", 0, 1, inner}};
+    const size_t points = outer * outer * inner;
+    std::vector<double> xs(points), ys(points), zs(points), out(points);
+    for (size_t i = 0; i < points; ++i)
+    {
+        xs[i] = axes[0].values[i / (outer * inner)];
+        ys[i] = axes[1].values[i / inner % outer];
+        zs[i] = axes[2].values[i % inner];
+    }
+
+    for (const char* expression: {"x*y+z",
+                                  "exp(-x*x)*sin(3*x)*cos(y)^2+sin(x*y)*exp(-y/2)*z+z*z",
+                                  "x < 0 ? sin(x)*cos(y)*z : exp(-x*y)*(z+1)"})
+    {
+        Function f = compiler.compile(expression);
+        const Grid grid(f, {std::begin(axes), std::end(axes)});
+        std::vector<double> args(3), expected(points);
+        const auto evaluate = [&](std::vector<double>& results)
+        {
+            for (size_t i = 0; i < points; ++i)
+            {
+                for (size_t k = 0; k < 3; ++k)
+                {
+                    const string& parameter = f.parameters()[k];
+                    args[k] = parameter == "x" ? xs[i] : parameter == "y" ? ys[i] : zs[i];
+                }
+                results[i] = f.evaluate(args);
+            }
+        };
+        const auto deviation = [&]()
+        {
+            double deviation = 0;
+            for (size_t i = 0; i < points; ++i)
+                deviation = std::max(deviation, std::abs(out[i] - expected[i]));
+            return deviation;
+        };
+        evaluate(expected);
+        suite.run("grid", string(expression) + " [evaluate per point]", points, [&]()
+        {
+            evaluate(out);
+            sink = out[points / 2];
+        });
+        std::vector<const double*> columns;
+        for (const string& parameter: f.parameters())
+            columns.push_back(parameter == "x" ? xs.data() : parameter == "y" ? ys.data() : zs.data());
+        suite.run("grid", string(expression) + " [batch of the product]", points, [&]()
+        {
+            f.evaluateBatch(columns, points, out.data());
+            sink = out[points / 2];
+        });
+        suite.run("grid", string(expression) + " [grid]", points, [&]()
+        {
+            grid.evaluate(out);
+            sink = out[points / 2];
+        });
+        suite.metric("points/s", 1e9 / suite.median());
+        suite.metric("max deviation", deviation());
+        suite.run("grid", string(expression) + " [grid parallel]", points, [&]()
+        {
+            grid.evaluateParallel(out);
+            sink = out[points / 2];
+        });
+        suite.metric("points/s", 1e9 / suite.median());
+        suite.metric("max deviation", deviation());
+    }
+}
+
+// A function of ten arguments called with some of them changed each time,
+// evaluated in full on each tier and incrementally.
+static void benchmarkIncremental(Suite& suite, Compiler& compiler)
+{
+    suite.group("incremental: re-evaluation with k of 10 arguments changed per call");
+    Function f = compiler.compile("sin(a)*cos(b)+exp(-c*c)*d+sin(e*f)/(g*g+1)+cos(g)*exp(-h)"
+                                  "+sin(i)*j-exp(-(a-j)^2)+cos(b*e)*sin(d+i)+(c<h ? sin(f) : cos(f))");
+    f.jitThreshold(0);
+    const size_t n = f.parameters().size();
+    const size_t count = suite.work(300'000);
+    std::vector<double> values = sample(4096, 17, -1, 1);
+    for (const size_t k: {1, 2, 5, 10})
+    {
+        // The same sequence of changes for every tier.
+        const auto change = [&](std::vector<double>& args, const size_t call)
+        {
+            for (size_t j = 0; j < k; ++j)
+                args[(call * 7 + j * 3) % n] = values[(call * k + j) % values.size()];
+        };
+        const string name = "k=" + std::to_string(k);
+        std::vector<double> args(n, 0.5);
+        suite.run("incremental", name + " [interpreter]", count, [&]()
+        {
+            double total = 0;
+            for (size_t call = 0; call < count; ++call)
+            {
+                change(args, call);
+                total += f.interpret(args);
+            }
+            sink = total;
+        });
+        if (f.jit())
+        {
+            suite.run("incremental", name + " [native]", count, [&]()
+            {
+                double total = 0;
+                for (size_t call = 0; call < count; ++call)
+                {
+                    change(args, call);
+                    total += f.evaluate(args);
+                }
+                sink = total;
+            });
+        }
+        Incremental incremental(f);
+        size_t recomputed = 0;
+        suite.run("incremental", name + " [incremental]", count, [&]()
+        {
+            double total = 0;
+            recomputed = 0;
+            for (size_t call = 0; call < count; ++call)
+            {
+                change(args, call);
+                incremental.set(args);
+                total += incremental.evaluate();
+                recomputed += incremental.recomputed();
+            }
+            sink = total;
+        });
+        suite.metric("recomputed share", (double) recomputed / (double) count / (double) incremental.size());
+
+        Incremental check(f);
+        std::fill(args.begin(), args.end(), 0.5);
+        double deviation = 0;
+        for (size_t call = 0; call < count; ++call)
+        {
+            change(args, call);
+            check.set(args);
+            deviation = std::max(deviation, std::abs(check.evaluate() - f.interpret(args)));
+        }
+        suite.metric("max deviation", deviation);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        Suite suite(argc, argv);
+        Grammar grammar;
+        Calculator::setupGrammar(grammar);
+        Compiler compiler(grammar);
+
+        benchmarkTokenize(suite, compiler);
+        benchmarkCompile(suite, compiler);
+        benchmarkGrammarSize(suite);
+        benchmarkBulk(suite, compiler);
+        benchmarkOperators(suite, compiler);
+        benchmarkExpressions(suite, compiler);
+        benchmarkArguments(suite, compiler);
+        benchmarkBatch(suite, compiler);
+        benchmarkRounding(suite, compiler);
+        benchmarkParallel(suite, compiler);
+        benchmarkBundle(suite, compiler);
+        benchmarkPrecision(suite);
+        benchmarkRegistry(suite, compiler);
+        suite.group("static: compile-time functions (bit-exact against the runtime)");
+        benchmarkStatic<"x*y+z">(suite, compiler);
+        benchmarkStatic<"(x+1)^2-3*x*y+y/z">(suite, compiler);
+        benchmarkStatic<"sin(x)*cos(y)+exp(-z)">(suite, compiler);
+        benchmarkStatic<"round(x*3)-floor(y)/(x*x+1)+ceil(x/y)*sin(y)">(suite, compiler);
+        benchmarkGradient(suite, compiler);
+        benchmarkConditionals(suite, compiler);
+        benchmarkGrid(suite, compiler);
+        benchmarkIncremental(suite, compiler);
+        suite.report();
+    }
+    catch (const std::exception& e)
+    {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,245 @@
+// functions_load socket [--serve threads] [--mode evals|batch|eval] [--connections n]
+//                       [--depth n] [--requests n] [--rows n] [--expression text]
+//
+// Keeps `depth` requests in flight on each of `connections` connections to a
+// server (see Protocol.hpp) and reports the throughput and the latency
+// percentiles. The expression is saved first; evals evaluates it by name one
+// row at a time, batch `rows` rows per request and eval compiles it anew with
+// every request. --serve starts a server with that many threads in this
+// process. Every result is checked against a local evaluation.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Calculator.hpp"
+#include "Protocol.hpp"
+#include "Server.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+
+struct Options
+{
+    string socket;
+    size_t serve = 0;
+    string mode = "evals";
+    size_t connections = 4;
+    size_t depth = 16;
+    size_t requests = 100000;
+    size_t rows = 256;
+    string expression = "x*y+sin(z)";
+
+    Options(const int argc, char* argv[])
+    {
+        if (argc < 2)
+            throw std::logic_error("Usage: functions_load socket [options]");
+        socket = argv[1];
+        for (int i = 2; i < argc; ++i)
+        {
+            const string option = argv[i];
+            if (i + 1 >= argc)
+                throw std::logic_error("Missing value for " + option);
+            const string value = argv[++i];
+            if (option == "--serve")
+                serve = std::stoul(value);
+            else if (option == "--mode" && (value == "evals" || value == "batch" || value == "eval"))
+                mode = value;
+            else if (option == "--connections")
+                connections = std::max(1ul, std::stoul(value));
+            else if (option == "--depth")
+                depth = std::max(1ul, std::stoul(value));
+            else if (option == "--requests")
+                requests = std::stoul(value);
+            else if (option == "--rows")
+                rows = std::max(1ul, std::stoul(value));
+            else if (option == "--expression")
+                expression = value;
+            else
+                throw std::logic_error("Unknown option: " + option + " " + value);
+        }
+    }
+
+    [[nodiscard]] size_t rowsPerRequest() const
+    {
+        return mode == "batch" ? rows : 1;
+    }
+};
+
+// The arguments of a row, reproducible from its position alone.
+static double argument(const size_t connection, const size_t id, const size_t row, const size_t k)
+{
+    return (double) ((connection * 7919 + id * 104729 + row * 31 + k * 13) % 2000) / 200.0 - 5.0;
+}
+
+struct Result
+{
+    std::vector<double> latencies;
+    size_t mismatches = 0;
+};
+
+static void drive(const Options& options, const Function& function, const size_t connection, Result& result)
+{
+    const size_t n = options.requests / options.connections + (connection < options.requests % options.connections);
+    const size_t rows = options.rowsPerRequest();
+    const size_t arity = function.parameters().size();
+    Protocol::Client client(options.socket);
+    std::vector<Clock::time_point> started(n);
+    std::vector<double> values(arity);
+    std::vector<double> column(rows);
+    string frames;
+
+    const auto request = [&](const uint32_t id)
+    {
+        Protocol::Message message(frames, id, options.mode == "evals" ? Protocol::EVALS
+                                              : options.mode == "batch" ? Protocol::BATCH : Protocol::EVAL);
+        if (options.mode == "eval")
+        {
+            message.text(options.expression).integer((uint32_t) arity);
+            for (size_t k = 0; k < arity; ++k)
+                message.text(function.parameters()[k]).number(argument(connection, id, 0, k));
+            return;
+        }
+        message.text("load");
+        if (options.mode == "batch")
+            message.integer((uint32_t) rows);
+        message.integer((uint32_t) arity);
+        for (size_t k = 0; k < arity; ++k)
+        {
+            for (size_t row = 0; row < rows; ++row)
+                column[row] = argument(connection, id, row, k);
+            message.numbers(column);
+        }
+    };
+
+    size_t sent = 0;
+    for (; sent < std::min(options.depth, n); ++sent)
+    {
+        started[sent] = Clock::now();
+        request((uint32_t) sent);
+    }
+    client.send(frames);
+
+    result.latencies.reserve(n);
+    for (size_t received = 0; received < n; ++received)
+    {
+        const Protocol::Frame response = client.receive();
+        const Clock::time_point now = Clock::now();
+        Protocol::Payload payload(response.payload);
+        if (response.code != Protocol::OK)
+            throw std::logic_error(string(payload.text()));
+        result.latencies.push_back(std::chrono::duration<double>(now - started[response.id]).count());
+        for (size_t row = 0; row < rows; ++row)
+        {
+            for (size_t k = 0; k < arity; ++k)
+                values[k] = argument(connection, response.id, row, k);
+            const double expected = function.evaluate(values);
+            const double value = payload.number();
+            if (value != expected && !(std::isnan(value) && std::isnan(expected)))
+                ++result.mismatches;
+        }
+
+        if (sent < n)
+        {
+            frames.clear();
+            started[sent] = Clock::now();
+            request((uint32_t) sent++);
+            client.send(frames);
+        }
+    }
+}
+
+static double percentile(const std::vector<double>& sorted, const double p)
+{
+    if (sorted.empty())
+        return 0;
+    return sorted[std::min(sorted.size() - 1, (size_t) (p * (double) sorted.size()))];
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        const Options options(argc, argv);
+        Grammar grammar;
+        Calculator::setupGrammar(grammar);
+
+        std::optional<Server> server;
+        std::thread serving;
+        if (options.serve)
+        {
+            server.emplace(options.socket, grammar, options.serve);
+            serving = std::thread([&]() { server->run(); });
+        }
+
+        Function function = Compiler(grammar).compile(options.expression);
+        {
+            Protocol::Client client(options.socket);
+            string request;
+            Protocol::Message(request, 0, Protocol::SAVE).text("load").text(options.expression);
+            client.call(request);
+        }
+
+        std::vector<Result> results(options.connections);
+        std::vector<std::thread> threads;
+        std::vector<string> errors(options.connections);
+        const Clock::time_point start = Clock::now();
+        for (size_t c = 0; c < options.connections; ++c)
+            threads.emplace_back([&, c]()
+            {
+                try
+                {
+                    drive(options, function, c, results[c]);
+                }
+                catch (const std::exception& e)
+                {
+                    errors[c] = e.what();
+                }
+            });
+        for (std::thread& thread: threads)
+            thread.join();
+        const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+        if (server)
+        {
+            server->stop();
+            serving.join();
+        }
+        for (const string& error: errors)
+        {
+            if (!error.empty())
+                throw std::logic_error(error);
+        }
+
+        std::vector<double> latencies;
+        size_t mismatches = 0;
+        for (const Result& result: results)
+        {
+            latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+            mismatches += result.mismatches;
+        }
+        std::sort(latencies.begin(), latencies.end());
+        const double requests = (double) latencies.size();
+
+        printf("%s of %s: %zu connection(s) x %zu in flight\n", options.mode.c_str(), options.expression.c_str(),
+               options.connections, options.depth);
+        printf("  %.0f requests in %.3f s: %.0f requests/s, %.0f rows/s\n", requests, elapsed,
+               requests / elapsed, requests * (double) options.rowsPerRequest() / elapsed);
+        printf("  latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+               percentile(latencies, 0.5) * 1e6, percentile(latencies, 0.9) * 1e6,
+               percentile(latencies, 0.99) * 1e6, percentile(latencies, 0.999) * 1e6,
+               (latencies.empty() ? 0 : latencies.back()) * 1e6);
+        printf("  %zu mismatch(es)\n", mismatches);
+        return mismatches ? 1 : 0;
+    }
+    catch (const std::exception& e)
+    {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+}
@@ -1,7 +1,53 @@
+#include <csignal>
+
 #include "Calculator.hpp"
+#include "Server.hpp"
+
+static Server* server = nullptr;
 
-int main()
+// 4_functions                                    - interactive dialogue
+// 4_functions stream expression input [output]   - evaluate over a file
+// 4_functions serve socket [threads]             - answer requests, see Protocol.hpp
+int main(int argc, char* argv[])
 {
+    if (argc >= 3 && string(argv[1]) == "serve")
+    {
+        try
+        {
+            Grammar grammar;
+            Calculator::setupGrammar(grammar);
+            Server instance(argv[2], grammar, argc > 3 ? std::stoul(argv[3]) : 2);
+            server = &instance;
+            std::signal(SIGINT, [](int) { server->stop(); });
+            std::signal(SIGTERM, [](int) { server->stop(); });
+            std::cerr << "Listening on " << argv[2] << endl;
+            instance.run();
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Error: " << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (argc >= 4 && string(argv[1]) == "stream")
+    {
+        try
+        {
+            Grammar grammar;
+            Calculator::setupGrammar(grammar);
+            Function function = Compiler(grammar).compile(argv[2]);
+            Stream::Report report = Stream::run(function, argv[3], argc > 4 ? argv[4] : "-");
+            std::cerr << report.rows << " rows in " << report.seconds << " s ("
+                      << (size_t) report.throughput() << " rows/s)" << endl;
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Error: " << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
     Calculator().dialogue();
     return 0;
-}
\ No newline at end of file
+}